@@ -1,33 +1,72 @@
 CFLAGS+=-std=c2x
 CPPFLAGS+=-D_GNU_SOURCE -I$(srcdir)/include
 
+ifneq ($(CONFIG_USDT),)
+CPPFLAGS+=-DCONFIG_USDT
+endif
+
 orm-libs-objs:= \
 	lib/data.o \
+	lib/process.o \
 	lib/sandbox.o \
 	lib/workdir.o
 
 orm-objs:=src/orm.o \
-	src/common/cmdpath.o
+	src/common/cmdpath.o \
+	src/common/dedup.o \
+	src/common/metrics.o \
+	src/common/mirror.o \
+	src/common/trace.o \
+	src/common/warmup.o \
+	src/common/watch.o
 
 lndworm-objs:=src/lndworm.o \
 	src/common/bsysexec.o \
+	src/common/buildlog.o \
 	src/common/cmdpath.o \
 	src/common/extract.o \
-	src/common/isdir.o
+	src/common/isdir.o \
+	src/common/metrics.o \
+	src/common/pathfilter.o \
+	src/common/prefetch.o \
+	src/common/trace.o \
+	src/common/warmup.o
 
 gitworm-objs:=src/gitworm.o \
 	src/common/bsysexec.o \
+	src/common/buildlog.o \
 	src/common/extract.o \
-	src/common/isdir.o
+	src/common/isdir.o \
+	src/common/metrics.o \
+	src/common/pathfilter.o \
+	src/common/trace.o
 
 src/orm.o src/lndworm.o: CPPFLAGS+= \
 	-DCONFIG_DEFAULT_SRCDIR_COMMAND='"$(CONFIG_DEFAULT_SRCDIR_COMMAND)"'
 
+src/orm.o: CPPFLAGS+= \
+	-DCONFIG_DEFAULT_SNAPSHOT_COMMAND='"$(CONFIG_DEFAULT_SNAPSHOT_COMMAND)"' \
+	-DCONFIG_WATCH_DEBOUNCE='$(CONFIG_WATCH_DEBOUNCE)'
+
 src/lndworm.o: CPPFLAGS+= \
-	-DCONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE='$(CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE)'
+	-DCONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE='$(CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE)' \
+	-DCONFIG_ARCHIVE_PREFETCH_THREADS='$(CONFIG_ARCHIVE_PREFETCH_THREADS)' \
+	-DCONFIG_ARCHIVE_PREFETCH_DEPTH='$(CONFIG_ARCHIVE_PREFETCH_DEPTH)' \
+	-DCONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH='$(CONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH)'
 
 src/gitworm.o: CPPFLAGS+= \
-	-DCONFIG_DEFAULT_GIT_EXEC_PATH='"$(CONFIG_DEFAULT_GIT_EXEC_PATH)"'
+	-DCONFIG_DEFAULT_GIT_EXEC_PATH='"$(CONFIG_DEFAULT_GIT_EXEC_PATH)"' \
+	-DCONFIG_ARCHIVE_INPUT_BLOCK_SIZE='$(CONFIG_ARCHIVE_INPUT_BLOCK_SIZE)'
+
+src/common/buildlog.o: CPPFLAGS+= \
+	-DCONFIG_BUILDLOG_BUFFER_SIZE='$(CONFIG_BUILDLOG_BUFFER_SIZE)' \
+	-DCONFIG_BUILDLOG_TAIL_SIZE='$(CONFIG_BUILDLOG_TAIL_SIZE)'
+
+src/common/dedup.o: CPPFLAGS+= \
+	-DCONFIG_DEDUP_MIN_SIZE='$(CONFIG_DEDUP_MIN_SIZE)'
+
+src/common/warmup.o: CPPFLAGS+= \
+	-DCONFIG_WARMUP_THREADS='$(CONFIG_WARMUP_THREADS)'
 
 src/common/extract.o: CPPFLAGS+= \
 	-DCONFIG_ARCHIVE_INPUT_BLOCK_SIZE='$(CONFIG_ARCHIVE_INPUT_BLOCK_SIZE)'
@@ -52,10 +91,55 @@ lndworm gitworm: CFLAGS+=$(libarchive-CFLAGS)
 lndworm gitworm: LDFLAGS+=$(libarchive-LDFLAGS)
 lndworm gitworm: LDLIBS+=$(libarchive-LDLIBS)
 
+libcrypto-CPPFLAGS:=$(shell pkg-config --cflags-only-I libcrypto)
+libcrypto-CFLAGS:=$(shell pkg-config --cflags-only-other libcrypto)
+libcrypto-LDFLAGS:=$(shell pkg-config --libs-only-L libcrypto)
+libcrypto-LDLIBS:=$(shell pkg-config --libs-only-l libcrypto)
+
+orm lndworm: CPPFLAGS+=$(libcrypto-CPPFLAGS)
+orm lndworm: CFLAGS+=$(libcrypto-CFLAGS)
+orm lndworm: LDFLAGS+=$(libcrypto-LDFLAGS)
+orm lndworm: LDLIBS+=$(libcrypto-LDLIBS)
+
+orm lndworm gitworm: CFLAGS+=-pthread
+orm lndworm gitworm: LDFLAGS+=-pthread
+
 host-bin+=orm lndworm gitworm
 host-lib+=$(orm-libs)
 clean-up+=$(host-bin) $(host-lib) $(orm-libs-objs) $(orm-objs) $(lndworm-objs) $(gitworm-objs)
 
+#############
+# Benchmark #
+#############
+
+bench-objs:=bench/sandbox.o
+
+BENCH_ITERATIONS?=1000
+
+.PHONY: bench
+
+bench: bench/sandbox bench/toolchain
+	$(v-e) BENCH
+	$(v-a) bench/sandbox -n $(BENCH_ITERATIONS) ./bench/toolchain
+
+# Linked statically, as it reaches the hidden hooks of liborm.
+bench/sandbox: $(bench-objs) liborm.a
+	$(v-e) CCLD $@
+	$(v-a) $(CC) $(CFLAGS) $(LDFLAGS) -o $@ $^ $(LDLIBS)
+
+bench/toolchain: $(srcdir)/bench/toolchain.sh
+	$(v-e) GEN $@
+	$(v-a) $(RM) -r -- $@ && sh $< $@
+
+clean-up+=bench/sandbox $(bench-objs)
+
+.PHONY: clean-bench
+
+clean: clean-bench
+clean-bench:
+	$(v-e) CLEAN bench/toolchain
+	$(v-a) $(RM) -r -- bench/toolchain
+
 ################
 # Manual pages #
 ################
@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include <stdio.h> /* printf, fprintf */
+#include <stdlib.h> /* exit, strtoul, realloc, qsort, mkdtemp */
+#include <stdnoreturn.h> /* noreturn */
+#include <stdint.h> /* uint64_t */
+#include <string.h> /* strchr, strcmp, strdup, strncpy */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* getopt, fork, execl, rmdir, _exit */
+#include <sys/mman.h> /* mmap */
+#include <sys/wait.h> /* waitpid */
+#include <err.h> /* err, errx, warn, warnx */
+
+#include <orm.h>
+#include <hooks.h>
+
+#define BENCH_STEPS_MAX 32
+
+/**
+ * Steps of an iteration, timed by the sandboxed child
+ * in memory shared with the parent.
+ */
+struct bench_iteration {
+	struct timespec last;
+	unsigned int count;
+	struct {
+		char name[32];
+		uint64_t nanoseconds;
+	} steps[BENCH_STEPS_MAX];
+};
+
+/**
+ * Samples of a step, across all iterations.
+ */
+struct bench_step {
+	char *name;
+	uint64_t *samples;
+	size_t count;
+};
+
+struct bench_args {
+	const char *toolchain, *bsys, *sysroot;
+	unsigned long iterations;
+	unsigned int asroot : 1, lean : 1;
+};
+
+static struct bench_iteration *bench_iteration;
+
+static uint64_t
+bench_elapsed(struct timespec *last) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const uint64_t nanoseconds = (now.tv_sec - last->tv_sec) * UINT64_C(1000000000) + now.tv_nsec - last->tv_nsec;
+	*last = now;
+
+	return nanoseconds;
+}
+
+static void
+bench_step(const char *step) {
+
+	if (bench_iteration->count < BENCH_STEPS_MAX) {
+		const unsigned int i = bench_iteration->count++;
+
+		strncpy(bench_iteration->steps[i].name, step, sizeof (bench_iteration->steps[i].name) - 1);
+		bench_iteration->steps[i].nanoseconds = bench_elapsed(&bench_iteration->last);
+	}
+}
+
+/**
+ * Record the sample of a step, steps are kept in their first seen order.
+ * @param steps Steps recorded so far.
+ * @param countp Number of steps.
+ * @param name Name of the step.
+ * @param nanoseconds Duration of the step.
+ * @return The steps.
+ */
+static struct bench_step *
+bench_record(struct bench_step *steps, size_t *countp, const char *name, uint64_t nanoseconds) {
+	struct bench_step *step = steps;
+
+	while (step != steps + *countp && strcmp(step->name, name) != 0) {
+		step++;
+	}
+
+	if (step == steps + *countp) {
+		steps = realloc(steps, ++*countp * sizeof (*steps));
+		if (steps == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		step = steps + *countp - 1;
+		*step = (struct bench_step) { .name = strdup(name) };
+		if (step->name == NULL) {
+			err(EXIT_FAILURE, "strdup");
+		}
+	}
+
+	step->samples = realloc(step->samples, (step->count + 1) * sizeof (*step->samples));
+	if (step->samples == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+	step->samples[step->count++] = nanoseconds;
+
+	return steps;
+}
+
+static int
+bench_compare(const void *lhs, const void *rhs) {
+	const uint64_t lhsvalue = *(const uint64_t *)lhs, rhsvalue = *(const uint64_t *)rhs;
+
+	return (lhsvalue > rhsvalue) - (lhsvalue < rhsvalue);
+}
+
+static double
+bench_percentile(const struct bench_step *step, unsigned int percentile) {
+	return step->samples[(step->count - 1) * percentile / 100] / 1000.0;
+}
+
+/**
+ * Print the latency distribution of each step, in microseconds.
+ * @param steps Steps to print, their samples are sorted.
+ * @param count Number of steps.
+ */
+static void
+bench_report(struct bench_step *steps, size_t count) {
+
+	printf("%-28s %8s %10s %10s %10s %10s %10s\n", "step (us)", "count", "min", "p50", "p90", "p99", "max");
+
+	for (size_t i = 0; i < count; i++) {
+		struct bench_step * const step = steps + i;
+
+		qsort(step->samples, step->count, sizeof (*step->samples), bench_compare);
+
+		printf("%-28s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", step->name, step->count,
+			bench_percentile(step, 0), bench_percentile(step, 50), bench_percentile(step, 90),
+			bench_percentile(step, 99), bench_percentile(step, 100));
+	}
+}
+
+/**
+ * Enter the sandbox and execute the bsys, iterations times, timing each step of orm_sandbox().
+ * The workdirs are bound to a scratch directory, and the sysroot, if any, as by orm(1).
+ * @param args Command line options.
+ * @param root Toolchain root directory.
+ */
+static void
+bench_run(const struct bench_args *args, const char *root) {
+	char scratch[] = "/tmp/orm-bench.XXXXXX";
+
+	if (mkdtemp(scratch) == NULL) {
+		err(EXIT_FAILURE, "mkdtemp '%s'", scratch);
+	}
+
+	const struct orm_sandbox_description description = {
+		.root = root, .sysroot = args->sysroot, .bsysdir = scratch,
+		.destdir = scratch, .objdir = scratch, .srcdir = scratch,
+		.asroot = args->asroot, .rosysroot = 1, .rosrcdir = 1, .lean = args->lean,
+	};
+
+	bench_iteration = mmap(NULL, sizeof (*bench_iteration), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (bench_iteration == MAP_FAILED) {
+		err(EXIT_FAILURE, "mmap");
+	}
+	orm_sandbox_step = bench_step;
+
+	struct bench_step *steps = NULL;
+	size_t count = 0;
+	for (unsigned long i = 0; i < args->iterations; i++) {
+		struct timespec start;
+
+		bench_iteration->count = 0;
+		clock_gettime(CLOCK_MONOTONIC, &bench_iteration->last);
+		start = bench_iteration->last;
+
+		const pid_t pid = fork();
+		if (pid < 0) {
+			err(EXIT_FAILURE, "fork");
+		}
+
+		if (pid == 0) {
+			if (orm_sandbox(&description, getuid(), getgid()) != 0) {
+				warn("Unable to enter toolbox");
+				_exit(EXIT_FAILURE);
+			}
+
+			execl(args->bsys, args->bsys, (char *)NULL);
+			warn("execl '%s'", args->bsys);
+			_exit(EXIT_FAILURE);
+		}
+
+		int wstatus;
+		if (waitpid(pid, &wstatus, 0) < 0) {
+			err(EXIT_FAILURE, "waitpid");
+		}
+
+		const uint64_t total = bench_elapsed(&start);
+		if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+			errx(EXIT_FAILURE, "Iteration %lu failed", i);
+		}
+
+		/* Whatever follows the last step, up to the reaping of the bsys. */
+		const uint64_t exec = bench_elapsed(&bench_iteration->last);
+
+		for (unsigned int j = 0; j < bench_iteration->count; j++) {
+			steps = bench_record(steps, &count, bench_iteration->steps[j].name, bench_iteration->steps[j].nanoseconds);
+		}
+		steps = bench_record(steps, &count, "exec", exec);
+		steps = bench_record(steps, &count, "total", total);
+	}
+
+	if (rmdir(scratch) != 0) {
+		warn("rmdir '%s'", scratch);
+	}
+
+	bench_report(steps, count);
+}
+
+noreturn static void
+bench_usage(const char *progname, int status) {
+
+	fprintf(stderr,
+		"usage: %1$s [-lr] [-n <iterations>] [-b <bsys>] [-u <sysroot>] <toolchain>\n"
+		"       %1$s -h\n",
+		progname);
+
+	exit(status);
+}
+
+static struct bench_args
+bench_parse_args(int argc, char **argv) {
+	struct bench_args args = {
+		.bsys = "/bin/true",
+		.iterations = 1000,
+	};
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, ":hlrn:b:u:")) >= 0) {
+		switch (c) {
+		case 'h': bench_usage(*argv, EXIT_SUCCESS);
+		case 'l': args.lean = 1; break;
+		case 'r': args.asroot = 1; break;
+		case 'n':
+			args.iterations = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || args.iterations == 0) {
+				warnx("Invalid number of iterations '%s'", optarg);
+				bench_usage(*argv, EXIT_FAILURE);
+			}
+			break;
+		case 'b': args.bsys = optarg; break;
+		case 'u': args.sysroot = optarg; break;
+		case ':':
+			warnx("Option -%c requires an operand", optopt);
+			bench_usage(*argv, EXIT_FAILURE);
+		case '?':
+			warnx("Unrecognized option -%c", optopt);
+			bench_usage(*argv, EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 1) {
+		warnx("Missing toolchain");
+		bench_usage(*argv, EXIT_FAILURE);
+	}
+
+	args.toolchain = argv[optind];
+
+	return args;
+}
+
+int
+main(int argc, char *argv[]) {
+	const struct bench_args args = bench_parse_args(argc, argv);
+	char *root;
+
+	/* As bsys, a toolchain with a slash is a path. */
+	if (strchr(args.toolchain, '/') != NULL) {
+		if ((root = strdup(args.toolchain)) == NULL) {
+			err(EXIT_FAILURE, "strdup");
+		}
+	} else if (orm_toolchain_path(args.toolchain, &root) != 0) {
+		err(EXIT_FAILURE, "Unable to find toolchain '%s'", args.toolchain);
+	}
+
+	bench_run(&args, root);
+
+	return EXIT_SUCCESS;
+}
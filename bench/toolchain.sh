@@ -0,0 +1,43 @@
+#!/bin/sh
+# SPDX-License-Identifier: AGPL-3.0-or-later
+# Generate a minimal toolchain for the sandbox benchmark, offline: the host's
+# true(1) and its shared libraries, with the layout orm_sandbox() expects.
+set -e
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 <toolchain>" >&2
+	exit 1
+fi
+
+root="$1"
+
+for true in /usr/bin/true /bin/true; do
+	if [ -x "$true" ]; then
+		break
+	fi
+done
+
+mkdir -p "$root"
+cd "$root"
+
+mkdir -p dev proc sys tmp root etc usr/bin usr/sbin \
+	var/bsys var/sysroot var/src var/obj var/dest
+ln -sf usr/bin bin
+
+cat > etc/passwd <<PASSWD
+root:x:0:0:root:/root:/bin/true
+bench:x:1000:1000:bench:/tmp:/bin/true
+PASSWD
+
+cat > etc/group <<GROUP
+root:x:0:
+bench:x:1000:
+GROUP
+
+cp -L "$true" usr/bin/true
+
+# Shared libraries and the dynamic loader, at their host path.
+ldd "$true" | sed -n 's|.*[[:space:]]\(/[^[:space:]]*\) (0x[0-9a-f]*)$|\1|p' | while read -r library; do
+	mkdir -p "./${library%/*}"
+	cp -L "$library" "./$library"
+done
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef HOOKS_H
+#define HOOKS_H
+
+/*
+ * Internal hooks of liborm, e.g. for benchmarks. They are hidden, thus not
+ * part of the shared library's interface, and only reachable when linking
+ * its static library.
+ */
+
+/**
+ * Hook called at the end of each step of orm_sandbox().
+ */
+extern __attribute__((visibility("hidden"))) void (*orm_sandbox_step)(const char *step);
+
+/* HOOKS_H */
+#endif
@@ -2,7 +2,8 @@
 #ifndef ORM_H
 #define ORM_H
 
-#include <sys/types.h> /* size_t, uid_t, gid_t */
+#include <sys/types.h> /* size_t, off_t, uid_t, gid_t, pid_t */
+#include <sys/resource.h> /* struct rusage */
 
 #define ORM_WORKDIR_PERSISTENT 0x01
 
@@ -10,16 +11,32 @@ struct orm_sandbox_description {
 	const char *root;
 	const char *sysroot, *bsysdir;
 	const char *destdir, *objdir, *srcdir;
+	const char *objupperdir;
 	unsigned int asroot : 1, rosysroot : 1, rosrcdir : 1;
+	unsigned int lean : 1;
 	size_t tmpsz;
 };
 
+struct orm_process {
+	pid_t pid;
+	int pidfd;
+	int outfd, errfd;
+};
+
 extern int orm_bsys_path(const char *bsys, char **pathp);
 extern int orm_toolchain_path(const char *toolchain, char **pathp);
 
 extern int orm_sandbox(const struct orm_sandbox_description *description, uid_t olduid, gid_t oldgid);
+extern int orm_sandbox_join(const struct orm_sandbox_description *description, pid_t pid);
+
+extern int orm_spawn(const struct orm_sandbox_description *description, char * const argv[], struct orm_process *process);
+extern int orm_process_wait(const struct orm_process *process, int options, int *wstatusp, struct rusage *rusagep);
+extern void orm_process_release(struct orm_process *process);
 
+extern int orm_cachedir(int flags, char **pathp);
 extern int orm_workdir(const char *workspace, const char *name, int flags, char **pathp);
+extern int orm_workspace_use(const char *workspace, int flags);
+extern int orm_workdir_collect(int flags, off_t budget, off_t *sizep);
 
 /* ORM_H */
 #endif
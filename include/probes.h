@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints (USDT) of the jormungandr provider, for perf(1) or bpftrace(8).
+ * Each probe is guarded by its semaphore, counting the tracers attached to it,
+ * so until attached a probe is a single test, and its arguments are not computed.
+ * Semaphores are defined once per linked object with ORM_PROBE_DEFINE(), by the
+ * source owning the probe, and hidden so they are not part of any interface.
+ * Probes are compiled out without CONFIG_USDT, or when <sys/sdt.h> is missing.
+ * Latencies are measured between a probe and its _done counterpart, on the same thread.
+ */
+#if defined(CONFIG_USDT) && __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h> /* DTRACE_PROBE* */
+
+#define ORM_PROBE_SEMAPHORE(name) \
+	__attribute__((visibility("hidden"))) volatile unsigned short jormungandr_##name##_semaphore
+#define ORM_PROBE_DEFINE(name) \
+	__attribute__((section(".probes"))) ORM_PROBE_SEMAPHORE(name)
+#define ORM_PROBE_ENABLED(name) \
+	__builtin_expect(jormungandr_##name##_semaphore != 0, 0)
+
+#define ORM_PROBE1(name, arg1) \
+	do { if (ORM_PROBE_ENABLED(name)) { DTRACE_PROBE1(jormungandr, name, arg1); } } while (0)
+#define ORM_PROBE2(name, arg1, arg2) \
+	do { if (ORM_PROBE_ENABLED(name)) { DTRACE_PROBE2(jormungandr, name, arg1, arg2); } } while (0)
+#define ORM_PROBE3(name, arg1, arg2, arg3) \
+	do { if (ORM_PROBE_ENABLED(name)) { DTRACE_PROBE3(jormungandr, name, arg1, arg2, arg3); } } while (0)
+
+/* Probes of liborm. */
+extern ORM_PROBE_SEMAPHORE(sandbox);
+extern ORM_PROBE_SEMAPHORE(sandbox_step);
+extern ORM_PROBE_SEMAPHORE(sandbox_done);
+
+/* Probes of archives extraction. */
+extern ORM_PROBE_SEMAPHORE(extract);
+extern ORM_PROBE_SEMAPHORE(extract_entry);
+extern ORM_PROBE_SEMAPHORE(extract_entry_done);
+extern ORM_PROBE_SEMAPHORE(extract_done);
+
+/* Probes of lndworm. */
+extern ORM_PROBE_SEMAPHORE(bsys);
+extern ORM_PROBE_SEMAPHORE(bsys_done);
+extern ORM_PROBE_SEMAPHORE(archive);
+extern ORM_PROBE_SEMAPHORE(archive_entry);
+extern ORM_PROBE_SEMAPHORE(archive_entry_done);
+extern ORM_PROBE_SEMAPHORE(archive_output_full);
+extern ORM_PROBE_SEMAPHORE(archive_done);
+#else
+/* Semaphores are never used, probes' arguments are referenced, but never evaluated. */
+#define ORM_PROBE_DEFINE(name) \
+	_Static_assert(1, #name)
+#define ORM_PROBE1(name, arg1) \
+	((void)sizeof (arg1))
+#define ORM_PROBE2(name, arg1, arg2) \
+	((void)sizeof (arg1), (void)sizeof (arg2))
+#define ORM_PROBE3(name, arg1, arg2, arg3) \
+	((void)sizeof (arg1), (void)sizeof (arg2), (void)sizeof (arg3))
+#endif
+
+/* PROBES_H */
+#endif
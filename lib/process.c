@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include <orm.h>
+
+#include <stdio.h> /* dprintf */
+#include <string.h> /* strerror */
+#include <unistd.h> /* fork, pipe2, dup2, read, ... */
+#include <signal.h> /* sigprocmask, SIGCHLD, ... */
+#include <fcntl.h> /* open, fcntl, ... */
+#include <sys/socket.h> /* socketpair, send, MSG_NOSIGNAL */
+#include <sys/wait.h> /* waitid, W_EXITCODE, ... */
+#include <sys/syscall.h> /* SYS_pidfd_open, SYS_waitid */
+#include <errno.h> /* errno, EAGAIN */
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/**
+ * Setup the sandbox in the newly spawned process and execute the command.
+ * Nothing is done before the parent holds our pidfd, signaled by a byte on syncfd.
+ * Errors are reported on the captured standard error, with status 127.
+ */
+static void
+orm_spawn_child(const struct orm_sandbox_description *description,
+	char * const argv[], uid_t uid, gid_t gid, int syncfd, int outfd, int errfd) {
+	sigset_t set;
+	int nullfd;
+	char sync;
+
+	if (read(syncfd, &sync, sizeof (sync)) != sizeof (sync)) {
+		_exit(127);
+	}
+	close(syncfd);
+
+	/* Event loops usually block signals to handle them through file descriptors. */
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	nullfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (nullfd < 0 || dup2(nullfd, STDIN_FILENO) < 0
+		|| dup2(outfd, STDOUT_FILENO) < 0 || dup2(errfd, STDERR_FILENO) < 0) {
+		_exit(127);
+	}
+
+	if (nullfd != STDIN_FILENO) {
+		close(nullfd);
+	}
+
+	if (orm_sandbox(description, uid, gid) != 0) {
+		dprintf(STDERR_FILENO, "orm_sandbox: %s\n", strerror(errno));
+		_exit(127);
+	}
+
+	execv(*argv, argv);
+	dprintf(STDERR_FILENO, "execv '%s': %s\n", *argv, strerror(errno));
+	_exit(127);
+}
+
+int
+orm_spawn(const struct orm_sandbox_description *description,
+	char * const argv[], struct orm_process *process) {
+	const uid_t uid = getuid();
+	const gid_t gid = getgid();
+	int syncfds[2], outfds[2], errfds[2];
+	const char sync = 0;
+	pid_t pid;
+	int pidfd;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, syncfds) != 0) {
+		return -1;
+	}
+
+	if (pipe2(outfds, O_CLOEXEC) != 0) {
+		goto spawn_err_outfds;
+	}
+
+	if (pipe2(errfds, O_CLOEXEC) != 0) {
+		goto spawn_err_errfds;
+	}
+
+	if (fcntl(outfds[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(errfds[0], F_SETFL, O_NONBLOCK) != 0) {
+		goto spawn_err_fork;
+	}
+
+	/* fork(2) rather than a raw clone3(2), as only the former runs
+	 * the C library's handlers making the child safe in a threaded caller.
+	 * The child may still be reaped by anyone ignoring SIGCHLD or waiting for any child,
+	 * so it waits on the sync socket, alive and its pid not recycled, until we hold its pidfd. */
+	pid = fork();
+	if (pid < 0) {
+		goto spawn_err_fork;
+	}
+
+	if (pid == 0) {
+		close(syncfds[1]);
+		orm_spawn_child(description, argv, uid, gid, syncfds[0], outfds[1], errfds[1]);
+	}
+
+	close(syncfds[0]);
+	close(outfds[1]);
+	close(errfds[1]);
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0 || send(syncfds[1], &sync, sizeof (sync), MSG_NOSIGNAL) != sizeof (sync)) {
+		const int errnum = errno;
+
+		/* Without its byte, the child exits on its own. */
+		close(syncfds[1]);
+		if (pidfd >= 0) {
+			syscall(SYS_waitid, P_PIDFD, pidfd, &(siginfo_t) { 0 }, WEXITED, NULL);
+			close(pidfd);
+		} else {
+			waitpid(pid, NULL, 0);
+		}
+		close(outfds[0]);
+		close(errfds[0]);
+		errno = errnum;
+
+		return -1;
+	}
+	close(syncfds[1]);
+
+	process->pid = pid;
+	process->pidfd = pidfd;
+	process->outfd = outfds[0];
+	process->errfd = errfds[0];
+
+	return 0;
+spawn_err_fork:
+	close(errfds[0]);
+	close(errfds[1]);
+spawn_err_errfds:
+	close(outfds[0]);
+	close(outfds[1]);
+spawn_err_outfds:
+	close(syncfds[0]);
+	close(syncfds[1]);
+	return -1;
+}
+
+int
+orm_process_wait(const struct orm_process *process, int options, int *wstatusp, struct rusage *rusagep) {
+	siginfo_t info = { 0 };
+	struct rusage rusage;
+
+	/* The C library's waitid(2) doesn't expose the kernel's resource usage argument. */
+	if (syscall(SYS_waitid, P_PIDFD, process->pidfd, &info, WEXITED | (options & WNOHANG), &rusage) != 0) {
+		return -1;
+	}
+
+	if (info.si_pid == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (wstatusp != NULL) {
+		switch (info.si_code) {
+		case CLD_EXITED: *wstatusp = W_EXITCODE(info.si_status, 0); break;
+		case CLD_KILLED: *wstatusp = W_EXITCODE(0, info.si_status); break;
+		default: *wstatusp = W_EXITCODE(0, info.si_status) | WCOREFLAG; break;
+		}
+	}
+
+	if (rusagep != NULL) {
+		*rusagep = rusage;
+	}
+
+	return 0;
+}
+
+void
+orm_process_release(struct orm_process *process) {
+
+	if (process->pidfd >= 0) {
+		close(process->pidfd);
+		process->pidfd = -1;
+	}
+
+	if (process->outfd >= 0) {
+		close(process->outfd);
+		process->outfd = -1;
+	}
+
+	if (process->errfd >= 0) {
+		close(process->errfd);
+		process->errfd = -1;
+	}
+}
@@ -1,14 +1,40 @@
 /* SPDX-License-Identifier: AGPL-3.0-or-later */
 #include <orm.h>
+#include <hooks.h>
+#include <probes.h>
 
 #include <stdio.h> /* fopen, fclose, snprintf */
 #include <stdlib.h> /* getenv, setenv, ... */
 #include <string.h> /* strlen, memcpy, ... */
+#include <signal.h> /* sigaction, kill, raise */
 #include <sys/mount.h> /* mount, ... */
-#include <unistd.h> /* write, close, chroot, ... */
-#include <sched.h> /* unshare */
+#include <sys/stat.h> /* mkdir */
+#include <sys/wait.h> /* waitpid */
+#include <unistd.h> /* write, close, chroot, symlink, ... */
+#include <sched.h> /* unshare, setns */
 #include <errno.h> /* errno */
 #include <pwd.h> /* fgetpwent_r */
+#include <fcntl.h> /* open */
+
+ORM_PROBE_DEFINE(sandbox);
+ORM_PROBE_DEFINE(sandbox_step);
+ORM_PROBE_DEFINE(sandbox_done);
+
+void (*orm_sandbox_step)(const char *step);
+
+/**
+ * Mark the end of a sandbox setup step.
+ * @param step Name of the step.
+ */
+static inline void
+sandbox_step(const char *step) {
+
+	ORM_PROBE1(sandbox_step, step);
+
+	if (orm_sandbox_step != NULL) {
+		orm_sandbox_step(step);
+	}
+}
 
 static inline void
 path_combine(char *buffer, const char *root, const char *path, size_t rootlen, size_t pathlen) {
@@ -24,7 +50,9 @@ path_combine(char *buffer, const char *root, const char *path, size_t rootlen, s
 static int
 remount_bind_path(const char *path, const char *src, unsigned long flags) {
 
-	if (mount(src, path, "", MS_REC | MS_BIND, NULL) != 0) {
+	/* Submounts locked by a less privileged user namespace can't be left behind. */
+	if (mount(src, path, "", MS_BIND | (flags & MS_REC), NULL) != 0
+		&& (errno != EINVAL || (flags & MS_REC) || mount(src, path, "", MS_BIND | MS_REC, NULL) != 0)) {
 		return -1;
 	}
 
@@ -69,6 +97,149 @@ mount_workdir(const char *root, const char *dst, const char *src, const void *tm
 	return 0;
 }
 
+/**
+ * Escape a path for overlayfs' mount options, which separate
+ * options with commas and lower layers with colons.
+ */
+static char *
+overlay_escape(char *buffer, const char *path) {
+
+	while (*path != '\0') {
+		if (*path == ',' || *path == ':' || *path == '\\') {
+			*buffer++ = '\\';
+		}
+		*buffer++ = *path++;
+	}
+
+	return buffer;
+}
+
+static int
+mount_overlay(const char *root, const char *dst, const char *lowerdir, const char *upperdir) {
+	static const char lower[] = "lowerdir=", upper[] = ",upperdir=", upperwork[] = "/upper,workdir=", work[] = "/work,userxattr";
+	const size_t rootlen = strlen(root), dstlen = strlen(dst);
+	char path[rootlen + dstlen + 1];
+	char data[sizeof (lower) + sizeof (upper) + sizeof (upperwork) + sizeof (work) + (strlen(lowerdir) + strlen(upperdir) * 2) * 2];
+	char *end = data;
+
+	path_combine(path, root, dst, rootlen, dstlen);
+
+	end = overlay_escape(mempcpy(end, lower, sizeof (lower) - 1), lowerdir);
+	end = overlay_escape(mempcpy(end, upper, sizeof (upper) - 1), upperdir);
+	end = overlay_escape(mempcpy(end, upperwork, sizeof (upperwork) - 1), upperdir);
+	memcpy(end, work, sizeof (work));
+
+	return mount("overlay", path, "overlay", MS_NOSUID | MS_NODEV, data);
+}
+
+static int
+mount_dev_node(const char *dev, const char *name) {
+	const size_t devlen = strlen(dev), namelen = strlen(name);
+	char path[devlen + 1 + namelen + 1], src[sizeof ("/dev/") + namelen];
+
+	*(char *)mempcpy(path, dev, devlen) = '/';
+	memcpy(path + devlen + 1, name, namelen + 1);
+	memcpy(mempcpy(src, "/dev/", sizeof ("/dev/") - 1), name, namelen + 1);
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	close(fd);
+
+	return mount(src, path, "", MS_BIND, NULL);
+}
+
+static int
+mount_dev(const char *root) {
+	static const char * const nodes[] = { "null", "zero", "full", "random", "urandom", "tty" };
+	static const char * const links[][2] = {
+		{ "ptmx", "pts/ptmx" }, { "fd", "/proc/self/fd" }, { "stdin", "/proc/self/fd/0" },
+		{ "stdout", "/proc/self/fd/1" }, { "stderr", "/proc/self/fd/2" },
+	};
+	const size_t rootlen = strlen(root);
+	char dev[rootlen + sizeof ("/dev")], path[rootlen + sizeof ("/dev/stdout")];
+
+	path_combine(dev, root, "/dev", rootlen, sizeof ("/dev") - 1);
+
+	if (mount("tmpfs", dev, "tmpfs", MS_NOSUID | MS_NOEXEC, "mode=0755") != 0) {
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < sizeof (nodes) / sizeof (*nodes); i++) {
+		if (mount_dev_node(dev, nodes[i]) != 0) {
+			return -1;
+		}
+	}
+
+	snprintf(path, sizeof (path), "%s/pts", dev);
+	if (mkdir(path, 0755) != 0 || mount("devpts", path, "devpts", MS_NOSUID | MS_NOEXEC, "newinstance,ptmxmode=0666,mode=0620") != 0) {
+		return -1;
+	}
+
+	snprintf(path, sizeof (path), "%s/shm", dev);
+	if (mkdir(path, 01777) != 0 || mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, "mode=01777") != 0) {
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < sizeof (links) / sizeof (*links); i++) {
+		snprintf(path, sizeof (path), "%s/%s", dev, links[i][0]);
+		if (symlink(links[i][1], path) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static pid_t sandbox_init;
+
+static void
+sandbox_kill(int signo) {
+	(void)signo;
+	kill(sandbox_init, SIGKILL);
+}
+
+/**
+ * Fork the init process of the sandbox's PID namespace, mounting its
+ * procfs. The calling process waits for it, and exits as it did,
+ * killing it (and thus the whole namespace) when interrupted.
+ */
+static int
+sandbox_lean_init(void) {
+	const pid_t pid = fork();
+
+	if (pid < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		return mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
+	}
+
+	const struct sigaction action = { .sa_handler = sandbox_kill };
+	sandbox_init = pid;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGQUIT, &action, NULL);
+
+	int wstatus;
+	while (waitpid(pid, &wstatus, 0) < 0) {
+		if (errno != EINTR) {
+			_exit(127);
+		}
+	}
+
+	if (WIFSIGNALED(wstatus)) {
+		signal(WTERMSIG(wstatus), SIG_DFL);
+		raise(WTERMSIG(wstatus));
+		_exit(128 + WTERMSIG(wstatus));
+	}
+
+	_exit(WEXITSTATUS(wstatus));
+}
+
 static int
 procfs_write_buffer(const char *path, const char *buffer, size_t length) {
 	int fd, ret;
@@ -140,10 +311,58 @@ passwd_setup(uid_t uid, gid_t gid) {
 	return ret;
 }
 
+static int
+sandbox_environment(uid_t newuid, gid_t newgid) {
+
+	/* Setup environment variables.
+	 * Save TERM, setup default PATH and user's passwd infos. */
+
+	char *term = getenv("TERM");
+	if (term != NULL) {
+		const size_t termsize = strlen(term) + 1;
+		char * const copy = alloca(termsize);
+		term = memcpy(copy, term, termsize);
+	}
+
+	if (clearenv() != 0) {
+		return -1;
+	}
+
+	if (putenv("PATH=/usr/bin:/usr/sbin") != 0) {
+		return -1;
+	}
+
+	if (term != NULL && setenv("TERM", term, 1) != 0) {
+		return -1;
+	}
+	sandbox_step("environment");
+
+	if (passwd_setup(newuid, newgid) != 0) {
+		return -1;
+	}
+	sandbox_step("passwd_setup");
+
+	/* Change working directory to either the new user's home directory or /. */
+	const char *workdir = getenv("HOME");
+
+	if (workdir == NULL) {
+		workdir = "/";
+	}
+
+	if (chdir(workdir) != 0) {
+		return -1;
+	}
+	sandbox_step("chdir");
+
+	return 0;
+}
+
 int
 orm_sandbox(const struct orm_sandbox_description *description, uid_t olduid, gid_t oldgid) {
 	const void *tmpfsdata;
 
+	ORM_PROBE1(sandbox, description->root);
+
 	if (description->tmpsz != 0) {
 		static const char format[] = "size=%zu";
 		const size_t size = sizeof (format) + sizeof (description->tmpsz) * 3;
@@ -158,120 +377,178 @@ orm_sandbox(const struct orm_sandbox_description *description, uid_t olduid, gid
 	 * New NS requires a NEWUSER if we want new user capabilties (CAP_SYS_ADMIN...) in the new filesystem.
 	 * To be authorized to use procfs fstype in mount, we need a new PID namespace,
 	 * which is only really applied when creating new processes. */
-	if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNS | (description->lean ? CLONE_NEWPID : 0)) != 0) {
 		return -1;
 	}
+	sandbox_step("unshare");
 
-	/* Remount toolchain root read-only. */
-	if (remount_bind(description->root, "/", description->root, MS_RDONLY) != 0) {
+	/* Map user and group ids, before populating any filesystem. */
+	id_t newuid, newgid;
+
+	if (description->asroot) {
+		newuid = 0;
+		newgid = 0;
+	} else {
+		newuid = 1000;
+		newgid = 1000;
+	}
+
+	if (procfs_id_map("/proc/self/uid_map", olduid, newuid) != 0) {
 		return -1;
 	}
 
-	/* Mount-bind host system's directories. */
-	if (remount_bind(description->root, "/dev", "/dev", 0) != 0) {
+	/* Only a process with CAP_SETGID in the parent namespace is allowed
+	 * to maintain setgroups to "allow" in a new namespace, "deny" setgroups from now on. */
+	if (procfs_write("/proc/self/setgroups", "deny") != 0) {
 		return -1;
 	}
 
-	if (remount_bind(description->root, "/proc", "/proc", 0) != 0) {
+	if (procfs_id_map("/proc/self/gid_map", oldgid, newgid) != 0) {
 		return -1;
 	}
+	sandbox_step("id_maps");
 
-	if (remount_bind(description->root, "/sys", "/sys", 0) != 0) {
+	/* Remount toolchain root read-only. */
+	if (remount_bind(description->root, "/", description->root, MS_REC | MS_RDONLY) != 0) {
 		return -1;
 	}
+	sandbox_step("remount_bind /");
 
-	/* Mount description's directories. */
-	if (mount_workdir(description->root, "/var/sysroot", description->sysroot, tmpfsdata, description->rosysroot ? MS_RDONLY : 0) != 0) {
+	if (description->lean) {
+		/* Minimal /dev, no /sys, and procfs is mounted by the namespace's init. */
+		if (mount_dev(description->root) != 0) {
+			return -1;
+		}
+		sandbox_step("mount_dev");
+	} else {
+		/* Mount-bind host system's directories. */
+		if (remount_bind(description->root, "/dev", "/dev", MS_REC) != 0) {
+			return -1;
+		}
+		sandbox_step("remount_bind /dev");
+
+		if (remount_bind(description->root, "/proc", "/proc", MS_REC) != 0) {
+			return -1;
+		}
+		sandbox_step("remount_bind /proc");
+
+		if (remount_bind(description->root, "/sys", "/sys", MS_REC) != 0) {
+			return -1;
+		}
+		sandbox_step("remount_bind /sys");
+	}
+
+	/* Mount description's directories, lean sandboxes don't import their submounts. */
+	const unsigned long rec = description->lean ? 0 : MS_REC;
+
+	if (mount_workdir(description->root, "/var/sysroot", description->sysroot, tmpfsdata, rec | (description->rosysroot ? MS_RDONLY : 0)) != 0) {
 		return -1;
 	}
+	sandbox_step("mount_workdir /var/sysroot");
 
-	if (mount_workdir(description->root, "/var/bsys", description->bsysdir, tmpfsdata, MS_RDONLY) != 0) {
+	if (mount_workdir(description->root, "/var/bsys", description->bsysdir, tmpfsdata, rec | MS_RDONLY) != 0) {
 		return -1;
 	}
+	sandbox_step("mount_workdir /var/bsys");
 
-	if (mount_workdir(description->root, "/var/dest", description->destdir, tmpfsdata, 0) != 0) {
+	if (mount_workdir(description->root, "/var/dest", description->destdir, tmpfsdata, rec) != 0) {
 		return -1;
 	}
+	sandbox_step("mount_workdir /var/dest");
 
-	if (mount_workdir(description->root, "/var/obj", description->objdir, tmpfsdata, 0) != 0) {
+	/* Overlaid objdirs are left untouched, their modifications landing in the upper directory. */
+	if (description->objupperdir != NULL) {
+		if (mount_overlay(description->root, "/var/obj", description->objdir, description->objupperdir) != 0) {
+			return -1;
+		}
+	} else if (mount_workdir(description->root, "/var/obj", description->objdir, tmpfsdata, rec) != 0) {
 		return -1;
 	}
+	sandbox_step("mount_workdir /var/obj");
 
-	if (mount_workdir(description->root, "/var/src", description->srcdir, tmpfsdata, description->rosrcdir ? MS_RDONLY : 0) != 0) {
+	if (mount_workdir(description->root, "/var/src", description->srcdir, tmpfsdata, rec | (description->rosrcdir ? MS_RDONLY : 0)) != 0) {
 		return -1;
 	}
+	sandbox_step("mount_workdir /var/src");
 
 	/* Enter toolbox filesystem. */
 	if (chroot(description->root) != 0) {
 		return -1;
 	}
+	sandbox_step("chroot");
 
 	/* Mount temporary files volatile. */
 	if (mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, tmpfsdata) != 0) {
 		return -1;
 	}
+	sandbox_step("mount /tmp");
 
-	/* Map user and group ids. */
-	id_t newuid, newgid;
-
-	if (description->asroot) {
-		newuid = 0;
-		newgid = 0;
-	} else {
-		newuid = 1000;
-		newgid = 1000;
+	if (description->lean) {
+		if (sandbox_lean_init() != 0) {
+			return -1;
+		}
+		sandbox_step("lean_init");
 	}
 
-	if (procfs_id_map("/proc/self/uid_map", olduid, newuid) != 0) {
-		return -1;
-	}
+	const int retval = sandbox_environment(newuid, newgid);
 
-	/* Only a process with CAP_SETGID in the parent namespace is allowed
-	 * to maintain setgroups to "allow" in a new namespace, "deny" setgroups from now on. */
-	if (procfs_write("/proc/self/setgroups", "deny") != 0) {
-		return -1;
-	}
+	ORM_PROBE1(sandbox_done, retval);
 
-	if (procfs_id_map("/proc/self/gid_map", oldgid, newgid) != 0) {
-		return -1;
-	}
+	return retval;
+}
 
-	/* Setup environment variables.
-	 * Save TERM, setup default PATH and user's passwd infos. */
+static int
+sandbox_open_namespace(pid_t pid, const char *name, int flags) {
+	char path[sizeof ("/proc//ns/") + sizeof (pid) * 3 + strlen(name)];
 
-	char *term = getenv("TERM");
-	if (term != NULL) {
-		const size_t termsize = strlen(term) + 1;
-		char * const copy = alloca(termsize);
-		term = memcpy(copy, term, termsize);
-	}
+	snprintf(path, sizeof (path), "/proc/%d/%s", pid, name);
 
-	if (clearenv() != 0) {
-		return -1;
-	}
+	return open(path, flags | O_CLOEXEC);
+}
 
-	if (putenv("PATH=/usr/bin:/usr/sbin") != 0) {
-		return -1;
+int
+orm_sandbox_join(const struct orm_sandbox_description *description, pid_t pid) {
+	int userfd, mntfd, rootfd, ret = -1;
+
+	/* Open everything now, as procfs is the sandbox's once we joined it. */
+	userfd = sandbox_open_namespace(pid, "ns/user", O_RDONLY);
+	if (userfd < 0) {
+		goto join_err_userfd;
 	}
 
-	if (term != NULL && setenv("TERM", term, 1) != 0) {
-		return -1;
+	mntfd = sandbox_open_namespace(pid, "ns/mnt", O_RDONLY);
+	if (mntfd < 0) {
+		goto join_err_mntfd;
 	}
 
-	if (passwd_setup(newuid, newgid) != 0) {
-		return -1;
+	rootfd = sandbox_open_namespace(pid, "root", O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0) {
+		goto join_err_rootfd;
 	}
 
-	/* Change working directory to either the new user's home directory or /. */
-	const char *workdir = getenv("HOME");
+	/* Joining the user namespace first grants us the capabilities to join its mount namespace. */
+	if (setns(userfd, CLONE_NEWUSER) != 0 || setns(mntfd, CLONE_NEWNS) != 0) {
+		goto join_err_setns;
+	}
 
-	if (workdir == NULL) {
-		workdir = "/";
+	/* Joining a mount namespace resets our root to the namespace's, enter the toolbox filesystem. */
+	if (fchdir(rootfd) != 0 || chroot(".") != 0) {
+		goto join_err_setns;
 	}
 
-	if (chdir(workdir) != 0) {
-		return -1;
+	/* User and group ids were mapped by the process owning the namespace. */
+	if (description->asroot) {
+		ret = sandbox_environment(0, 0);
+	} else {
+		ret = sandbox_environment(1000, 1000);
 	}
 
-	return 0;
+join_err_setns:
+	close(rootfd);
+join_err_rootfd:
+	close(mntfd);
+join_err_mntfd:
+	close(userfd);
+join_err_userfd:
+	return ret;
 }
@@ -1,10 +1,24 @@
 /* SPDX-License-Identifier: AGPL-3.0-or-later */
 #include <orm.h>
 
-#include <stdlib.h> /* realpath, getenv, alloca */
+#include <stdio.h> /* snprintf, dprintf */
+#include <stdlib.h> /* realpath, getenv, malloc, free, qsort */
+#include <stdint.h> /* intmax_t */
+#include <stdbool.h> /* bool, true, false */
 #include <string.h> /* strlen, memcpy, ... */
-#include <sys/stat.h> /* mkdir */
-#include <errno.h> /* errno, EEXIST, ... */
+#include <unistd.h> /* unlinkat, rmdir, ... */
+#include <dirent.h> /* fdopendir, readdir, closedir */
+#include <fcntl.h> /* open, openat */
+#include <fts.h> /* fts_open, fts_read, fts_close */
+#include <sys/stat.h> /* mkdir, fstat, futimens */
+#include <sys/file.h> /* flock */
+#include <errno.h> /* errno, EEXIST, EWOULDBLOCK, ... */
+
+struct orm_workspace_usage {
+	char *name;
+	struct timespec used;
+	off_t size;
+};
 
 static int
 orm_mkdirs(char *path) {
@@ -34,28 +48,20 @@ orm_mkdirs(char *path) {
 }
 
 int
-orm_workdir(const char *workspace, const char *name, int flags, char **pathp) {
-	char *cache, *path;
-
-	if (*workspace == '\0' || *workspace == '.' || strchr(workspace, '/') != NULL) {
-		errno = EINVAL;
-		return -1;
-	}
+orm_cachedir(int flags, char **pathp) {
+	static const char suffix[] = "/jormungandr";
+	const char *cache, *subdir = "";
 
 	if (flags & ORM_WORKDIR_PERSISTENT) {
 		cache = getenv("XDG_CACHE_HOME");
 		if (cache == NULL || *cache != '/') {
-			static const char cachedefault[] = "/.cache";
-			char * const home = getenv("HOME");
+			cache = getenv("HOME");
+			subdir = "/.cache";
 
-			if (home == NULL || *home != '/') {
+			if (cache == NULL || *cache != '/') {
 				errno = EINVAL;
 				return -1;
 			}
-
-			const size_t homelen = strlen(home);
-			cache = alloca(homelen + sizeof (cachedefault));
-			memcpy(mempcpy(cache, home, homelen), cachedefault, sizeof (cachedefault));
 		}
 	} else {
 		cache = getenv("XDG_RUNTIME_DIR");
@@ -65,18 +71,45 @@ orm_workdir(const char *workspace, const char *name, int flags, char **pathp) {
 		}
 	}
 
+	const size_t cachelen = strlen(cache), subdirlen = strlen(subdir);
+	char * const path = malloc(cachelen + subdirlen + sizeof (suffix));
+	if (path == NULL) {
+		return -1;
+	}
+
+	memcpy(mempcpy(mempcpy(path, cache, cachelen), subdir, subdirlen), suffix, sizeof (suffix));
+
+	*pathp = path;
+
+	return 0;
+}
+
+int
+orm_workdir(const char *workspace, const char *name, int flags, char **pathp) {
+	char *cache, *path;
+
+	if (*workspace == '\0' || *workspace == '.' || strchr(workspace, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (orm_cachedir(flags, &cache) != 0) {
+		return -1;
+	}
+
 	const size_t cachelen = strlen(cache),
 		workspacelen = strlen(workspace),
 		namelen = strlen(name);
-	static const char prefix[] = "/jormungandr/";
-	char buffer[cachelen + sizeof (prefix) + workspacelen + 1 + namelen];
+	char buffer[cachelen + 1 + workspacelen + 1 + namelen + 1];
 
 	path = mempcpy(buffer, cache, cachelen);
-	path = mempcpy(path, prefix, sizeof (prefix) - 1);
+	*path++ = '/';
 	path = mempcpy(path, workspace, workspacelen);
 	*path++ = '/';
 	memcpy(path, name, namelen + 1);
 
+	free(cache);
+
 	if (orm_mkdirs(buffer) != 0) {
 		return -1;
 	}
@@ -90,3 +123,358 @@ orm_workdir(const char *workspace, const char *name, int flags, char **pathp) {
 
 	return 0;
 }
+
+int
+orm_workspace_use(const char *workspace, int flags) {
+	char *workspacedir;
+	int fd;
+
+	/* Collections move workspaces out of the way while holding their lock,
+	 * only keep the lock if its workspace is still there once we got it. */
+	for (;;) {
+		struct stat st, current;
+
+		if (orm_workdir(workspace, ".", flags, &workspacedir) != 0) {
+			return -1;
+		}
+
+		const size_t workspacedirlen = strlen(workspacedir);
+		char usedpath[workspacedirlen + sizeof ("/.used")];
+		memcpy(mempcpy(usedpath, workspacedir, workspacedirlen), "/.used", sizeof ("/.used"));
+		free(workspacedir);
+
+		/* Not close-on-exec, the lock is held until the build ends. */
+		fd = open(usedpath, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+		if (fd < 0) {
+			if (errno == ENOENT) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (flock(fd, LOCK_SH) != 0 || fstat(fd, &st) != 0) {
+			goto use_error;
+		}
+
+		if (stat(usedpath, &current) != 0) {
+			if (errno != ENOENT) {
+				goto use_error;
+			}
+		} else if (st.st_dev == current.st_dev && st.st_ino == current.st_ino) {
+			break;
+		}
+		close(fd);
+	}
+
+	if (futimens(fd, NULL) != 0) {
+		goto use_error;
+	}
+
+	return fd;
+use_error: {
+		const int errcode = errno;
+		close(fd);
+		errno = errcode;
+	}
+	return -1;
+}
+
+static int
+orm_workspace_fts(const char *path, int remove, off_t *sizep) {
+	char * const paths[] = { (char *)path, NULL };
+	FTS * const fts = fts_open(paths, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR, NULL);
+	off_t size = 0;
+	FTSENT *ent;
+
+	if (fts == NULL) {
+		return -1;
+	}
+
+	while (ent = fts_read(fts), ent != NULL) {
+		switch (ent->fts_info) {
+		case FTS_D:
+			/* Read-only directories can't have their entries removed. */
+			if (remove) {
+				(void)chmod(ent->fts_accpath, 0700);
+			}
+			break;
+		case FTS_DP:
+			if (remove && rmdir(ent->fts_accpath) != 0) {
+				goto fts_error;
+			}
+			size += ent->fts_statp->st_blocks * 512;
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+			errno = ent->fts_errno;
+			goto fts_error;
+		default:
+			if (remove && unlink(ent->fts_accpath) != 0) {
+				goto fts_error;
+			}
+			if (ent->fts_statp != NULL) {
+				size += ent->fts_statp->st_blocks * 512;
+			}
+			break;
+		}
+	}
+
+	if (errno != 0) {
+		goto fts_error;
+	}
+
+	fts_close(fts);
+
+	if (sizep != NULL) {
+		*sizep = size;
+	}
+
+	return 0;
+fts_error: {
+		const int errcode = errno;
+		fts_close(fts);
+		errno = errcode;
+	}
+	return -1;
+}
+
+static int
+orm_workspace_measure(const char *cachedir, const char *name, off_t *sizep) {
+	const size_t cachedirlen = strlen(cachedir), namelen = strlen(name);
+	char path[cachedirlen + 1 + namelen + 1];
+
+	*(char *)mempcpy(path, cachedir, cachedirlen) = '/';
+	memcpy(path + cachedirlen + 1, name, namelen + 1);
+
+	return orm_workspace_fts(path, 0, sizep);
+}
+
+static int
+orm_workspace_usage(int cachefd, const char *cachedir, const char *name, struct orm_workspace_usage *usage) {
+	const int dirfd = openat(cachefd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+
+	if (dirfd < 0) {
+		return -1;
+	}
+
+	const int usedfd = openat(dirfd, ".used", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (usedfd < 0 || fstat(usedfd, &st) != 0) {
+		goto usage_error;
+	}
+	usage->used = st.st_mtim;
+
+	/* The cached size is exact if measured after the last use, else an estimate. */
+	bool cached = false, fresh = false;
+	const int sizefd = openat(dirfd, ".size", O_RDONLY | O_CLOEXEC);
+	if (sizefd >= 0) {
+		char buffer[32];
+		ssize_t length;
+
+		if (fstat(sizefd, &st) == 0 && (length = read(sizefd, buffer, sizeof (buffer) - 1)) > 0) {
+			buffer[length] = '\0';
+			usage->size = strtoll(buffer, NULL, 10);
+			cached = true;
+			fresh = st.st_mtim.tv_sec > usage->used.tv_sec
+				|| (st.st_mtim.tv_sec == usage->used.tv_sec && st.st_mtim.tv_nsec > usage->used.tv_nsec);
+		}
+		close(sizefd);
+	}
+
+	if (fresh) {
+		goto usage_done;
+	}
+
+	/* Workspaces in use can't be evicted, and are growing, keep their last size
+	 * until they are measured again once unused. Locking is only a probe,
+	 * a use while measuring makes the size stale again. */
+	if (flock(usedfd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno != EWOULDBLOCK) {
+			goto usage_error;
+		}
+
+		if (!cached) {
+			usage->size = 0;
+		}
+		goto usage_done;
+	}
+	(void)flock(usedfd, LOCK_UN);
+
+	if (orm_workspace_measure(cachedir, name, &usage->size) != 0) {
+		goto usage_error;
+	}
+
+	const int newfd = openat(dirfd, ".size.new", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (newfd >= 0) {
+		dprintf(newfd, "%jd\n", (intmax_t)usage->size);
+		close(newfd);
+		(void)renameat(dirfd, ".size.new", dirfd, ".size");
+	}
+
+usage_done:
+	close(usedfd);
+	close(dirfd);
+
+	usage->name = strdup(name);
+	if (usage->name == NULL) {
+		return -1;
+	}
+
+	return 0;
+usage_error: {
+		const int errcode = errno;
+		if (usedfd >= 0) {
+			close(usedfd);
+		}
+		close(dirfd);
+		errno = errcode;
+	}
+	return -1;
+}
+
+static int
+orm_workspace_usage_compare(const void *lhs, const void *rhs) {
+	const struct orm_workspace_usage * const lusage = lhs, * const rusage = rhs;
+
+	if (lusage->used.tv_sec != rusage->used.tv_sec) {
+		return lusage->used.tv_sec < rusage->used.tv_sec ? -1 : 1;
+	}
+
+	if (lusage->used.tv_nsec != rusage->used.tv_nsec) {
+		return lusage->used.tv_nsec < rusage->used.tv_nsec ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static int
+orm_workspace_evict(int cachefd, const char *cachedir, const char *name) {
+	const int dirfd = openat(cachefd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (dirfd < 0) {
+		return -1;
+	}
+
+	const int usedfd = openat(dirfd, ".used", O_RDWR | O_CLOEXEC);
+	close(dirfd);
+	if (usedfd < 0) {
+		return -1;
+	}
+
+	/* Never evict a workspace in use. */
+	if (flock(usedfd, LOCK_EX | LOCK_NB) != 0) {
+		close(usedfd);
+		return 1;
+	}
+
+	/* Move it out of the way while locked, so it can't be used again. */
+	const size_t cachedirlen = strlen(cachedir), namelen = strlen(name);
+	char trash[cachedirlen + sizeof ("/.gc-") + namelen];
+	snprintf(trash, sizeof (trash), "%s/.gc-%s", cachedir, name);
+
+	if (orm_workspace_fts(trash, 1, NULL) != 0 && errno != ENOENT) {
+		close(usedfd);
+		return -1;
+	}
+
+	if (renameat(cachefd, name, AT_FDCWD, trash) != 0) {
+		close(usedfd);
+		return -1;
+	}
+	close(usedfd);
+
+	return orm_workspace_fts(trash, 1, NULL);
+}
+
+int
+orm_workdir_collect(int flags, off_t budget, off_t *sizep) {
+	struct orm_workspace_usage *usages = NULL;
+	size_t count = 0, capacity = 0;
+	off_t size = 0;
+	char *cachedir;
+	int retval = -1;
+
+	if (orm_cachedir(flags, &cachedir) != 0) {
+		return -1;
+	}
+
+	const int cachefd = open(cachedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cachefd < 0) {
+		if (errno == ENOENT) {
+			retval = 0;
+		}
+		goto collect_free_cachedir;
+	}
+
+	const int listfd = dup(cachefd);
+	DIR * const dirp = listfd >= 0 ? fdopendir(listfd) : NULL;
+	if (dirp == NULL) {
+		goto collect_close_cachefd;
+	}
+
+	/* Workspaces never start with a dot, unlike the dedup store. */
+	const struct dirent *entry;
+	while (errno = 0, entry = readdir(dirp), entry != NULL) {
+		if (*entry->d_name == '.' || entry->d_type != DT_DIR) {
+			continue;
+		}
+
+		if (count == capacity) {
+			const size_t newcapacity = capacity == 0 ? 16 : capacity * 2;
+			struct orm_workspace_usage * const newusages = realloc(usages, newcapacity * sizeof (*usages));
+
+			if (newusages == NULL) {
+				goto collect_closedir;
+			}
+
+			usages = newusages;
+			capacity = newcapacity;
+		}
+
+		if (orm_workspace_usage(cachefd, cachedir, entry->d_name, usages + count) != 0) {
+			goto collect_closedir;
+		}
+
+		size += usages[count++].size;
+	}
+
+	if (errno != 0) {
+		goto collect_closedir;
+	}
+
+	/* Evict least recently used workspaces first. */
+	qsort(usages, count, sizeof (*usages), orm_workspace_usage_compare);
+
+	for (size_t i = 0; i < count && size > budget; i++) {
+		const int evicted = orm_workspace_evict(cachefd, cachedir, usages[i].name);
+
+		if (evicted < 0) {
+			goto collect_closedir;
+		}
+
+		if (evicted == 0) {
+			size -= usages[i].size;
+		}
+	}
+
+	if (sizep != NULL) {
+		*sizep = size;
+	}
+
+	retval = 0;
+collect_closedir: {
+		const int errcode = errno;
+		closedir(dirp);
+		while (count != 0) {
+			free(usages[--count].name);
+		}
+		free(usages);
+		errno = errcode;
+	}
+collect_close_cachefd:
+	close(cachefd);
+collect_free_cachedir:
+	free(cachedir);
+
+	return retval;
+}
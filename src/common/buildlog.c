@@ -0,0 +1,412 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "buildlog.h"
+
+#include <stdio.h> /* snprintf */
+#include <stdlib.h> /* malloc, free, EXIT_FAILURE */
+#include <stdint.h> /* intmax_t */
+#include <string.h> /* strlen, strcmp, memcpy, memchr */
+#include <pthread.h> /* pthread_create, pthread_join, ... */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* pipe2, read, write, close, dup2 */
+#include <fcntl.h> /* fcntl, O_CLOEXEC, O_NONBLOCK */
+#include <poll.h> /* poll */
+#include <errno.h> /* errno, EINTR, EAGAIN */
+#include <err.h> /* err, errx, warn, warnx */
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#define BUILDLOG_CHUNK_SIZE 65536
+
+struct buildlog {
+	pthread_mutex_t mutex;
+	pthread_cond_t notempty;
+	pthread_t reader, writer;
+	const char *path;
+	struct archive *out;
+	int fd, pipefds[2], stopfds[2];
+	struct timespec start;
+	bool linestart, eof, broken;
+	size_t head, consumed;
+	char ring[CONFIG_BUILDLOG_BUFFER_SIZE];
+};
+
+/**
+ * Compression filters of logs, detected from their extension.
+ */
+static const struct {
+	const char *extension, *filter;
+} buildlog_filters[] = {
+	{ ".gz", "gzip" },
+	{ ".bz2", "bzip2" },
+	{ ".xz", "xz" },
+	{ ".lz4", "lz4" },
+	{ ".zst", "zstd" },
+};
+
+static const char *
+buildlog_filter(const char *path) {
+	const size_t pathlen = strlen(path);
+
+	for (size_t i = 0; i < sizeof (buildlog_filters) / sizeof (*buildlog_filters); i++) {
+		const size_t extensionlen = strlen(buildlog_filters[i].extension);
+
+		if (pathlen > extensionlen
+			&& strcmp(path + pathlen - extensionlen, buildlog_filters[i].extension) == 0) {
+			return buildlog_filters[i].filter;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Append data to the ring, overwriting the oldest data when full.
+ * Must be called with the mutex held.
+ * @param log The log.
+ * @param data Data to append.
+ * @param size Size of data.
+ */
+static void
+buildlog_append(struct buildlog *log, const char *data, size_t size) {
+
+	while (size != 0) {
+		const size_t offset = log->head % sizeof (log->ring);
+		const size_t count = size < sizeof (log->ring) - offset ? size : sizeof (log->ring) - offset;
+
+		memcpy(log->ring + offset, data, count);
+		log->head += count;
+		data += count;
+		size -= count;
+	}
+}
+
+/**
+ * Drain the captured output into the ring as fast as it comes,
+ * prefixing each line with the time elapsed since the start.
+ * Once stopped, only what is already buffered in the pipe is read,
+ * as processes left behind by the bsys may keep it open indefinitely.
+ */
+static void *
+buildlog_read(void *data) {
+	struct buildlog * const log = data;
+	struct pollfd pollfds[] = {
+		{ .fd = log->pipefds[0], .events = POLLIN },
+		{ .fd = log->stopfds[0], .events = POLLIN },
+	};
+	char buffer[BUILDLOG_CHUNK_SIZE];
+	bool stopped = false;
+	ssize_t readval;
+
+	while (true) {
+		if (!stopped) {
+			if (poll(pollfds, sizeof (pollfds) / sizeof (*pollfds), -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				err(EXIT_FAILURE, "poll");
+			}
+
+			if (pollfds[1].revents != 0) {
+				if (fcntl(log->pipefds[0], F_SETFL, O_NONBLOCK) != 0) {
+					err(EXIT_FAILURE, "fcntl");
+				}
+				stopped = true;
+			} else if (pollfds[0].revents == 0) {
+				continue;
+			}
+		}
+
+		readval = read(log->pipefds[0], buffer, sizeof (buffer));
+		if (readval == 0) {
+			break;
+		}
+
+		if (readval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (stopped && errno == EAGAIN) {
+				break;
+			}
+			err(EXIT_FAILURE, "read");
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		intmax_t seconds = now.tv_sec - log->start.tv_sec;
+		long nanoseconds = now.tv_nsec - log->start.tv_nsec;
+		if (nanoseconds < 0) {
+			nanoseconds += 1000000000;
+			seconds--;
+		}
+
+		char stamp[sizeof ("[.] ") + sizeof (seconds) * 3 + 3];
+		const int stamplen = snprintf(stamp, sizeof (stamp), "[%6jd.%03ld] ", seconds, nanoseconds / 1000000);
+
+		const char *line = buffer, * const end = buffer + readval;
+		pthread_mutex_lock(&log->mutex);
+		while (line != end) {
+			const char * const newline = memchr(line, '\n', end - line);
+			const char * const next = newline != NULL ? newline + 1 : end;
+
+			if (log->linestart) {
+				buildlog_append(log, stamp, stamplen);
+			}
+			buildlog_append(log, line, next - line);
+
+			log->linestart = newline != NULL;
+			line = next;
+		}
+		pthread_cond_signal(&log->notempty);
+		pthread_mutex_unlock(&log->mutex);
+	}
+
+	pthread_mutex_lock(&log->mutex);
+	log->eof = true;
+	pthread_cond_signal(&log->notempty);
+	pthread_mutex_unlock(&log->mutex);
+
+	return NULL;
+}
+
+/**
+ * Write data to the log, compressed if requested.
+ * On errors, the log is abandoned rather than the build.
+ * @param log The log.
+ * @param data Data to write.
+ * @param size Size of data.
+ */
+static void
+buildlog_output(struct buildlog *log, const char *data, size_t size) {
+
+	while (!log->broken && size != 0) {
+		ssize_t written;
+
+		if (log->out != NULL) {
+			written = archive_write_data(log->out, data, size);
+			if (written < 0) {
+				warnx("Unable to write build log '%s': %s", log->path, archive_error_string(log->out));
+				log->broken = true;
+			}
+		} else {
+			written = write(log->fd, data, size);
+			if (written < 0 && errno != EINTR) {
+				warn("Unable to write build log '%s'", log->path);
+				log->broken = true;
+			}
+		}
+
+		if (written > 0) {
+			data += written;
+			size -= written;
+		}
+	}
+}
+
+/**
+ * Consume the ring into the log, at the log's pace.
+ * Data overwritten before being consumed is reported as dropped.
+ */
+static void *
+buildlog_write(void *data) {
+	struct buildlog * const log = data;
+	char chunk[BUILDLOG_CHUNK_SIZE];
+
+	pthread_mutex_lock(&log->mutex);
+	while (true) {
+		while (log->consumed == log->head && !log->eof) {
+			pthread_cond_wait(&log->notempty, &log->mutex);
+		}
+
+		if (log->consumed == log->head) {
+			break;
+		}
+
+		size_t dropped = 0;
+		if (log->head - log->consumed > sizeof (log->ring)) {
+			dropped = log->head - sizeof (log->ring) - log->consumed;
+			log->consumed += dropped;
+		}
+
+		const size_t offset = log->consumed % sizeof (log->ring);
+		size_t count = log->head - log->consumed;
+		if (count > sizeof (log->ring) - offset) {
+			count = sizeof (log->ring) - offset;
+		}
+		if (count > sizeof (chunk)) {
+			count = sizeof (chunk);
+		}
+
+		memcpy(chunk, log->ring + offset, count);
+		log->consumed += count;
+		pthread_mutex_unlock(&log->mutex);
+
+		if (dropped != 0) {
+			char marker[sizeof ("\n[ bytes dropped]\n") + sizeof (dropped) * 3];
+			const int markerlen = snprintf(marker, sizeof (marker), "\n[%zu bytes dropped]\n", dropped);
+
+			buildlog_output(log, marker, markerlen);
+		}
+		buildlog_output(log, chunk, count);
+
+		pthread_mutex_lock(&log->mutex);
+	}
+	pthread_mutex_unlock(&log->mutex);
+
+	return NULL;
+}
+
+/**
+ * Create a build log capture, the bsys' standard output and error
+ * are captured through a pipe into a ring, which is written to the
+ * log, compressed according to its extension, so the bsys never
+ * waits for the log's consumer.
+ * @param path Log path, for its compression and diagnostics.
+ * @param fd Log file descriptor.
+ * @return The capture, the bsys must buildlog_redirect(),
+ *  while its parent must buildlog_start() and buildlog_finish().
+ */
+struct buildlog *
+buildlog_create(const char *path, int fd) {
+	struct buildlog * const log = malloc(sizeof (*log));
+
+	if (log == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (pipe2(log->pipefds, O_CLOEXEC) != 0 || pipe2(log->stopfds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe");
+	}
+
+	log->path = path;
+	log->fd = fd;
+	log->linestart = true;
+	log->eof = false;
+	log->broken = false;
+	log->head = 0;
+	log->consumed = 0;
+	log->out = NULL;
+
+	const char * const filter = buildlog_filter(path);
+	if (filter != NULL) {
+		struct archive * const out = archive_write_new();
+		struct archive_entry * const entry = archive_entry_new();
+
+		if (archive_write_set_format_raw(out) != ARCHIVE_OK
+			|| archive_write_add_filter_by_name(out, filter) != ARCHIVE_OK
+			|| archive_write_set_bytes_in_last_block(out, 1) != ARCHIVE_OK
+			|| archive_write_open_fd(out, fd) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "Unable to create build log '%s': %s", path, archive_error_string(out));
+		}
+
+		archive_entry_set_pathname(entry, "log");
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_perm(entry, 0644);
+		if (archive_write_header(out, entry) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_write_header '%s': %s", path, archive_error_string(out));
+		}
+		archive_entry_free(entry);
+
+		log->out = out;
+	}
+
+	return log;
+}
+
+/**
+ * Redirect the standard output and error of the calling process
+ * into the capture, to be called by the bsys before its execution.
+ * @param log The capture.
+ */
+void
+buildlog_redirect(const struct buildlog *log) {
+
+	if (dup2(log->pipefds[1], STDOUT_FILENO) < 0 || dup2(log->pipefds[1], STDERR_FILENO) < 0) {
+		err(EXIT_FAILURE, "dup2");
+	}
+}
+
+/**
+ * Start capturing, in the parent of the bsys, once it was forked.
+ * @param log The capture.
+ */
+void
+buildlog_start(struct buildlog *log) {
+
+	close(log->pipefds[1]);
+
+	pthread_mutex_init(&log->mutex, NULL);
+	pthread_cond_init(&log->notempty, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &log->start);
+
+	errno = pthread_create(&log->reader, NULL, buildlog_read, log);
+	if (errno != 0) {
+		err(EXIT_FAILURE, "pthread_create");
+	}
+
+	errno = pthread_create(&log->writer, NULL, buildlog_write, log);
+	if (errno != 0) {
+		err(EXIT_FAILURE, "pthread_create");
+	}
+}
+
+/**
+ * Stop capturing once the bsys was waited for, and wait for the log to be
+ * written. Everything the bsys wrote is in the log, but not what processes
+ * it left behind write afterwards, so they cannot hold the build hostage.
+ * If the build failed, the end of its output, at most
+ * BUILDLOG_TAIL_SIZE bytes, is replayed on our standard error.
+ * @param log The capture, freed.
+ * @param failed Whether the build failed.
+ */
+void
+buildlog_finish(struct buildlog *log, bool failed) {
+
+	/* The reader is woken up by the hang up of the stop pipe. */
+	close(log->stopfds[1]);
+	pthread_join(log->reader, NULL);
+	pthread_join(log->writer, NULL);
+	close(log->stopfds[0]);
+	close(log->pipefds[0]);
+
+	if (log->out != NULL) {
+		if (!log->broken && archive_write_close(log->out) != ARCHIVE_OK) {
+			warnx("Unable to write build log '%s': %s", log->path, archive_error_string(log->out));
+		}
+		archive_write_free(log->out);
+	}
+
+	if (failed && log->head != 0) {
+		size_t size = CONFIG_BUILDLOG_TAIL_SIZE;
+		if (size > sizeof (log->ring)) {
+			size = sizeof (log->ring);
+		}
+		if (size > log->head) {
+			size = log->head;
+		}
+
+		warnx("Build failed, last %zu bytes of '%s':", size, log->path);
+
+		size_t offset = (log->head - size) % sizeof (log->ring);
+		while (size != 0) {
+			const size_t count = size < sizeof (log->ring) - offset ? size : sizeof (log->ring) - offset;
+			const ssize_t written = write(STDERR_FILENO, log->ring + offset, count);
+
+			if (written <= 0) {
+				break;
+			}
+			offset = (offset + written) % sizeof (log->ring);
+			size -= written;
+		}
+
+		if (log->ring[(log->head - 1) % sizeof (log->ring)] != '\n') {
+			(void)write(STDERR_FILENO, "\n", 1);
+		}
+	}
+
+	pthread_cond_destroy(&log->notempty);
+	pthread_mutex_destroy(&log->mutex);
+	free(log);
+}
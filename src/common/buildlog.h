@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_BUILDLOG_H
+#define COMMON_BUILDLOG_H
+
+#include <stdbool.h> /* bool */
+
+struct buildlog;
+
+extern struct buildlog *buildlog_create(const char *path, int fd);
+
+extern void buildlog_redirect(const struct buildlog *log);
+
+extern void buildlog_start(struct buildlog *log);
+
+extern void buildlog_finish(struct buildlog *log, bool failed);
+
+/* COMMON_BUILDLOG_H */
+#endif
@@ -2,22 +2,22 @@
 #include "cmdpath.h"
 
 #include <stdio.h> /* popen, ... */
-#include <stdlib.h> /* malloc, realpath */
+#include <stdlib.h> /* malloc, free, realpath */
 #include <string.h> /* strdupa */
 #include <limits.h> /* PATH_MAX */
 #include <ctype.h> /* isspace */
 #include <errno.h> /* ENOENT */
 
 /**
- * Run a command and returns the returned path in a string.
+ * Run a command and returns the first line it printed, trimmed.
  * @param command Command to run using popen(3).
- * @return On success, the absolute path of the source directory,
- *   must be free(3)'d. On error, NULL, setting errno appropriately.
+ * @return On success, the line, must be free(3)'d.
+ *   On error, NULL, setting errno appropriately.
  */
 char *
-cmdpath(const char *command) {
+cmdline(const char *command) {
 	FILE * const fp = popen(command, "r");
-	char *line, *path;
+	char *line;
 	ssize_t len;
 	size_t n;
 
@@ -35,6 +35,7 @@ cmdpath(const char *command) {
 	pclose(fp);
 
 	if (len < 0) {
+		free(line);
 		errno = ENOENT;
 		return NULL;
 	}
@@ -43,7 +44,24 @@ cmdpath(const char *command) {
 		line[len] = '\0';
 	}
 
-	path = strdupa(line);
+	return line;
+}
+
+/**
+ * Run a command and returns the returned path in a string.
+ * @param command Command to run using popen(3).
+ * @return On success, the absolute path of the source directory,
+ *   must be free(3)'d. On error, NULL, setting errno appropriately.
+ */
+char *
+cmdpath(const char *command) {
+	char * const line = cmdline(command);
+
+	if (line == NULL) {
+		return NULL;
+	}
+
+	char * const path = strdupa(line);
 
 	return realpath(path, line);
 }
@@ -2,6 +2,8 @@
 #ifndef CMDPATH_H
 #define CMDPATH_H
 
+extern char *cmdline(const char *command);
+
 extern char *cmdpath(const char *command);
 
 /* CMDPATH_H */
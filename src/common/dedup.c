@@ -0,0 +1,393 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "dedup.h"
+
+#include <stdio.h> /* sprintf, snprintf */
+#include <stdlib.h> /* calloc, free, EXIT_FAILURE */
+#include <string.h> /* memcpy */
+#include <stdbool.h> /* bool */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* read, linkat, unlinkat, ... */
+#include <dirent.h> /* fdopendir, readdir, dirfd, closedir */
+#include <fcntl.h> /* openat, AT_* */
+#include <errno.h> /* errno, ENOENT, ... */
+#include <sys/stat.h> /* fstatat, mkdirat, utimensat */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/xattr.h> /* fgetxattr, fsetxattr */
+#include <linux/fs.h> /* FICLONE, FIDEDUPERANGE */
+#include <err.h> /* err, warn, warnx */
+
+#include <openssl/evp.h>
+
+#include "mirror.h"
+
+#define DEDUP_DIGEST_SIZE 32
+#define DEDUP_XATTR "user.jormungandr.sha256"
+
+struct dedup {
+	int storefd;
+	struct timespec start;
+	bool noreflinks;
+	struct dedup_stats stats;
+};
+
+/**
+ * Digest of a file's content, cached in an extended
+ * attribute until its size or modification time change.
+ */
+struct dedup_digest {
+	struct timespec mtim;
+	off_t size;
+	unsigned char digest[DEDUP_DIGEST_SIZE];
+};
+
+/**
+ * Open the content-addressed store, and start a deduplication pass.
+ * @param store Directory of the store, created if missing.
+ * @return The deduplication pass.
+ */
+struct dedup *
+dedup_create(const char *store) {
+	struct dedup * const dedup = calloc(1, sizeof (*dedup));
+
+	if (dedup == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	if (mkdir(store, 0700) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir '%s'", store);
+	}
+
+	dedup->storefd = open(store, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dedup->storefd < 0) {
+		err(EXIT_FAILURE, "open '%s'", store);
+	}
+
+	/* Without shared extents, there is nothing to deduplicate. */
+	dedup->noreflinks = !mirror_reflinks(store);
+	if (dedup->noreflinks) {
+		warnx("Store '%s' doesn't share extents, unable to deduplicate", store);
+	}
+
+	/* Store entries are marked by their access time when used during the pass. */
+	if (clock_gettime(CLOCK_REALTIME, &dedup->start) != 0) {
+		err(EXIT_FAILURE, "clock_gettime");
+	}
+
+	return dedup;
+}
+
+static bool
+dedup_isdot(const char *name) {
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static DIR *
+dedup_opendir(int dirfd, const char *name) {
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dirp;
+
+	if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+		err(EXIT_FAILURE, "Unable to open directory '%s'", name);
+	}
+
+	return dirp;
+}
+
+/**
+ * Compute the digest of a file, or reuse its cached one.
+ * @param fd File descriptor, at offset 0.
+ * @param st Status of the file.
+ * @param digest Where to store the digest.
+ * @return true on success, false if the file couldn't be read.
+ */
+static bool
+dedup_digest(int fd, const struct stat *st, unsigned char digest[static DEDUP_DIGEST_SIZE]) {
+	struct dedup_digest cached;
+
+	if (fgetxattr(fd, DEDUP_XATTR, &cached, sizeof (cached)) == sizeof (cached)
+		&& cached.size == st->st_size
+		&& cached.mtim.tv_sec == st->st_mtim.tv_sec
+		&& cached.mtim.tv_nsec == st->st_mtim.tv_nsec) {
+		memcpy(digest, cached.digest, DEDUP_DIGEST_SIZE);
+		return true;
+	}
+
+	EVP_MD_CTX * const ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+		errx(EXIT_FAILURE, "Unable to initialize SHA-256 digest");
+	}
+
+	char buffer[65536];
+	ssize_t readval;
+	while (readval = read(fd, buffer, sizeof (buffer)), readval > 0) {
+		if (EVP_DigestUpdate(ctx, buffer, readval) != 1) {
+			errx(EXIT_FAILURE, "EVP_DigestUpdate");
+		}
+	}
+
+	if (readval < 0) {
+		EVP_MD_CTX_free(ctx);
+		return false;
+	}
+
+	if (EVP_DigestFinal_ex(ctx, digest, NULL) != 1) {
+		errx(EXIT_FAILURE, "EVP_DigestFinal_ex");
+	}
+	EVP_MD_CTX_free(ctx);
+
+	/* Best effort, the filesystem may not support user extended attributes. */
+	cached = (struct dedup_digest) { .mtim = st->st_mtim, .size = st->st_size };
+	memcpy(cached.digest, digest, DEDUP_DIGEST_SIZE);
+	(void)fsetxattr(fd, DEDUP_XATTR, &cached, sizeof (cached), 0);
+
+	return true;
+}
+
+/**
+ * Share the extents of a store entry with a file of identical content.
+ * @param entryfd Store entry.
+ * @param fd File to deduplicate.
+ * @param size Size of both files.
+ * @return 0 if extents are shared, 1 if contents differ,
+ *   -1 if the filesystem doesn't support it.
+ */
+static int
+dedup_extents(int entryfd, int fd, off_t size) {
+	struct {
+		struct file_dedupe_range range;
+		struct file_dedupe_range_info info;
+	} request;
+	off_t offset = 0;
+
+	while (offset < size) {
+		request.range = (struct file_dedupe_range) {
+			.src_offset = offset, .src_length = size - offset, .dest_count = 1,
+		};
+		request.info = (struct file_dedupe_range_info) {
+			.dest_fd = fd, .dest_offset = offset,
+		};
+
+		if (ioctl(entryfd, FIDEDUPERANGE, &request) != 0) {
+			if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EXDEV) {
+				return -1;
+			}
+			err(EXIT_FAILURE, "ioctl FIDEDUPERANGE");
+		}
+
+		if (request.info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+			return 1;
+		}
+
+		if (request.info.status < 0) {
+			errno = -request.info.status;
+			return errno == EOPNOTSUPP || errno == EINVAL ? -1 : 1;
+		}
+
+		if (request.info.bytes_deduped == 0) {
+			return 1;
+		}
+
+		offset += request.info.bytes_deduped;
+	}
+
+	return 0;
+}
+
+/**
+ * Create a store entry for a file, as a clone sharing its extents.
+ * @param dedup Deduplication pass.
+ * @param fd File descriptor of the file.
+ * @param path Path of the entry in the store.
+ */
+static void
+dedup_store(struct dedup *dedup, int fd, const char *path) {
+	const int entryfd = openat(dedup->storefd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0444);
+
+	if (entryfd < 0) {
+		err(EXIT_FAILURE, "Unable to create store entry '%s'", path);
+	}
+
+	/* Files are never replaced, so they keep their own inode, mode and modification time. */
+	if (ioctl(entryfd, FICLONE, fd) != 0) {
+		if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL && errno != EXDEV) {
+			err(EXIT_FAILURE, "ioctl FICLONE '%s'", path);
+		}
+
+		if (!dedup->noreflinks) {
+			warnx("Store and workdirs don't share extents, unable to deduplicate");
+			dedup->noreflinks = true;
+		}
+		close(entryfd);
+		return;
+	}
+
+	char procpath[32];
+	snprintf(procpath, sizeof (procpath), "/proc/self/fd/%d", entryfd);
+	if (linkat(AT_FDCWD, procpath, dedup->storefd, path, AT_SYMLINK_FOLLOW) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "Unable to link store entry '%s'", path);
+	}
+	close(entryfd);
+
+	dedup->stats.stored++;
+}
+
+/**
+ * Deduplicate a regular file against the store.
+ * @param dedup Deduplication pass.
+ * @param dirfd Parent directory of the file.
+ * @param name Name of the file.
+ * @param st Status of the file.
+ */
+static void
+dedup_file(struct dedup *dedup, int dirfd, const char *name, const struct stat *st) {
+	const int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	unsigned char digest[DEDUP_DIGEST_SIZE];
+
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			warn("openat '%s'", name);
+		}
+		return;
+	}
+
+	if (!dedup_digest(fd, st, digest)) {
+		warn("Unable to read '%s'", name);
+		close(fd);
+		return;
+	}
+
+	dedup->stats.files++;
+
+	char path[3 + DEDUP_DIGEST_SIZE * 2 + 1], *current = path;
+	for (unsigned int i = 0; i < DEDUP_DIGEST_SIZE; i++) {
+		current += sprintf(current, i == 1 ? "/%02x" : "%02x", digest[i]);
+	}
+
+	const int entryfd = openat(dedup->storefd, path, O_RDONLY | O_CLOEXEC);
+	if (entryfd < 0) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "openat '%s'", path);
+		}
+
+		path[2] = '\0';
+		if (mkdirat(dedup->storefd, path, 0700) != 0 && errno != EEXIST) {
+			err(EXIT_FAILURE, "mkdirat '%s'", path);
+		}
+		path[2] = '/';
+
+		dedup_store(dedup, fd, path);
+	} else {
+		if (dedup_extents(entryfd, fd, st->st_size) == 0) {
+			dedup->stats.shared++;
+			dedup->stats.bytes += st->st_size;
+		}
+
+		close(entryfd);
+	}
+
+	/* Mark the entry as used during this pass. */
+	const struct timespec times[] = { dedup->start, { .tv_nsec = UTIME_OMIT } };
+	if (utimensat(dedup->storefd, path, times, 0) != 0 && errno != ENOENT) {
+		err(EXIT_FAILURE, "utimensat '%s'", path);
+	}
+
+	close(fd);
+}
+
+static void
+dedup_directory(struct dedup *dedup, int parentfd, const char *name) {
+	DIR * const dirp = dedup_opendir(parentfd, name);
+	const int fd = dirfd(dirp);
+	const struct dirent *entry;
+
+	while (entry = readdir(dirp), entry != NULL) {
+		struct stat st;
+
+		if (dedup_isdot(entry->d_name)) {
+			continue;
+		}
+
+		if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			if (errno != ENOENT) {
+				warn("fstatat '%s'", entry->d_name);
+			}
+			continue;
+		}
+
+		switch (st.st_mode & S_IFMT) {
+		case S_IFDIR:
+			dedup_directory(dedup, fd, entry->d_name);
+			break;
+		case S_IFREG:
+			if (st.st_size >= CONFIG_DEDUP_MIN_SIZE) {
+				dedup_file(dedup, fd, entry->d_name, &st);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	closedir(dirp);
+}
+
+/**
+ * Deduplicate all regular files of a directory tree against the store.
+ * @param dedup Deduplication pass.
+ * @param root Root of the directory tree.
+ */
+void
+dedup_tree(struct dedup *dedup, const char *root) {
+
+	if (!dedup->noreflinks) {
+		dedup_directory(dedup, AT_FDCWD, root);
+	}
+}
+
+/**
+ * End a deduplication pass, removing store entries unused during it.
+ * @param dedup Deduplication pass.
+ * @param stats Where to store the pass statistics, may be NULL.
+ */
+void
+dedup_destroy(struct dedup *dedup, struct dedup_stats *stats) {
+	DIR * const dirp = dedup_opendir(dedup->storefd, ".");
+	const struct dirent *entry;
+
+	while (entry = readdir(dirp), entry != NULL) {
+		if (dedup_isdot(entry->d_name)) {
+			continue;
+		}
+
+		DIR * const subdirp = dedup_opendir(dedup->storefd, entry->d_name);
+		const int fd = dirfd(subdirp);
+		const struct dirent *subentry;
+
+		while (subentry = readdir(subdirp), subentry != NULL) {
+			struct stat st;
+
+			if (dedup_isdot(subentry->d_name)
+				|| fstatat(fd, subentry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+
+			if (st.st_atim.tv_sec < dedup->start.tv_sec
+				|| (st.st_atim.tv_sec == dedup->start.tv_sec && st.st_atim.tv_nsec < dedup->start.tv_nsec)) {
+				if (unlinkat(fd, subentry->d_name, 0) != 0) {
+					warn("unlinkat '%s/%s'", entry->d_name, subentry->d_name);
+				}
+			}
+		}
+
+		closedir(subdirp);
+	}
+
+	closedir(dirp);
+	close(dedup->storefd);
+
+	if (stats != NULL) {
+		*stats = dedup->stats;
+	}
+
+	free(dedup);
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_DEDUP_H
+#define COMMON_DEDUP_H
+
+#include <sys/types.h> /* off_t */
+
+struct dedup_stats {
+	size_t files, stored, shared;
+	off_t bytes;
+};
+
+struct dedup;
+
+extern struct dedup *dedup_create(const char *store);
+
+extern void dedup_tree(struct dedup *dedup, const char *root);
+
+extern void dedup_destroy(struct dedup *dedup, struct dedup_stats *stats);
+
+/* COMMON_DEDUP_H */
+#endif
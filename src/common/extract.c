@@ -3,11 +3,21 @@
 
 #include <stdlib.h> /* EXIT_FAILURE */
 #include <string.h> /* strlen, memcpy, ... */
+#include <pthread.h> /* pthread_create, pthread_join */
 #include <sys/mount.h> /* mount, ... */
-#include <err.h> /* err */
+#include <errno.h> /* errno */
+#include <err.h> /* err, warnx */
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <probes.h>
+
+#include "pathfilter.h"
+
+ORM_PROBE_DEFINE(extract);
+ORM_PROBE_DEFINE(extract_entry);
+ORM_PROBE_DEFINE(extract_entry_done);
+ORM_PROBE_DEFINE(extract_done);
 
 void
 archive_copy_to_disk(struct archive *in, struct archive *out) {
@@ -32,7 +42,7 @@ void
 extract_prepare(int fd, struct archive **outp, struct archive **inp) {
 	struct archive * const out = archive_write_disk_new(), * const in = archive_read_new();
 
-	if (archive_write_disk_set_options(out, ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME) != ARCHIVE_OK) {
+	if (archive_write_disk_set_options(out, ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SPARSE) != ARCHIVE_OK) {
 		errx(EXIT_FAILURE, "archive_write_disk_set_options: %s", archive_error_string(out));
 	}
 
@@ -61,7 +71,7 @@ extract_prepare(int fd, struct archive **outp, struct archive **inp) {
 	*inp = in;
 }
 
-void
+int64_t
 extract_finish(const char *output, unsigned int ro, int fd,
 	int status, struct archive *out, struct archive *in) {
 
@@ -72,6 +82,9 @@ extract_finish(const char *output, unsigned int ro, int fd,
 		errx(EXIT_FAILURE, "archive_read_next_header: %s", archive_error_string(in));
 	}
 
+	/* Uncompressed size of the archive. */
+	const int64_t size = archive_filter_bytes(in, 0);
+
 	archive_read_free(in);
 	archive_write_free(out);
 
@@ -80,29 +93,128 @@ extract_finish(const char *output, unsigned int ro, int fd,
 	}
 
 	close(fd);
+
+	return size;
 }
 
-void
-extract(const char *output, unsigned int ro, int fd) {
+/**
+ * Strip a path of its toplevel directory, if any, and of its leading slashes.
+ * @param path Path of an entry, or of its hardlink target.
+ * @param toplevel Toplevel directory to strip, or NULL.
+ * @param toplevellen Length of toplevel.
+ * @return The stripped path, or NULL if path is not under toplevel.
+ */
+static const char *
+extract_strip(const char *path, const char *toplevel, size_t toplevellen) {
+
+	if (toplevel != NULL) {
+		if (strncmp(path, toplevel, toplevellen) != 0) {
+			return NULL;
+		}
+		path += toplevellen;
+	}
+
+	while (*path == '/') {
+		path++;
+	}
+
+	return path;
+}
+
+/**
+ * Check whether an entry passes a filter. Filtered out entries are never
+ * written, their data being skipped (or at least, for compressed archives,
+ * discarded) when reading the next header.
+ * @param entry Entry to check.
+ * @param toplevel Toplevel directory to strip, or NULL.
+ * @param filter Filter to apply, or NULL.
+ * @return Whether the entry must be extracted.
+ */
+bool
+extract_filter(struct archive_entry *entry, const char *toplevel, const struct pathfilter *filter) {
+
+	if (filter == NULL || pathfilter_empty(filter)) {
+		return true;
+	}
+
+	const size_t toplevellen = toplevel != NULL ? strlen(toplevel) : 0;
+	const char * const pathname = extract_strip(archive_entry_pathname(entry), toplevel, toplevellen);
+
+	/* Left for rebasing to reject. */
+	if (pathname == NULL) {
+		return true;
+	}
+
+	if (!pathfilter_match(filter, pathname, archive_entry_filetype(entry) == AE_IFDIR)) {
+		return false;
+	}
+
+	/* A hardlink has no data of its own, its target must be extracted. */
+	const char *hardlink = archive_entry_hardlink(entry);
+	if (hardlink != NULL && (hardlink = extract_strip(hardlink, toplevel, toplevellen)) != NULL
+		&& !pathfilter_match(filter, hardlink, false)) {
+		warnx("Ignored hardlink '%s' as its target '%s' is filtered out", pathname, hardlink);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+extract_rebase(struct archive_entry *entry, const char *output, const char *toplevel) {
+	const size_t outputlen = strlen(output), toplevellen = toplevel != NULL ? strlen(toplevel) : 0;
+	const char * const pathname = extract_strip(archive_entry_pathname(entry), toplevel, toplevellen);
+	const char *hardlink = archive_entry_hardlink(entry);
+
+	if (pathname == NULL) {
+		return false;
+	}
+
+	/* Hardlinks targets are paths in the archive too, and must follow their target. */
+	if (hardlink != NULL) {
+		hardlink = extract_strip(hardlink, toplevel, toplevellen);
+		if (hardlink == NULL) {
+			return false;
+		}
+	}
+
+	const size_t pathnamelen = strlen(pathname);
+	const size_t hardlinklen = hardlink != NULL ? strlen(hardlink) : 0;
+	char outpathname[outputlen + 1 + pathnamelen + 1];
+	char outhardlink[outputlen + 1 + hardlinklen + 1];
+
+	*(char *)mempcpy(outpathname, output, outputlen) = '/';
+	memcpy(outpathname + outputlen + 1, pathname, pathnamelen + 1);
+
+	if (hardlink != NULL) {
+		*(char *)mempcpy(outhardlink, output, outputlen) = '/';
+		memcpy(outhardlink + outputlen + 1, hardlink, hardlinklen + 1);
+		archive_entry_copy_hardlink(entry, outhardlink);
+	}
+
+	archive_entry_copy_pathname(entry, outpathname);
+
+	return true;
+}
+
+int64_t
+extract(const char *output, unsigned int ro, int fd, const struct pathfilter *filter) {
 	struct archive *out, *in;
 
+	ORM_PROBE1(extract, output);
+
 	extract_prepare(fd, &out, &in);
 
 	int status;
 	struct archive_entry *entry;
-	const size_t outputlen = strlen(output);
 	while (status = archive_read_next_header(in, &entry), status == ARCHIVE_OK) {
-		const char *inpathname = archive_entry_pathname(entry);
-		while (*inpathname == '/') {
-			inpathname++;
+		if (!extract_filter(entry, NULL, filter)) {
+			continue;
 		}
-		const size_t inpathnamelen = strlen(inpathname);
 
-		char outpathname[outputlen + 1 + inpathnamelen + 1];
-		*(char *)mempcpy(outpathname, output, outputlen) = '/';
-		memcpy(outpathname + outputlen + 1, inpathname, inpathnamelen + 1);
+		extract_rebase(entry, output, NULL);
 
-		archive_entry_copy_pathname(entry, outpathname);
+		ORM_PROBE2(extract_entry, archive_entry_pathname(entry), archive_entry_size(entry));
 
 		status = archive_write_header(out, entry);
 		if (status != ARCHIVE_OK) {
@@ -110,7 +222,47 @@ extract(const char *output, unsigned int ro, int fd) {
 		}
 
 		archive_copy_to_disk(in, out);
+
+		ORM_PROBE2(extract_entry_done, archive_entry_pathname(entry), archive_entry_size(entry));
+	}
+
+	const int64_t size = extract_finish(output, ro, fd, status, out, in);
+
+	ORM_PROBE1(extract_done, output);
+
+	return size;
+}
+
+static void *
+extract_thread_run(void *data) {
+	struct extract_thread * const thread = data;
+
+	thread->size = thread->extract(thread->output, thread->ro, thread->fd, thread->filter);
+
+	return NULL;
+}
+
+/**
+ * Start an extraction on its own thread, so independent inputs
+ * are staged concurrently. Errors exit the process as usual.
+ * @param thread Extraction to start, its extract function,
+ *  output, ro, fd and filter must be set.
+ */
+void
+extract_start(struct extract_thread *thread) {
+
+	errno = pthread_create(&thread->thread, NULL, extract_thread_run, thread);
+	if (errno != 0) {
+		err(EXIT_FAILURE, "pthread_create");
 	}
+}
+
+/**
+ * Wait for an extraction started with extract_start() to end.
+ * @param thread The extraction, its size is then set.
+ */
+void
+extract_join(struct extract_thread *thread) {
 
-	extract_finish(output, ro, fd, status, out, in);
+	pthread_join(thread->thread, NULL);
 }
@@ -2,15 +2,39 @@
 #ifndef COMMON_EXTRACT_H
 #define COMMON_EXTRACT_H
 
+#include <stdbool.h> /* bool */
+#include <stdint.h> /* int64_t */
+#include <pthread.h> /* pthread_t */
+
 struct archive;
+struct archive_entry;
+struct pathfilter;
+
+struct extract_thread {
+	int64_t (*extract)(const char *output, unsigned int ro, int fd, const struct pathfilter *filter);
+	const char *output;
+	unsigned int ro;
+	int fd;
+	const struct pathfilter *filter;
+	int64_t size;
+	pthread_t thread;
+};
 
 extern void archive_copy_to_disk(struct archive *in, struct archive *out);
 
 extern void extract_prepare(int fd, struct archive **outp, struct archive **inp);
 
-extern void extract_finish(const char *output, unsigned int ro, int fd, int status, struct archive *out, struct archive *in);
+extern int64_t extract_finish(const char *output, unsigned int ro, int fd, int status, struct archive *out, struct archive *in);
+
+extern bool extract_filter(struct archive_entry *entry, const char *toplevel, const struct pathfilter *filter);
+
+extern bool extract_rebase(struct archive_entry *entry, const char *output, const char *toplevel);
+
+extern int64_t extract(const char *output, unsigned int ro, int fd, const struct pathfilter *filter);
+
+extern void extract_start(struct extract_thread *thread);
 
-extern void extract(const char *output, unsigned int ro, int fd);
+extern void extract_join(struct extract_thread *thread);
 
 /* COMMON_EXTRACT_H */
 #endif
@@ -0,0 +1,673 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "metrics.h"
+
+#include <stdio.h> /* fdopen, fprintf, snprintf, asprintf, getline, fclose, renameat2 */
+#include <stdlib.h> /* getenv, malloc, realloc, free, strtod, strtoll, qsort, EXIT_FAILURE */
+#include <stdint.h> /* intmax_t, uint64_t */
+#include <inttypes.h> /* PRIx64 */
+#include <string.h> /* strlen, strcpy, strdup, strncmp, strrchr, strstr, strchrnul, memcmp, memchr, memcpy, memmove */
+#include <unistd.h> /* write, pread, close, unlinkat */
+#include <fcntl.h> /* open, openat */
+#include <errno.h> /* errno, EEXIST, ENOENT */
+#include <sys/stat.h> /* fstat */
+#include <sys/random.h> /* getrandom */
+#include <err.h> /* err, warn, warnx */
+
+#define METRICS_LOG "jormungandr.log"
+#define METRICS_TEXTFILE "jormungandr.prom"
+#define METRICS_OFFSET "# jormungandr offset "
+
+/**
+ * Metric families, indexed by metric.
+ */
+static const struct {
+	const char *name, *help;
+	bool histogram;
+} metrics_families[] = {
+	[METRICS_SANDBOX_SECONDS] = { "jormungandr_sandbox_setup_seconds", "Time spent entering the sandbox.", true },
+	[METRICS_BSYS_SECONDS] = { "jormungandr_bsys_duration_seconds", "Time spent executing the bsys.", true },
+	[METRICS_EXTRACT_BYTES] = { "jormungandr_extract_bytes_total", "Uncompressed bytes of src and sysroot archives extracted.", false },
+	[METRICS_EXTRACT_SECONDS] = { "jormungandr_extract_seconds_total", "Time spent extracting src and sysroot archives.", false },
+	[METRICS_PACKAGE_BYTES] = { "jormungandr_package_bytes_total", "Bytes of files packaged into output archives.", false },
+	[METRICS_PACKAGE_SECONDS] = { "jormungandr_package_seconds_total", "Time spent packaging output archives.", false },
+	[METRICS_BUILDS] = { "jormungandr_builds_total", "Builds, by result of the bsys.", false },
+};
+
+/**
+ * Upper bounds of histograms' buckets, in seconds.
+ */
+static const double metrics_buckets[] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+	1, 2.5, 5, 10, 30, 60, 120, 300, 600, 1800, 3600,
+};
+
+struct metrics {
+	int dirfd, logfd;
+	char *labels, *records;
+	size_t length;
+};
+
+struct metrics_sample {
+	char *key;
+	double value;
+};
+
+struct metrics_textfile {
+	struct metrics_sample *samples;
+	size_t count, capacity;
+	off_t offset;
+};
+
+/**
+ * Parts of a sample's key, ordering samples so families are contiguous,
+ * and histograms' buckets precede their sum and count, by increasing bound.
+ */
+struct metrics_key {
+	const char *base, *labels;
+	size_t baselen, labelslen;
+	unsigned int rank;
+	double bound;
+};
+
+static void
+metrics_key(const char *key, struct metrics_key *parts) {
+	static const char * const suffixes[] = { "_bucket", "_sum", "_count" };
+	const char * const labels = strchrnul(key, '{');
+
+	*parts = (struct metrics_key) {
+		.base = key, .baselen = labels - key,
+		.labels = labels, .labelslen = strlen(labels),
+	};
+
+	for (unsigned int i = 0; i < sizeof (suffixes) / sizeof (*suffixes); i++) {
+		const size_t suffixlen = strlen(suffixes[i]);
+
+		if (parts->baselen > suffixlen && memcmp(labels - suffixlen, suffixes[i], suffixlen) == 0) {
+			parts->baselen -= suffixlen;
+			parts->rank = i;
+			break;
+		}
+	}
+
+	/* The bound is always the last label of a bucket. */
+	const char *bound = NULL, *next = labels;
+	while (next = strstr(next, "le=\""), next != NULL) {
+		bound = next++;
+	}
+
+	if (parts->rank == 0 && bound != NULL) {
+		parts->labelslen = bound - labels;
+		parts->bound = strtod(bound + sizeof ("le=\"") - 1, NULL);
+	}
+}
+
+static int
+metrics_compare_strings(const char *lhs, size_t lhslen, const char *rhs, size_t rhslen) {
+	const int cmp = memcmp(lhs, rhs, lhslen < rhslen ? lhslen : rhslen);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+
+	return (lhslen > rhslen) - (lhslen < rhslen);
+}
+
+static int
+metrics_compare(const char *lhs, const char *rhs) {
+	struct metrics_key lhsparts, rhsparts;
+	int cmp;
+
+	metrics_key(lhs, &lhsparts);
+	metrics_key(rhs, &rhsparts);
+
+	if ((cmp = metrics_compare_strings(lhsparts.base, lhsparts.baselen, rhsparts.base, rhsparts.baselen)) != 0
+		|| (cmp = metrics_compare_strings(lhsparts.labels, lhsparts.labelslen, rhsparts.labels, rhsparts.labelslen)) != 0) {
+		return cmp;
+	}
+
+	if (lhsparts.rank != rhsparts.rank) {
+		return lhsparts.rank < rhsparts.rank ? -1 : 1;
+	}
+
+	return (lhsparts.bound > rhsparts.bound) - (lhsparts.bound < rhsparts.bound);
+}
+
+static int
+metrics_sample_compare(const void *lhs, const void *rhs) {
+	const struct metrics_sample * const lhssample = lhs, * const rhssample = rhs;
+
+	return metrics_compare(lhssample->key, rhssample->key);
+}
+
+/**
+ * Append a sample to a textfile, without keeping it sorted.
+ * @param textfile The textfile.
+ * @param key Key of the sample, consumed.
+ * @param value Value of the sample.
+ * @return The appended sample.
+ */
+static struct metrics_sample *
+metrics_textfile_push(struct metrics_textfile *textfile, char *key, double value) {
+
+	if (key == NULL) {
+		err(EXIT_FAILURE, "strdup");
+	}
+
+	if (textfile->count == textfile->capacity) {
+		textfile->capacity = textfile->capacity != 0 ? textfile->capacity * 2 : 64;
+		textfile->samples = realloc(textfile->samples, textfile->capacity * sizeof (*textfile->samples));
+		if (textfile->samples == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+	}
+
+	struct metrics_sample * const sample = textfile->samples + textfile->count++;
+	sample->key = key;
+	sample->value = value;
+
+	return sample;
+}
+
+/**
+ * Find a sample of a sorted textfile, inserting it if missing.
+ * @param textfile The textfile.
+ * @param key Key of the sample.
+ * @return The sample's value.
+ */
+static double *
+metrics_textfile_sample(struct metrics_textfile *textfile, const char *key) {
+	size_t low = 0, high = textfile->count;
+
+	while (low < high) {
+		const size_t middle = low + (high - low) / 2;
+		const int cmp = metrics_compare(key, textfile->samples[middle].key);
+
+		if (cmp == 0) {
+			return &textfile->samples[middle].value;
+		}
+
+		if (cmp < 0) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+
+	metrics_textfile_push(textfile, strdup(key), 0);
+	const struct metrics_sample sample = textfile->samples[textfile->count - 1];
+	memmove(textfile->samples + low + 1, textfile->samples + low, (textfile->count - 1 - low) * sizeof (sample));
+	textfile->samples[low] = sample;
+
+	return &textfile->samples[low].value;
+}
+
+static void
+metrics_textfile_clear(struct metrics_textfile *textfile) {
+
+	for (size_t i = 0; i < textfile->count; i++) {
+		free(textfile->samples[i].key);
+	}
+
+	textfile->count = 0;
+	textfile->offset = 0;
+}
+
+/**
+ * Split a line as a key and a value, the key may contain spaces in its labels.
+ * @param line Line to split, modified.
+ * @param valuep Where the value is stored.
+ * @return The key, or NULL if the line is invalid.
+ */
+static char *
+metrics_split(char *line, double *valuep) {
+	char * const separator = strrchr(line, ' ');
+	char *end;
+
+	if (separator == NULL || separator == line) {
+		return NULL;
+	}
+
+	*separator = '\0';
+	*valuep = strtod(separator + 1, &end);
+	if (end == separator + 1 || *end != '\0') {
+		return NULL;
+	}
+
+	return line;
+}
+
+/**
+ * Load the last published textfile, and the offset of the log it folded.
+ * A missing or invalid textfile folds the log from its start.
+ * @param dirfd Metrics directory.
+ * @param textfile Where the samples and offset are loaded, sorted.
+ */
+static void
+metrics_textfile_load(int dirfd, struct metrics_textfile *textfile) {
+	const int fd = openat(dirfd, METRICS_TEXTFILE, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			warn("Unable to open metrics textfile '%s'", METRICS_TEXTFILE);
+		}
+		return;
+	}
+
+	FILE * const input = fdopen(fd, "r");
+	if (input == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+	bool folded = false;
+	while (length = getline(&line, &size, input), length > 0) {
+		double value;
+
+		if (line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		if (strncmp(line, METRICS_OFFSET, sizeof (METRICS_OFFSET) - 1) == 0) {
+			textfile->offset = strtoll(line + sizeof (METRICS_OFFSET) - 1, NULL, 10);
+			folded = true;
+		} else if (*line != '#' && metrics_split(line, &value) != NULL) {
+			metrics_textfile_push(textfile, strdup(line), value);
+		}
+	}
+	free(line);
+	fclose(input);
+
+	if (!folded) {
+		metrics_textfile_clear(textfile);
+	}
+
+	qsort(textfile->samples, textfile->count, sizeof (*textfile->samples), metrics_sample_compare);
+}
+
+/**
+ * Apply a record of the log to a textfile.
+ * Counters are incremented, histograms observe the value in all their buckets.
+ * @param textfile The textfile.
+ * @param record The record, modified.
+ */
+static void
+metrics_textfile_apply(struct metrics_textfile *textfile, char *record) {
+	double value;
+
+	if ((*record != 'c' && *record != 'h') || record[1] != ' ') {
+		return;
+	}
+
+	const char * const key = metrics_split(record + 2, &value);
+	if (key == NULL) {
+		return;
+	}
+
+	if (*record == 'c') {
+		*metrics_textfile_sample(textfile, key) += value;
+		return;
+	}
+
+	const size_t keylen = strlen(key);
+	const char * const labels = memchr(key, '{', keylen);
+	if (labels == NULL || key[keylen - 1] != '}') {
+		return;
+	}
+
+	const int namelen = labels - key, labelslen = keylen - namelen - 2;
+	char sample[keylen + sizeof ("_bucket,le=\"+Inf\"") + 32];
+
+	for (unsigned int i = 0; i <= sizeof (metrics_buckets) / sizeof (*metrics_buckets); i++) {
+		const bool inf = i == sizeof (metrics_buckets) / sizeof (*metrics_buckets);
+		char bound[32];
+
+		if (inf) {
+			strcpy(bound, "+Inf");
+		} else {
+			snprintf(bound, sizeof (bound), "%g", metrics_buckets[i]);
+		}
+
+		snprintf(sample, sizeof (sample), "%.*s_bucket{%.*s%sle=\"%s\"}",
+			namelen, key, labelslen, labels + 1, labelslen != 0 ? "," : "", bound);
+		*metrics_textfile_sample(textfile, sample) += inf || value <= metrics_buckets[i];
+	}
+
+	snprintf(sample, sizeof (sample), "%.*s_sum%s", namelen, key, labels);
+	*metrics_textfile_sample(textfile, sample) += value;
+
+	snprintf(sample, sizeof (sample), "%.*s_count%s", namelen, key, labels);
+	*metrics_textfile_sample(textfile, sample) += 1;
+}
+
+/**
+ * Fold the log records appended since the textfile was last published.
+ * Only complete records are folded, the others are still being appended.
+ * @param logfd The log.
+ * @param textfile The textfile.
+ */
+static void
+metrics_textfile_fold(int logfd, struct metrics_textfile *textfile) {
+	struct stat st;
+
+	if (fstat(logfd, &st) != 0) {
+		warn("Unable to stat metrics log '%s'", METRICS_LOG);
+		return;
+	}
+
+	/* The log was truncated, start over. */
+	if (st.st_size < textfile->offset) {
+		metrics_textfile_clear(textfile);
+	}
+
+	const size_t size = st.st_size - textfile->offset;
+	char * const buffer = malloc(size + 1);
+	if (buffer == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	size_t total = 0;
+	while (total < size) {
+		const ssize_t readval = pread(logfd, buffer + total, size - total, textfile->offset + total);
+
+		if (readval <= 0) {
+			if (readval < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		total += readval;
+	}
+
+	char *record = buffer, *newline;
+	while (newline = memchr(record, '\n', buffer + total - record), newline != NULL) {
+		*newline = '\0';
+		metrics_textfile_apply(textfile, record);
+		record = newline + 1;
+	}
+
+	textfile->offset += record - buffer;
+	free(buffer);
+}
+
+/**
+ * Read the log offset folded by a textfile.
+ * @param dirfd Metrics directory.
+ * @param name Name of the textfile in the directory.
+ * @return The offset, zero if none.
+ */
+static off_t
+metrics_textfile_offset(int dirfd, const char *name) {
+	const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	char header[sizeof (METRICS_OFFSET) + 24] = { 0 };
+	off_t offset = 0;
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	if (pread(fd, header, sizeof (header) - 1, 0) > 0
+		&& strncmp(header, METRICS_OFFSET, sizeof (METRICS_OFFSET) - 1) == 0) {
+		offset = strtoll(header + sizeof (METRICS_OFFSET) - 1, NULL, 10);
+	}
+
+	close(fd);
+
+	return offset;
+}
+
+/**
+ * Publish a textfile, atomically exchanged with the previous one,
+ * unless the latter folded further into the log.
+ * @param dirfd Metrics directory.
+ * @param textfile The textfile.
+ */
+static void
+metrics_textfile_store(int dirfd, const struct metrics_textfile *textfile) {
+	char temp[sizeof ("." METRICS_TEXTFILE ".") + 16];
+	int fd;
+
+	/* The sandbox's pid namespace makes pids unsuitable for unique names. */
+	do {
+		uint64_t random;
+
+		if (getrandom(&random, sizeof (random), 0) != sizeof (random)) {
+			warn("getrandom");
+			return;
+		}
+
+		snprintf(temp, sizeof (temp), "." METRICS_TEXTFILE ".%016" PRIx64, random);
+	} while (fd = openat(dirfd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644), fd < 0 && errno == EEXIST);
+
+	if (fd < 0) {
+		warn("Unable to create metrics textfile '%s'", temp);
+		return;
+	}
+
+	FILE * const output = fdopen(fd, "w");
+	if (output == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	fprintf(output, METRICS_OFFSET "%jd\n", (intmax_t)textfile->offset);
+
+	struct metrics_key previous;
+	for (size_t i = 0; i < textfile->count; i++) {
+		const struct metrics_sample * const sample = textfile->samples + i;
+		struct metrics_key parts;
+
+		metrics_key(sample->key, &parts);
+
+		if (i == 0 || metrics_compare_strings(previous.base, previous.baselen, parts.base, parts.baselen) != 0) {
+			for (unsigned int j = 0; j < sizeof (metrics_families) / sizeof (*metrics_families); j++) {
+				const char * const name = metrics_families[j].name;
+
+				if (strlen(name) == parts.baselen && memcmp(name, parts.base, parts.baselen) == 0) {
+					fprintf(output, "# HELP %s %s\n# TYPE %s %s\n", name, metrics_families[j].help,
+						name, metrics_families[j].histogram ? "histogram" : "counter");
+					break;
+				}
+			}
+		}
+		previous = parts;
+
+		fprintf(output, "%s %.15g\n", sample->key, sample->value);
+	}
+
+	const bool failed = ferror(output) != 0;
+	if (fclose(output) != 0 || failed) {
+		warn("Unable to write metrics textfile '%s'", temp);
+		unlinkat(dirfd, temp, 0);
+		return;
+	}
+
+	/* Folds of concurrent invocations may end in any order, yet counters
+	 * must not go backwards, they would look reset to Prometheus. Checking
+	 * the published offset before renaming would race with other publishers,
+	 * so the textfiles are exchanged, and the displaced one is checked: if it
+	 * folded further, it is exchanged back, and so on with whichever textfile
+	 * was displaced then. Offsets only grow along the loop, which thus ends,
+	 * with the textfile which folded the furthest published. A scrape between
+	 * the two exchanges may still see counters briefly go backwards,
+	 * which is why the published offset is checked first. */
+	off_t offset = textfile->offset;
+	if (metrics_textfile_offset(dirfd, METRICS_TEXTFILE) > offset) {
+		unlinkat(dirfd, temp, 0);
+		return;
+	}
+
+	while (true) {
+		if (renameat2(dirfd, temp, dirfd, METRICS_TEXTFILE, RENAME_EXCHANGE) != 0) {
+			if (errno == ENOENT) {
+				/* First publication, unless one happened meanwhile. */
+				if (renameat2(dirfd, temp, dirfd, METRICS_TEXTFILE, RENAME_NOREPLACE) == 0) {
+					return;
+				}
+				if (errno == EEXIST) {
+					continue;
+				}
+			}
+			warn("Unable to publish metrics textfile '%s'", METRICS_TEXTFILE);
+			break;
+		}
+
+		const off_t displaced = metrics_textfile_offset(dirfd, temp);
+		if (displaced <= offset) {
+			break;
+		}
+		offset = displaced;
+	}
+
+	unlinkat(dirfd, temp, 0);
+}
+
+/**
+ * Start collecting the metrics of an invocation, if enabled with
+ * ORM_METRICS_DIR. Its records are appended to the log of the directory,
+ * which is then folded into a Prometheus textfile. Opened now, as the host's
+ * filesystem is unreachable from the sandbox. Metrics are opportunistic,
+ * failures are only warned about.
+ * @param tool Name of the invoked tool, as a label.
+ * @param toolchain Name of the toolchain, as a label.
+ * @return The metrics, or NULL if disabled.
+ */
+struct metrics *
+metrics_open(const char *tool, const char *toolchain) {
+	const char * const directory = getenv("ORM_METRICS_DIR");
+
+	if (directory == NULL || *directory == '\0') {
+		return NULL;
+	}
+
+	const int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		warn("Unable to open metrics directory '%s'", directory);
+		return NULL;
+	}
+
+	const int logfd = openat(dirfd, METRICS_LOG, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (logfd < 0) {
+		warn("Unable to open metrics log '%s/%s'", directory, METRICS_LOG);
+		close(dirfd);
+		return NULL;
+	}
+
+	/* Label values escape backslashes, double quotes and line feeds. */
+	const size_t toolchainlen = strlen(toolchain);
+	char escaped[2 * toolchainlen + 1], *current = escaped;
+	for (size_t i = 0; i < toolchainlen; i++) {
+		switch (toolchain[i]) {
+		case '\\': *current++ = '\\'; *current++ = '\\'; break;
+		case '"': *current++ = '\\'; *current++ = '"'; break;
+		case '\n': *current++ = '\\'; *current++ = 'n'; break;
+		default: *current++ = toolchain[i]; break;
+		}
+	}
+	*current = '\0';
+
+	struct metrics * const metrics = malloc(sizeof (*metrics));
+	if (metrics == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (asprintf(&metrics->labels, "tool=\"%s\",toolchain=\"%s\"", tool, escaped) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	metrics->dirfd = dirfd;
+	metrics->logfd = logfd;
+	metrics->records = NULL;
+	metrics->length = 0;
+
+	return metrics;
+}
+
+/**
+ * Seconds elapsed since a monotonic start.
+ * @param start Start, from CLOCK_MONOTONIC.
+ * @return The elapsed seconds.
+ */
+double
+metrics_elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+metrics_append(struct metrics *metrics, enum metrics_metric metric, const char *labels, double value) {
+	char *record;
+	const int length = asprintf(&record, "%c %s{%s%s} %.17g\n", metrics_families[metric].histogram ? 'h' : 'c',
+		metrics_families[metric].name, metrics->labels, labels, value);
+
+	if (length < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	metrics->records = realloc(metrics->records, metrics->length + length);
+	if (metrics->records == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	memcpy(metrics->records + metrics->length, record, length);
+	metrics->length += length;
+	free(record);
+}
+
+/**
+ * Record a metric of the invocation, a counter's increment
+ * or a histogram's observation. Kept in memory until committed.
+ * @param metrics The metrics, or NULL if disabled.
+ * @param metric The metric.
+ * @param value Its value.
+ */
+void
+metrics_record(struct metrics *metrics, enum metrics_metric metric, double value) {
+
+	if (metrics != NULL) {
+		metrics_append(metrics, metric, "", value);
+	}
+}
+
+/**
+ * Count the build, and append all records in a single write, so concurrent
+ * invocations never interleave. The log is then folded into the textfile,
+ * both without locks, the textfile being exchanged atomically. When folds
+ * of concurrent invocations race, the last records may only be published
+ * by the next invocation.
+ * @param metrics The metrics, or NULL if disabled, freed.
+ * @param success Whether the bsys succeeded.
+ */
+void
+metrics_commit(struct metrics *metrics, bool success) {
+
+	if (metrics == NULL) {
+		return;
+	}
+
+	metrics_append(metrics, METRICS_BUILDS, success ? ",result=\"success\"" : ",result=\"failure\"", 1);
+
+	const ssize_t written = write(metrics->logfd, metrics->records, metrics->length);
+	if (written < 0 || (size_t)written != metrics->length) {
+		warn("Unable to append to metrics log '%s'", METRICS_LOG);
+	} else {
+		struct metrics_textfile textfile = { 0 };
+
+		metrics_textfile_load(metrics->dirfd, &textfile);
+		metrics_textfile_fold(metrics->logfd, &textfile);
+		metrics_textfile_store(metrics->dirfd, &textfile);
+
+		metrics_textfile_clear(&textfile);
+		free(textfile.samples);
+	}
+
+	close(metrics->logfd);
+	close(metrics->dirfd);
+	free(metrics->records);
+	free(metrics->labels);
+	free(metrics);
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_METRICS_H
+#define COMMON_METRICS_H
+
+#include <stdbool.h> /* bool */
+#include <time.h> /* struct timespec */
+
+enum metrics_metric {
+	METRICS_SANDBOX_SECONDS,
+	METRICS_BSYS_SECONDS,
+	METRICS_EXTRACT_BYTES,
+	METRICS_EXTRACT_SECONDS,
+	METRICS_PACKAGE_BYTES,
+	METRICS_PACKAGE_SECONDS,
+	METRICS_BUILDS,
+};
+
+struct metrics;
+
+extern struct metrics *metrics_open(const char *tool, const char *toolchain);
+
+extern double metrics_elapsed(const struct timespec *start);
+
+extern void metrics_record(struct metrics *metrics, enum metrics_metric metric, double value);
+
+extern void metrics_commit(struct metrics *metrics, bool success);
+
+/* COMMON_METRICS_H */
+#endif
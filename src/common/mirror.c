@@ -0,0 +1,439 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "mirror.h"
+
+#include <stdio.h> /* renameat */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memcmp */
+#include <stdbool.h> /* bool, true, false */
+#include <unistd.h> /* unlinkat, readlinkat, symlinkat, copy_file_range, ... */
+#include <dirent.h> /* fdopendir, readdir, closedir */
+#include <limits.h> /* PATH_MAX */
+#include <fcntl.h> /* openat, AT_* */
+#include <errno.h> /* errno, ENOENT, ... */
+#include <sys/stat.h> /* fstatat, mkdirat, futimens, fchmod */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/xattr.h> /* fgetxattr */
+#include <linux/fs.h> /* FICLONE */
+#include <err.h> /* err */
+
+/**
+ * Iterate over a directory, skipping its dot entries.
+ * @param dirfd Directory file descriptor, not consumed.
+ * @return The directory stream.
+ */
+static DIR *
+mirror_opendir(int dirfd) {
+	const int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dirp;
+
+	if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+		err(EXIT_FAILURE, "Unable to open directory");
+	}
+
+	return dirp;
+}
+
+static bool
+mirror_isdot(const char *name) {
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/**
+ * Remove a file, recursively if it is a directory.
+ * @param dirfd Parent directory file descriptor.
+ * @param name Name of the file in the parent directory.
+ */
+void
+mirror_remove(int dirfd, const char *name) {
+
+	if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) {
+		return;
+	}
+
+	if (errno != EISDIR) {
+		err(EXIT_FAILURE, "unlinkat '%s'", name);
+	}
+
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "openat '%s'", name);
+	}
+
+	/* Read-only directories can't have their entries removed. */
+	(void)fchmod(fd, 0700);
+
+	DIR * const dirp = mirror_opendir(fd);
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		if (!mirror_isdot(entry->d_name)) {
+			mirror_remove(fd, entry->d_name);
+		}
+	}
+	closedir(dirp);
+	close(fd);
+
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0) {
+		err(EXIT_FAILURE, "unlinkat '%s'", name);
+	}
+}
+
+/**
+ * Copy a regular file's content, sharing extents when the filesystem allows it.
+ * @param srcfd Source file descriptor.
+ * @param dstfd Destination file descriptor, empty.
+ * @param size Size of the source file.
+ */
+static void
+mirror_copy(int srcfd, int dstfd, off_t size) {
+
+	if (ioctl(dstfd, FICLONE, srcfd) == 0) {
+		return;
+	}
+
+	while (size != 0) {
+		const ssize_t copied = copy_file_range(srcfd, NULL, dstfd, NULL, size, 0);
+
+		if (copied < 0) {
+			/* Cross-device, or unsupported, fallback to userspace copies. */
+			if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+				break;
+			}
+			err(EXIT_FAILURE, "copy_file_range");
+		}
+
+		if (copied == 0) {
+			return;
+		}
+
+		size -= copied;
+	}
+
+	char buffer[65536];
+	ssize_t readval;
+	while (readval = read(srcfd, buffer, sizeof (buffer)), readval > 0) {
+		for (ssize_t written = 0; written < readval;) {
+			const ssize_t writeval = write(dstfd, buffer + written, readval - written);
+
+			if (writeval < 0) {
+				err(EXIT_FAILURE, "write");
+			}
+
+			written += writeval;
+		}
+	}
+
+	if (readval < 0) {
+		err(EXIT_FAILURE, "read");
+	}
+}
+
+static void
+mirror_file(int srcdirfd, int dstdirfd, const char *name, const struct stat *st, bool exists) {
+	const int srcfd = openat(srcdirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (srcfd < 0) {
+		err(EXIT_FAILURE, "openat '%s'", name);
+	}
+
+	/* Replace rather than truncate, the previous one may be read-only, or shared. */
+	if (exists && unlinkat(dstdirfd, name, 0) != 0) {
+		err(EXIT_FAILURE, "unlinkat '%s'", name);
+	}
+
+	const int dstfd = openat(dstdirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (dstfd < 0) {
+		err(EXIT_FAILURE, "openat '%s'", name);
+	}
+
+	mirror_copy(srcfd, dstfd, st->st_size);
+
+	const struct timespec times[] = { st->st_atim, st->st_mtim };
+	if (fchmod(dstfd, st->st_mode & 07777) != 0 || futimens(dstfd, times) != 0) {
+		err(EXIT_FAILURE, "Unable to set attributes of '%s'", name);
+	}
+
+	close(dstfd);
+	close(srcfd);
+}
+
+static void
+mirror_symlink(int srcdirfd, int dstdirfd, const char *name, bool exists) {
+	char target[PATH_MAX], current[PATH_MAX];
+	const ssize_t length = readlinkat(srcdirfd, name, target, sizeof (target) - 1);
+
+	if (length < 0) {
+		err(EXIT_FAILURE, "readlinkat '%s'", name);
+	}
+	target[length] = '\0';
+
+	if (exists) {
+		const ssize_t currentlen = readlinkat(dstdirfd, name, current, sizeof (current) - 1);
+
+		if (currentlen == length && memcmp(current, target, length) == 0) {
+			return;
+		}
+
+		mirror_remove(dstdirfd, name);
+	}
+
+	if (symlinkat(target, dstdirfd, name) != 0) {
+		err(EXIT_FAILURE, "symlinkat '%s'", name);
+	}
+}
+
+static void mirror_directory(int srcfd, int dstfd);
+
+/**
+ * Mirror one entry of a directory.
+ * @param srcdirfd Source parent directory.
+ * @param dstdirfd Destination parent directory.
+ * @param name Name of the entry in both directories.
+ */
+static void
+mirror_entry(int srcdirfd, int dstdirfd, const char *name) {
+	struct stat srcst, dstst;
+	bool exists;
+
+	if (fstatat(srcdirfd, name, &srcst, AT_SYMLINK_NOFOLLOW) != 0) {
+		if (errno == ENOENT) {
+			return;
+		}
+		err(EXIT_FAILURE, "fstatat '%s'", name);
+	}
+
+	if (fstatat(dstdirfd, name, &dstst, AT_SYMLINK_NOFOLLOW) == 0) {
+		exists = (srcst.st_mode & S_IFMT) == (dstst.st_mode & S_IFMT);
+		if (!exists) {
+			mirror_remove(dstdirfd, name);
+		}
+	} else if (errno == ENOENT) {
+		exists = false;
+	} else {
+		err(EXIT_FAILURE, "fstatat '%s'", name);
+	}
+
+	switch (srcst.st_mode & S_IFMT) {
+	case S_IFREG:
+		if (!exists || srcst.st_size != dstst.st_size
+			|| srcst.st_mtim.tv_sec != dstst.st_mtim.tv_sec
+			|| srcst.st_mtim.tv_nsec != dstst.st_mtim.tv_nsec) {
+			mirror_file(srcdirfd, dstdirfd, name, &srcst, exists);
+		} else if ((srcst.st_mode & 07777) != (dstst.st_mode & 07777)
+			&& fchmodat(dstdirfd, name, srcst.st_mode & 07777, 0) != 0) {
+			err(EXIT_FAILURE, "fchmodat '%s'", name);
+		}
+		break;
+	case S_IFLNK:
+		mirror_symlink(srcdirfd, dstdirfd, name, exists);
+		break;
+	case S_IFDIR: {
+		if (!exists && mkdirat(dstdirfd, name, 0700) != 0) {
+			err(EXIT_FAILURE, "mkdirat '%s'", name);
+		}
+
+		const int srcfd = openat(srcdirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		const int dstfd = openat(dstdirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (srcfd < 0 || dstfd < 0) {
+			err(EXIT_FAILURE, "openat '%s'", name);
+		}
+
+		/* Previous attributes may forbid updating its content. */
+		if (exists && (dstst.st_mode & 0700) != 0700 && fchmod(dstfd, 0700) != 0) {
+			err(EXIT_FAILURE, "fchmod '%s'", name);
+		}
+
+		mirror_directory(srcfd, dstfd);
+
+		const struct timespec times[] = { srcst.st_atim, srcst.st_mtim };
+		if (fchmod(dstfd, srcst.st_mode & 07777) != 0 || futimens(dstfd, times) != 0) {
+			err(EXIT_FAILURE, "Unable to set attributes of '%s'", name);
+		}
+
+		close(dstfd);
+		close(srcfd);
+	} break;
+	default:
+		/* Devices, fifos and sockets have no place in workdirs. */
+		break;
+	}
+}
+
+/**
+ * Mirror the content of a directory into another one.
+ * @param srcfd Source directory.
+ * @param dstfd Destination directory.
+ */
+static void
+mirror_directory(int srcfd, int dstfd) {
+	const struct dirent *entry;
+	DIR *dirp;
+
+	/* Remove what disappeared first, freeing space for what follows. */
+	dirp = mirror_opendir(dstfd);
+	while (entry = readdir(dirp), entry != NULL) {
+		if (!mirror_isdot(entry->d_name)
+			&& faccessat(srcfd, entry->d_name, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+			if (errno != ENOENT) {
+				err(EXIT_FAILURE, "faccessat '%s'", entry->d_name);
+			}
+			mirror_remove(dstfd, entry->d_name);
+		}
+	}
+	closedir(dirp);
+
+	dirp = mirror_opendir(srcfd);
+	while (entry = readdir(dirp), entry != NULL) {
+		if (!mirror_isdot(entry->d_name)) {
+			mirror_entry(srcfd, dstfd, entry->d_name);
+		}
+	}
+	closedir(dirp);
+}
+
+/**
+ * Incrementally make a directory's content identical to another one's.
+ * Regular files are copied when their size or modification time differ,
+ * preserving their modification time, extents are shared when possible.
+ * @param source Directory to mirror.
+ * @param destination Directory to update, created if missing.
+ */
+void
+mirror(const char *source, const char *destination) {
+	const int srcfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (srcfd < 0) {
+		err(EXIT_FAILURE, "open '%s'", source);
+	}
+
+	if (mkdir(destination, 0700) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir '%s'", destination);
+	}
+
+	const int dstfd = open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dstfd < 0) {
+		err(EXIT_FAILURE, "open '%s'", destination);
+	}
+
+	mirror_directory(srcfd, dstfd);
+
+	close(dstfd);
+	close(srcfd);
+}
+
+/**
+ * Check whether a directory's filesystem shares extents between copies.
+ * @param directory Directory on the filesystem.
+ * @return Whether copies are clones.
+ */
+bool
+mirror_reflinks(const char *directory) {
+	const int srcfd = open(directory, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	const int dstfd = open(directory, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	const bool reflinks = srcfd >= 0 && dstfd >= 0 && ioctl(dstfd, FICLONE, srcfd) == 0;
+
+	if (dstfd >= 0) {
+		close(dstfd);
+	}
+
+	if (srcfd >= 0) {
+		close(srcfd);
+	}
+
+	return reflinks;
+}
+
+/**
+ * Merge the content of an overlayfs upper directory into its lower one.
+ * Entries are moved rather than copied, whiteouts remove their lower
+ * counterpart, and opaque directories replace theirs.
+ * @param upperfd Upper directory, emptied of its files.
+ * @param lowerfd Lower directory.
+ */
+static void
+mirror_merge_directory(int upperfd, int lowerfd) {
+	const struct dirent *entry;
+	DIR * const dirp = mirror_opendir(upperfd);
+
+	while (entry = readdir(dirp), entry != NULL) {
+		const char * const name = entry->d_name;
+		struct stat upperst, lowerst;
+
+		if (mirror_isdot(name)) {
+			continue;
+		}
+
+		if (fstatat(upperfd, name, &upperst, AT_SYMLINK_NOFOLLOW) != 0) {
+			err(EXIT_FAILURE, "fstatat '%s'", name);
+		}
+
+		const bool lowerdir = fstatat(lowerfd, name, &lowerst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(lowerst.st_mode);
+
+		if (S_ISCHR(upperst.st_mode) && upperst.st_rdev == 0) {
+			mirror_remove(lowerfd, name);
+		} else if (S_ISDIR(upperst.st_mode)) {
+			const int fd = openat(upperfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			char opaque;
+
+			if (fd < 0) {
+				err(EXIT_FAILURE, "openat '%s'", name);
+			}
+
+			if (!lowerdir || (fgetxattr(fd, "user.overlay.opaque", &opaque, sizeof (opaque)) == sizeof (opaque) && opaque == 'y')) {
+				mirror_remove(lowerfd, name);
+				if (mkdirat(lowerfd, name, 0700) != 0) {
+					err(EXIT_FAILURE, "mkdirat '%s'", name);
+				}
+			}
+
+			const int dstfd = openat(lowerfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (dstfd < 0) {
+				err(EXIT_FAILURE, "openat '%s'", name);
+			}
+
+			/* Previous attributes may forbid updating its content. */
+			if (fchmod(dstfd, 0700) != 0) {
+				err(EXIT_FAILURE, "fchmod '%s'", name);
+			}
+
+			mirror_merge_directory(fd, dstfd);
+
+			const struct timespec times[] = { upperst.st_atim, upperst.st_mtim };
+			if (fchmod(dstfd, upperst.st_mode & 07777) != 0 || futimens(dstfd, times) != 0) {
+				err(EXIT_FAILURE, "Unable to set attributes of '%s'", name);
+			}
+
+			close(dstfd);
+			close(fd);
+		} else {
+			if (lowerdir) {
+				mirror_remove(lowerfd, name);
+			}
+
+			if (renameat(upperfd, name, lowerfd, name) != 0) {
+				err(EXIT_FAILURE, "renameat '%s'", name);
+			}
+		}
+	}
+	closedir(dirp);
+}
+
+/**
+ * Merge the modifications of an overlayfs mount, once unmounted, into its lower directory.
+ * Both must be on the same filesystem, as files are moved rather than copied.
+ * @param upper Upper directory, emptied of its files.
+ * @param lower Lower directory.
+ */
+void
+mirror_merge(const char *upper, const char *lower) {
+	const int upperfd = open(upper, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int lowerfd = open(lower, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (upperfd < 0 || lowerfd < 0) {
+		err(EXIT_FAILURE, "Unable to open '%s' and '%s'", upper, lower);
+	}
+
+	mirror_merge_directory(upperfd, lowerfd);
+
+	close(lowerfd);
+	close(upperfd);
+}
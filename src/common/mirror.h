@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_MIRROR_H
+#define COMMON_MIRROR_H
+
+#include <stdbool.h> /* bool */
+
+extern void mirror(const char *source, const char *destination);
+
+extern void mirror_remove(int dirfd, const char *name);
+
+extern bool mirror_reflinks(const char *directory);
+
+extern void mirror_merge(const char *upper, const char *lower);
+
+/* COMMON_MIRROR_H */
+#endif
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "pathfilter.h"
+
+#include <stdlib.h> /* reallocarray, EXIT_FAILURE */
+#include <string.h> /* strchr, strchrnul, memcpy */
+#include <fnmatch.h> /* fnmatch */
+#include <err.h> /* err */
+
+static void
+pathfilter_append(const char ***patternsp, size_t *countp, const char *pattern) {
+	const char **patterns = reallocarray(*patternsp, *countp + 1, sizeof (*patterns));
+
+	if (patterns == NULL) {
+		err(EXIT_FAILURE, "reallocarray");
+	}
+
+	patterns[(*countp)++] = pattern;
+	*patternsp = patterns;
+}
+
+void
+pathfilter_include(struct pathfilter *filter, const char *pattern) {
+	pathfilter_append(&filter->includes, &filter->includescount, pattern);
+}
+
+void
+pathfilter_exclude(struct pathfilter *filter, const char *pattern) {
+	pathfilter_append(&filter->excludes, &filter->excludescount, pattern);
+}
+
+bool
+pathfilter_empty(const struct pathfilter *filter) {
+	return filter->includescount == 0 && filter->excludescount == 0;
+}
+
+/**
+ * Match an anchored glob pattern against a path, component by component.
+ * Components are matched with fnmatch(3), a `**` component matches
+ * any number of components, and a trailing slash only matches directories.
+ * Matching a directory matches all of its contents.
+ * @param pattern Pattern, without leading slash.
+ * @param path Path, without leading nor trailing slashes.
+ * @param isdir Whether path is a directory.
+ * @param partial Whether to match directories which may contain matches.
+ * @return Whether path matches.
+ */
+static bool
+pathfilter_glob(const char *pattern, const char *path, bool isdir, bool partial) {
+	const char * const patternend = strchrnul(pattern, '/'), * const pathend = strchrnul(path, '/');
+
+	if (patternend - pattern == 2 && pattern[0] == '*' && pattern[1] == '*') {
+		if (*patternend == '\0' || partial) {
+			return true;
+		}
+
+		while (!pathfilter_glob(patternend + 1, path, isdir, partial)) {
+			path = strchr(path, '/');
+			if (path == NULL) {
+				return false;
+			}
+			path++;
+		}
+
+		return true;
+	}
+
+	char segpattern[patternend - pattern + 1], segpath[pathend - path + 1];
+
+	*(char *)mempcpy(segpattern, pattern, patternend - pattern) = '\0';
+	*(char *)mempcpy(segpath, path, pathend - path) = '\0';
+
+	if (fnmatch(segpattern, segpath, 0) != 0) {
+		return false;
+	}
+
+	if (*patternend == '\0') {
+		return true;
+	}
+
+	if (patternend[1] == '\0') {
+		return *pathend == '/' || isdir;
+	}
+
+	if (*pathend == '\0') {
+		return partial;
+	}
+
+	return pathfilter_glob(patternend + 1, pathend + 1, isdir, partial);
+}
+
+/**
+ * Match gitignore-style patterns against a path. A leading slash
+ * anchors a pattern, which is otherwise also anchored if it contains
+ * a slash before its end, else it matches at any depth.
+ * @param patterns Patterns to match.
+ * @param count Number of patterns.
+ * @param path Path, without leading nor trailing slashes.
+ * @param isdir Whether path is a directory.
+ * @param partial Whether to match directories which may contain matches.
+ * @return Whether any pattern matches.
+ */
+static bool
+pathfilter_any(const char * const *patterns, size_t count, const char *path, bool isdir, bool partial) {
+
+	for (size_t i = 0; i < count; i++) {
+		const char *pattern = patterns[i];
+
+		if (*pattern == '/') {
+			if (pathfilter_glob(pattern + 1, path, isdir, partial)) {
+				return true;
+			}
+			continue;
+		}
+
+		const char * const slash = strchr(pattern, '/');
+		if (slash != NULL && slash[1] != '\0') {
+			if (pathfilter_glob(pattern, path, isdir, partial)) {
+				return true;
+			}
+			continue;
+		}
+
+		if (partial) {
+			return true;
+		}
+
+		for (const char *component = path; component != NULL; component = strchr(component, '/')) {
+			if (*component == '/') {
+				component++;
+			}
+
+			if (pathfilter_glob(pattern, component, isdir, partial)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool
+pathfilter_match(const struct pathfilter *filter, const char *path, bool isdir) {
+
+	/* Normalize leading dot directories and slashes, and trailing slashes. */
+	while (*path == '/' || (path[0] == '.' && (path[1] == '/' || path[1] == '\0'))) {
+		path++;
+	}
+
+	size_t length = strlen(path);
+	while (length != 0 && path[length - 1] == '/') {
+		length--;
+	}
+
+	if (length == 0) {
+		return true;
+	}
+
+	char normalized[length + 1];
+	*(char *)mempcpy(normalized, path, length) = '\0';
+
+	/* Directories are kept when they may contain included entries,
+	 * parents of included entries would be created anyway. */
+	if (filter->includescount != 0
+		&& !pathfilter_any(filter->includes, filter->includescount, normalized, isdir, isdir)) {
+		return false;
+	}
+
+	return !pathfilter_any(filter->excludes, filter->excludescount, normalized, isdir, false);
+}
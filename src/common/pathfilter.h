@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_PATHFILTER_H
+#define COMMON_PATHFILTER_H
+
+#include <stdbool.h> /* bool */
+#include <stddef.h> /* size_t */
+
+struct pathfilter {
+	const char **includes, **excludes;
+	size_t includescount, excludescount;
+};
+
+extern void pathfilter_include(struct pathfilter *filter, const char *pattern);
+
+extern void pathfilter_exclude(struct pathfilter *filter, const char *pattern);
+
+extern bool pathfilter_empty(const struct pathfilter *filter);
+
+extern bool pathfilter_match(const struct pathfilter *filter, const char *path, bool isdir);
+
+/* COMMON_PATHFILTER_H */
+#endif
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "prefetch.h"
+
+#include <stdlib.h> /* malloc, free, EXIT_FAILURE */
+#include <string.h> /* strdup */
+#include <stdbool.h> /* bool */
+#include <pthread.h> /* pthread_create, ... */
+#include <fcntl.h> /* open, readahead */
+#include <unistd.h> /* close */
+#include <errno.h> /* errno */
+#include <err.h> /* err */
+
+struct prefetch_request {
+	char *path;
+	off_t size;
+};
+
+struct prefetch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct prefetch_request *requests;
+	unsigned int depth, head, count;
+	unsigned int threads;
+	bool stopped;
+	pthread_t workers[];
+};
+
+static void *
+prefetch_worker(void *data) {
+	struct prefetch * const prefetch = data;
+
+	pthread_mutex_lock(&prefetch->mutex);
+	while (true) {
+		while (prefetch->count == 0 && !prefetch->stopped) {
+			pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+		}
+
+		if (prefetch->count == 0) {
+			break;
+		}
+
+		const struct prefetch_request request = prefetch->requests[prefetch->head];
+		prefetch->head = (prefetch->head + 1) % prefetch->depth;
+		prefetch->count--;
+
+		pthread_mutex_unlock(&prefetch->mutex);
+
+		/* Errors are not ours to report, the reader will. */
+		const int fd = open(request.path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			readahead(fd, 0, request.size);
+			close(fd);
+		}
+		free(request.path);
+
+		pthread_mutex_lock(&prefetch->mutex);
+	}
+	pthread_mutex_unlock(&prefetch->mutex);
+
+	return NULL;
+}
+
+/**
+ * Start a pool of threads reading files ahead of their actual use,
+ * so their data is already in the page cache when needed.
+ * @param threads Number of threads reading files concurrently.
+ * @param depth Maximum number of pending files.
+ * @return The pool, must be prefetch_destroy()'d.
+ */
+struct prefetch *
+prefetch_create(unsigned int threads, unsigned int depth) {
+	struct prefetch * const prefetch = malloc(sizeof (*prefetch) + threads * sizeof (*prefetch->workers));
+
+	if (prefetch == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	prefetch->requests = malloc(depth * sizeof (*prefetch->requests));
+	if (prefetch->requests == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	pthread_mutex_init(&prefetch->mutex, NULL);
+	pthread_cond_init(&prefetch->cond, NULL);
+	prefetch->depth = depth;
+	prefetch->head = 0;
+	prefetch->count = 0;
+	prefetch->threads = threads;
+	prefetch->stopped = false;
+
+	for (unsigned int i = 0; i < threads; i++) {
+		errno = pthread_create(prefetch->workers + i, NULL, prefetch_worker, prefetch);
+		if (errno != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	return prefetch;
+}
+
+/**
+ * Queue a file to be read ahead. If too many files are
+ * already pending, the request is dropped instead of waiting.
+ * @param prefetch Pool of reading threads.
+ * @param path Path of the file.
+ * @param size Number of bytes to read ahead.
+ */
+void
+prefetch_file(struct prefetch *prefetch, const char *path, off_t size) {
+
+	pthread_mutex_lock(&prefetch->mutex);
+	if (prefetch->count != prefetch->depth) {
+		char * const copy = strdup(path);
+
+		if (copy != NULL) {
+			struct prefetch_request * const request = prefetch->requests
+				+ (prefetch->head + prefetch->count) % prefetch->depth;
+
+			request->path = copy;
+			request->size = size;
+			prefetch->count++;
+
+			pthread_cond_signal(&prefetch->cond);
+		}
+	}
+	pthread_mutex_unlock(&prefetch->mutex);
+}
+
+/**
+ * Drop pending files, wait for the ones being read, and release the pool.
+ * @param prefetch Pool of reading threads.
+ */
+void
+prefetch_destroy(struct prefetch *prefetch) {
+
+	pthread_mutex_lock(&prefetch->mutex);
+	while (prefetch->count != 0) {
+		free(prefetch->requests[prefetch->head].path);
+		prefetch->head = (prefetch->head + 1) % prefetch->depth;
+		prefetch->count--;
+	}
+	prefetch->stopped = true;
+	pthread_cond_broadcast(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->mutex);
+
+	for (unsigned int i = 0; i < prefetch->threads; i++) {
+		pthread_join(prefetch->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->mutex);
+	free(prefetch->requests);
+	free(prefetch);
+}
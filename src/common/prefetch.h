@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_PREFETCH_H
+#define COMMON_PREFETCH_H
+
+#include <sys/types.h> /* off_t */
+
+struct prefetch;
+
+extern struct prefetch *prefetch_create(unsigned int threads, unsigned int depth);
+
+extern void prefetch_file(struct prefetch *prefetch, const char *path, off_t size);
+
+extern void prefetch_destroy(struct prefetch *prefetch);
+
+/* COMMON_PREFETCH_H */
+#endif
@@ -0,0 +1,400 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "trace.h"
+
+#include <stdio.h> /* fdopen, fprintf, snprintf */
+#include <stdlib.h> /* malloc, free, EXIT_FAILURE */
+#include <string.h> /* strlen, strdup, strcmp, strncmp, strchrnul, memcpy, memmove, memchr, memset */
+#include <stdbool.h> /* bool */
+#include <stddef.h> /* offsetof */
+#include <search.h> /* tsearch, twalk_r, tdestroy */
+#include <unistd.h> /* fork, pread, readlink, syscall, sysconf */
+#include <fcntl.h> /* open, AT_FDCWD */
+#include <limits.h> /* PATH_MAX */
+#include <poll.h> /* poll */
+#include <errno.h> /* errno, EINTR, ENOENT */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/prctl.h> /* prctl, PR_SET_NO_NEW_PRIVS */
+#include <sys/socket.h> /* socketpair, sendmsg, recvmsg */
+#include <sys/syscall.h> /* SYS_seccomp, __NR_* */
+#include <linux/audit.h> /* AUDIT_ARCH_* */
+#include <linux/filter.h> /* struct sock_filter, BPF_* */
+#include <linux/seccomp.h> /* SECCOMP_* */
+#include <err.h> /* err, errx */
+
+#if defined(__x86_64__)
+#define TRACE_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define TRACE_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__riscv) && __riscv_xlen == 64
+#define TRACE_AUDIT_ARCH AUDIT_ARCH_RISCV64
+#else
+#error "Unsupported architecture for file accesses tracing"
+#endif
+
+/* Notify the supervisor of a system call. */
+#define TRACE_SYSCALL(nr) \
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), \
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF)
+
+/* Paths never recorded, outputs and pseudo-filesystems. */
+static const char * const trace_ignored[] = {
+	"/dev/", "/proc/", "/sys/", "/tmp/", "/var/dest/", "/var/obj/",
+};
+
+static int
+trace_compare(const void *lhs, const void *rhs) {
+	return strcmp(lhs, rhs);
+}
+
+static void
+trace_print(const void *node, VISIT which, void *output) {
+	if (which == postorder || which == leaf) {
+		fprintf(output, "%s\n", *(const char * const *)node);
+	}
+}
+
+/**
+ * Install the seccomp filter notifying the listener
+ * of all opened and executed files of the calling process
+ * and its future children.
+ * @return The listener file descriptor.
+ */
+static int
+trace_filter(void) {
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TRACE_AUDIT_ARCH, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+#ifdef __NR_open
+		TRACE_SYSCALL(__NR_open),
+#endif
+#ifdef __NR_creat
+		TRACE_SYSCALL(__NR_creat),
+#endif
+		TRACE_SYSCALL(__NR_openat),
+#ifdef __NR_openat2
+		TRACE_SYSCALL(__NR_openat2),
+#endif
+		TRACE_SYSCALL(__NR_execve),
+		TRACE_SYSCALL(__NR_execveat),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	};
+	const struct sock_fprog program = {
+		.len = sizeof (filter) / sizeof (*filter),
+		.filter = filter,
+	};
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+		err(EXIT_FAILURE, "prctl PR_SET_NO_NEW_PRIVS");
+	}
+
+	const int listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &program);
+	if (listener < 0) {
+		err(EXIT_FAILURE, "seccomp");
+	}
+
+	return listener;
+}
+
+/**
+ * Fork a child process which opened and executed files are reported
+ * to a listener, which must be given to trace_supervise(), as the
+ * child's system calls are suspended until they are supervised.
+ * @param listenerp Where the listener is stored in the parent.
+ * @return As fork(2).
+ */
+pid_t
+trace_fork(int *listenerp) {
+	int sockets[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+		err(EXIT_FAILURE, "socketpair");
+	}
+
+	char control[CMSG_SPACE(sizeof (int))] = { 0 };
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = sizeof (byte) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof (control),
+	};
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(sockets[0]);
+
+		const int listener = trace_filter();
+		struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof (listener));
+		memcpy(CMSG_DATA(cmsg), &listener, sizeof (listener));
+
+		if (sendmsg(sockets[1], &msg, 0) < 0) {
+			err(EXIT_FAILURE, "sendmsg");
+		}
+
+		close(listener);
+		close(sockets[1]);
+
+		return 0;
+	}
+
+	close(sockets[1]);
+
+	const struct cmsghdr *cmsg;
+	if (recvmsg(sockets[0], &msg, MSG_CMSG_CLOEXEC) <= 0
+		|| (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+		errx(EXIT_FAILURE, "Unable to receive tracing listener");
+	}
+	memcpy(listenerp, CMSG_DATA(cmsg), sizeof (*listenerp));
+
+	close(sockets[0]);
+
+	return pid;
+}
+
+/**
+ * Read a NUL-terminated string from a traced process, page by page
+ * as the string may end right before an unmapped page.
+ * @param memfd Memory of the process.
+ * @param address Address of the string.
+ * @param buffer Where the string is stored.
+ * @param size Size of buffer.
+ * @return 0 on success, -1 if unreadable or too long.
+ */
+static int
+trace_read_string(int memfd, unsigned long long address, char *buffer, size_t size) {
+	const size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t length = 0;
+
+	while (length < size) {
+		const size_t remaining = pagesize - (address + length) % pagesize;
+		const size_t count = remaining < size - length ? remaining : size - length;
+		const ssize_t readval = pread(memfd, buffer + length, count, address + length);
+
+		if (readval <= 0) {
+			return -1;
+		}
+
+		if (memchr(buffer + length, '\0', readval) != NULL) {
+			return 0;
+		}
+
+		length += readval;
+	}
+
+	return -1;
+}
+
+/**
+ * Lexically normalize an absolute path, in place,
+ * removing empty and dot components, and resolving dot-dot ones.
+ * @param path Path to normalize.
+ */
+static void
+trace_normalize(char *path) {
+	char *output = path;
+	const char *input = path;
+
+	while (*input != '\0') {
+		while (*input == '/') {
+			input++;
+		}
+
+		const char *end = strchrnul(input, '/');
+		const size_t length = end - input;
+
+		if (length == 0 || (length == 1 && *input == '.')) {
+			/* Nothing to append. */
+		} else if (length == 2 && input[0] == '.' && input[1] == '.') {
+			while (output != path && *--output != '/');
+		} else {
+			*output++ = '/';
+			memmove(output, input, length);
+			output += length;
+		}
+
+		input = end;
+	}
+
+	if (output == path) {
+		*output++ = '/';
+	}
+	*output = '\0';
+}
+
+/**
+ * Resolve the path accessed by a notified system call.
+ * @param notif Notification.
+ * @param path Where the absolute path is stored.
+ * @param size Size of path.
+ * @return 0 on success, -1 if the path couldn't be resolved.
+ */
+static int
+trace_resolve(const struct seccomp_notif *notif, char *path, size_t size) {
+	const int nr = notif->data.nr;
+	int dirfd = AT_FDCWD, pathindex = 0;
+
+	if (nr == __NR_openat
+#ifdef __NR_openat2
+		|| nr == __NR_openat2
+#endif
+		|| nr == __NR_execveat) {
+		dirfd = (int)notif->data.args[0];
+		pathindex = 1;
+	}
+
+	char procpath[sizeof ("/proc//fd/") + sizeof (pid_t) * 3 + sizeof (int) * 3];
+	snprintf(procpath, sizeof (procpath), "/proc/%u/mem", notif->pid);
+
+	const int memfd = open(procpath, O_RDONLY | O_CLOEXEC);
+	if (memfd < 0) {
+		return -1;
+	}
+
+	char relative[PATH_MAX];
+	const int readval = trace_read_string(memfd, notif->data.args[pathindex], relative, sizeof (relative));
+	close(memfd);
+
+	if (readval != 0 || *relative == '\0') {
+		return -1;
+	}
+
+	size_t length = 0;
+	if (*relative != '/') {
+		if (dirfd == AT_FDCWD) {
+			snprintf(procpath, sizeof (procpath), "/proc/%u/cwd", notif->pid);
+		} else {
+			snprintf(procpath, sizeof (procpath), "/proc/%u/fd/%d", notif->pid, dirfd);
+		}
+
+		const ssize_t linklen = readlink(procpath, path, size - 1);
+		if (linklen <= 0 || *path != '/') {
+			return -1;
+		}
+		length = linklen;
+		path[length++] = '/';
+	}
+
+	const size_t relativelen = strlen(relative);
+	if (length + relativelen >= size) {
+		return -1;
+	}
+	memcpy(path + length, relative, relativelen + 1);
+
+	trace_normalize(path);
+
+	return 0;
+}
+
+static bool
+trace_ignore(const char *path) {
+	const size_t pathlen = strlen(path);
+
+	for (size_t i = 0; i < sizeof (trace_ignored) / sizeof (*trace_ignored); i++) {
+		const size_t ignoredlen = strlen(trace_ignored[i]);
+
+		/* Match both the directory itself and its contents. */
+		if (strncmp(path, trace_ignored[i], ignoredlen - 1) == 0
+			&& (pathlen == ignoredlen - 1 || path[ignoredlen - 1] == '/')) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Supervise a traced process tree until all its processes exited,
+ * recording the paths they opened or executed, even unsuccessfully.
+ * Outputs and pseudo-filesystems are ignored.
+ * System calls are always resumed unmodified.
+ * @param listener Listener returned by trace_fork(), consumed.
+ * @param fds Where to print the sorted paths, one per line.
+ * @param count Number of file descriptors in fds.
+ */
+void
+trace_supervise(int listener, const int *fds, size_t count) {
+	struct seccomp_notif_sizes sizes;
+	void *paths = NULL;
+
+	if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) != 0) {
+		err(EXIT_FAILURE, "seccomp SECCOMP_GET_NOTIF_SIZES");
+	}
+
+	struct seccomp_notif * const notif = malloc(sizes.seccomp_notif);
+	struct seccomp_notif_resp * const resp = malloc(sizes.seccomp_notif_resp);
+	if (notif == NULL || resp == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	struct pollfd pollfd = { .fd = listener, .events = POLLIN };
+	while (true) {
+		if (poll(&pollfd, 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		/* No process uses the filter anymore. */
+		if (!(pollfd.revents & POLLIN)) {
+			break;
+		}
+
+		memset(notif, 0, sizes.seccomp_notif);
+		if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, notif) != 0) {
+			/* The process may have been killed since. */
+			if (errno == EINTR || errno == ENOENT) {
+				continue;
+			}
+			err(EXIT_FAILURE, "ioctl SECCOMP_IOCTL_NOTIF_RECV");
+		}
+
+		/* The path is only trusted if the process is still suspended in the system call. */
+		char path[PATH_MAX];
+		if (trace_resolve(notif, path, sizeof (path)) == 0
+			&& ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &notif->id) == 0
+			&& !trace_ignore(path) && tfind(path, &paths, trace_compare) == NULL) {
+			char * const copy = strdup(path);
+
+			if (copy == NULL || tsearch(copy, &paths, trace_compare) == NULL) {
+				err(EXIT_FAILURE, "Unable to record path");
+			}
+		}
+
+		memset(resp, 0, sizes.seccomp_notif_resp);
+		resp->id = notif->id;
+		resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+
+		if (ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, resp) != 0 && errno != ENOENT) {
+			err(EXIT_FAILURE, "ioctl SECCOMP_IOCTL_NOTIF_SEND");
+		}
+	}
+
+	close(listener);
+	free(resp);
+	free(notif);
+
+	for (size_t i = 0; i < count; i++) {
+		FILE * const output = fdopen(dup(fds[i]), "w");
+		if (output == NULL) {
+			err(EXIT_FAILURE, "fdopen");
+		}
+
+		twalk_r(paths, trace_print, output);
+
+		if (fclose(output) != 0) {
+			err(EXIT_FAILURE, "Unable to write trace");
+		}
+	}
+
+	tdestroy(paths, free);
+}
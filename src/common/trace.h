@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <sys/types.h> /* pid_t, size_t */
+
+extern pid_t trace_fork(int *listenerp);
+
+extern void trace_supervise(int listener, const int *fds, size_t count);
+
+/* COMMON_TRACE_H */
+#endif
@@ -0,0 +1,367 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "warmup.h"
+
+#include <stdio.h> /* fdopen, getline, fclose, sprintf */
+#include <stdlib.h> /* getenv, malloc, realloc, free, mkostemp, EXIT_* */
+#include <stdnoreturn.h> /* noreturn */
+#include <string.h> /* strlen, strdup, strncmp, strrchr, memcpy, mempcpy */
+#include <stdatomic.h> /* atomic_size_t, atomic_fetch_add */
+#include <pthread.h> /* pthread_create, pthread_join */
+#include <unistd.h> /* fork, close, close_range, fsync, syscall, unlinkat, _exit */
+#include <fcntl.h> /* open, openat, readahead, renameat */
+#include <errno.h> /* errno, EEXIST, ENOENT */
+#include <sys/stat.h> /* mkdir, stat, fstat */
+#include <sys/wait.h> /* waitpid */
+#include <sys/syscall.h> /* SYS_openat2 */
+#include <linux/openat2.h> /* struct open_how, RESOLVE_* */
+#include <time.h> /* struct timespec */
+#include <err.h> /* err, errx, warn */
+
+#include <openssl/evp.h>
+
+#include <orm.h>
+
+#define WARMUP_DIGEST_SIZE 32
+
+struct warmup {
+	int dirfd, fd;
+	char *temp;
+	char name[2 * WARMUP_DIGEST_SIZE + 1];
+};
+
+struct warmup_replay {
+	int rootfd, sysrootfd;
+	char **paths;
+	size_t count;
+	atomic_size_t next;
+};
+
+/**
+ * Name the profile of a toolchain and sysroot pair, as the hexadecimal SHA-256
+ * digest of their paths and their directories' identities and change times,
+ * so replacing or modifying them records a new profile.
+ * @param root Toolchain root directory.
+ * @param sysroot Sysroot directory, or NULL if extracted.
+ * @param name Where the name is stored.
+ * @return 0 on success, -1 if a directory can't be stated.
+ */
+static int
+warmup_name(const char *root, const char *sysroot, char name[static 2 * WARMUP_DIGEST_SIZE + 1]) {
+	const size_t rootlen = strlen(root), sysrootlen = sysroot != NULL ? strlen(sysroot) : 0;
+	unsigned char key[rootlen + 1 + sysrootlen], digest[WARMUP_DIGEST_SIZE];
+	struct {
+		dev_t dev;
+		ino_t ino;
+		struct timespec ctim;
+	} identities[2] = { 0 };
+	struct stat st;
+
+	memcpy(key, root, rootlen + 1);
+	if (sysroot != NULL) {
+		memcpy(key + rootlen + 1, sysroot, sysrootlen);
+	}
+
+	for (unsigned int i = 0; i < (sysroot != NULL ? 2 : 1); i++) {
+		const char * const path = i == 0 ? root : sysroot;
+
+		if (stat(path, &st) != 0) {
+			warn("stat '%s'", path);
+			return -1;
+		}
+
+		identities[i].dev = st.st_dev;
+		identities[i].ino = st.st_ino;
+		identities[i].ctim = st.st_ctim;
+	}
+
+	EVP_MD_CTX * const ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1
+		|| EVP_DigestUpdate(ctx, key, sizeof (key)) != 1
+		|| EVP_DigestUpdate(ctx, identities, sizeof (identities)) != 1
+		|| EVP_DigestFinal_ex(ctx, digest, NULL) != 1) {
+		errx(EXIT_FAILURE, "Unable to digest warmup profile key");
+	}
+	EVP_MD_CTX_free(ctx);
+
+	for (unsigned int i = 0; i < WARMUP_DIGEST_SIZE; i++) {
+		sprintf(name + 2 * i, "%02x", digest[i]);
+	}
+
+	return 0;
+}
+
+/**
+ * Read ahead a file of the profile, resolved on the host.
+ * The sysroot is only reachable if it was mounted, and
+ * other mount points are skipped, sources changed since.
+ * @param replay The replay.
+ * @param path Path of the file in the sandbox.
+ */
+static void
+warmup_readahead(const struct warmup_replay *replay, const char *path) {
+	static const char sysrootdir[] = "/var/sysroot/", vardir[] = "/var/";
+	int dirfd = replay->rootfd;
+
+	if (strncmp(path, sysrootdir, sizeof (sysrootdir) - 1) == 0) {
+		dirfd = replay->sysrootfd;
+		path += sizeof (sysrootdir) - 2;
+	} else if (strncmp(path, vardir, sizeof (vardir) - 1) == 0) {
+		return;
+	}
+
+	if (dirfd < 0) {
+		return;
+	}
+
+	/* Absolute symbolic links must be resolved as in the sandbox. */
+	struct open_how how = {
+		.flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC,
+		.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+	};
+	const int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof (how));
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		readahead(fd, 0, st.st_size);
+	}
+
+	close(fd);
+}
+
+static void *
+warmup_replay_run(void *data) {
+	struct warmup_replay * const replay = data;
+	size_t i;
+
+	while (i = atomic_fetch_add(&replay->next, 1), i < replay->count) {
+		warmup_readahead(replay, replay->paths[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ * Replay a profile, reading all its files ahead concurrently.
+ * Failures are silent, this is only a hint to the page cache.
+ * @param fd Profile, consumed.
+ * @param root Toolchain root directory.
+ * @param sysroot Sysroot directory, or NULL if extracted.
+ * @return Never
+ */
+noreturn static void
+warmup_replay(int fd, const char *root, const char *sysroot) {
+	struct warmup_replay replay = { .rootfd = -1, .sysrootfd = -1 };
+	FILE * const profile = fdopen(fd, "r");
+	char *line = NULL;
+	size_t size = 0, capacity = 0;
+	ssize_t length;
+
+	if (profile == NULL) {
+		_exit(EXIT_FAILURE);
+	}
+
+	while (length = getline(&line, &size, profile), length > 0) {
+		if (line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		if (replay.count == capacity) {
+			capacity = capacity != 0 ? capacity * 2 : 256;
+			replay.paths = realloc(replay.paths, capacity * sizeof (*replay.paths));
+			if (replay.paths == NULL) {
+				_exit(EXIT_FAILURE);
+			}
+		}
+
+		if ((replay.paths[replay.count++] = strdup(line)) == NULL) {
+			_exit(EXIT_FAILURE);
+		}
+	}
+	free(line);
+	fclose(profile);
+
+	/* Inherited descriptors may be pipes read until end of file. */
+	close_range(0, ~0U, 0);
+
+	replay.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sysroot != NULL) {
+		replay.sysrootfd = open(sysroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	pthread_t threads[CONFIG_WARMUP_THREADS];
+	unsigned int started = 0;
+	while (started < CONFIG_WARMUP_THREADS
+		&& pthread_create(threads + started, NULL, warmup_replay_run, &replay) == 0) {
+		started++;
+	}
+
+	if (started == 0) {
+		warmup_replay_run(&replay);
+	}
+
+	while (started != 0) {
+		pthread_join(threads[--started], NULL);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Spawn the replay of a profile in an orphaned process,
+ * as the caller is about to enter a sandbox and execute.
+ * @param fd Profile.
+ * @param root Toolchain root directory.
+ * @param sysroot Sysroot directory, or NULL if extracted.
+ */
+static void
+warmup_spawn(int fd, const char *root, const char *sysroot) {
+	const pid_t pid = fork();
+
+	if (pid < 0) {
+		warn("fork");
+		return;
+	}
+
+	if (pid == 0) {
+		const pid_t replayer = fork();
+
+		if (replayer == 0) {
+			warmup_replay(fd, root, sysroot);
+		}
+
+		_exit(replayer < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, NULL, 0) < 0) {
+		warn("waitpid");
+	}
+}
+
+/**
+ * Start the page cache warmup of a toolchain and sysroot, if enabled
+ * with ORM_WARMUP. If their profile was recorded, its files are read
+ * ahead in the background. Else, the profile must be recorded by
+ * tracing the bsys into warmup_fd() and committed with warmup_commit().
+ * Warmup is opportunistic, failures are only warned about.
+ * @param root Toolchain root directory.
+ * @param sysroot Sysroot directory, or NULL if extracted.
+ * @return The profile to record, or NULL if none.
+ */
+struct warmup *
+warmup_start(const char *root, const char *sysroot) {
+	static const char warmupname[] = "/.warmup", tempext[] = ".XXXXXX";
+	const char * const enabled = getenv("ORM_WARMUP");
+	char *cachedir;
+
+	if (enabled == NULL || *enabled == '\0') {
+		return NULL;
+	}
+
+	if (orm_cachedir(ORM_WORKDIR_PERSISTENT, &cachedir) != 0) {
+		warn("Unable to lookup cache directory");
+		return NULL;
+	}
+
+	const size_t cachedirlen = strlen(cachedir);
+	char warmupdir[cachedirlen + sizeof (warmupname)];
+	memcpy(mempcpy(warmupdir, cachedir, cachedirlen), warmupname, sizeof (warmupname));
+
+	if ((mkdir(cachedir, 0700) != 0 && errno != EEXIST)
+		|| (mkdir(warmupdir, 0700) != 0 && errno != EEXIST)) {
+		warn("Unable to create '%s'", warmupdir);
+		free(cachedir);
+		return NULL;
+	}
+	free(cachedir);
+
+	struct warmup * const warmup = malloc(sizeof (*warmup));
+	if (warmup == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (warmup_name(root, sysroot, warmup->name) != 0) {
+		free(warmup);
+		return NULL;
+	}
+
+	warmup->dirfd = open(warmupdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (warmup->dirfd < 0) {
+		warn("open '%s'", warmupdir);
+		free(warmup);
+		return NULL;
+	}
+
+	const int fd = openat(warmup->dirfd, warmup->name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 || errno != ENOENT) {
+		if (fd >= 0) {
+			warmup_spawn(fd, root, sysroot);
+			close(fd);
+		} else {
+			warn("open '%s/%s'", warmupdir, warmup->name);
+		}
+		close(warmup->dirfd);
+		free(warmup);
+		return NULL;
+	}
+
+	/* Only complete profiles take their name. */
+	const size_t warmupdirlen = strlen(warmupdir);
+	warmup->temp = malloc(warmupdirlen + 1 + sizeof (warmup->name) - 1 + sizeof (tempext));
+	if (warmup->temp == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	*(char *)mempcpy(warmup->temp, warmupdir, warmupdirlen) = '/';
+	memcpy(mempcpy(warmup->temp + warmupdirlen + 1, warmup->name, sizeof (warmup->name) - 1),
+		tempext, sizeof (tempext));
+
+	warmup->fd = mkostemp(warmup->temp, O_CLOEXEC);
+	if (warmup->fd < 0) {
+		warn("mkostemp '%s'", warmup->temp);
+		close(warmup->dirfd);
+		free(warmup->temp);
+		free(warmup);
+		return NULL;
+	}
+
+	return warmup;
+}
+
+/**
+ * Where the traced paths of the profile being recorded must be printed.
+ * @param warmup The profile being recorded.
+ * @return The file descriptor of the profile.
+ */
+int
+warmup_fd(const struct warmup *warmup) {
+	return warmup->fd;
+}
+
+/**
+ * Finish recording a profile. Renaming is done relative
+ * to the profiles directory, which remains reachable
+ * even from the sandbox.
+ * @param warmup The profile being recorded, freed.
+ * @param complete Whether the profile must be kept, usually if the build succeeded.
+ */
+void
+warmup_commit(struct warmup *warmup, bool complete) {
+	const char * const temp = strrchr(warmup->temp, '/') + 1;
+
+	if (complete && (fsync(warmup->fd) != 0
+		|| renameat(warmup->dirfd, temp, warmup->dirfd, warmup->name) != 0)) {
+		warn("Unable to record warmup profile '%s'", warmup->temp);
+		complete = false;
+	}
+
+	if (!complete) {
+		unlinkat(warmup->dirfd, temp, 0);
+	}
+
+	close(warmup->fd);
+	close(warmup->dirfd);
+	free(warmup->temp);
+	free(warmup);
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_WARMUP_H
+#define COMMON_WARMUP_H
+
+#include <stdbool.h> /* bool */
+
+struct warmup;
+
+extern struct warmup *warmup_start(const char *root, const char *sysroot);
+
+extern int warmup_fd(const struct warmup *warmup);
+
+extern void warmup_commit(struct warmup *warmup, bool complete);
+
+/* COMMON_WARMUP_H */
+#endif
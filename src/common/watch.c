@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "watch.h"
+
+#include <stdlib.h> /* malloc, realloc, free, EXIT_FAILURE */
+#include <string.h> /* strlen, strdup, memcpy, mempcpy, strcmp */
+#include <stdbool.h> /* bool */
+#include <search.h> /* tsearch, tfind, twalk_r, tdestroy */
+#include <unistd.h> /* read */
+#include <dirent.h> /* opendir, readdir, closedir */
+#include <limits.h> /* NAME_MAX */
+#include <poll.h> /* poll */
+#include <errno.h> /* errno, EINTR, ... */
+#include <sys/inotify.h> /* inotify_init1, inotify_add_watch */
+#include <err.h> /* err, warn */
+
+#define WATCH_DIRECTORY_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVE \
+	| IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct watch {
+	int fd;
+	size_t rootlen;
+	char **paths;
+	int count;
+	bool overflow;
+	void *changes;
+};
+
+/**
+ * Watch a directory and all its subdirectories, except .git ones.
+ * @param watch Watcher.
+ * @param path Path of the directory, under the watched root.
+ */
+static void
+watch_directory(struct watch *watch, const char *path) {
+	const int wd = inotify_add_watch(watch->fd, path, WATCH_DIRECTORY_MASK);
+
+	if (wd < 0) {
+		/* Removed since, or not a directory anymore. */
+		if (errno != ENOENT && errno != ENOTDIR) {
+			warn("inotify_add_watch '%s'", path);
+		}
+		return;
+	}
+
+	if (wd >= watch->count) {
+		char ** const paths = realloc(watch->paths, (wd + 1) * sizeof (*paths));
+
+		if (paths == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		while (watch->count <= wd) {
+			paths[watch->count++] = NULL;
+		}
+		watch->paths = paths;
+	}
+
+	free(watch->paths[wd]);
+	watch->paths[wd] = strdup(path);
+	if (watch->paths[wd] == NULL) {
+		err(EXIT_FAILURE, "strdup");
+	}
+
+	DIR * const dirp = opendir(path);
+	if (dirp == NULL) {
+		return;
+	}
+
+	const size_t pathlen = strlen(path);
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		if (entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0
+			|| strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".git") == 0) {
+			continue;
+		}
+
+		const size_t namelen = strlen(entry->d_name);
+		char subpath[pathlen + 1 + namelen + 1];
+
+		*(char *)mempcpy(subpath, path, pathlen) = '/';
+		memcpy(subpath + pathlen + 1, entry->d_name, namelen + 1);
+
+		watch_directory(watch, subpath);
+	}
+
+	closedir(dirp);
+}
+
+/**
+ * Watch a directory tree for modifications.
+ * @param root Root of the directory tree.
+ * @return The watcher.
+ */
+struct watch *
+watch_create(const char *root) {
+	struct watch * const watch = malloc(sizeof (*watch));
+
+	if (watch == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	watch->fd = inotify_init1(IN_CLOEXEC);
+	if (watch->fd < 0) {
+		err(EXIT_FAILURE, "inotify_init1");
+	}
+
+	watch->rootlen = strlen(root);
+	watch->paths = NULL;
+	watch->count = 0;
+	watch->changes = NULL;
+
+	watch_directory(watch, root);
+
+	return watch;
+}
+
+static int
+watch_compare(const void *lhs, const void *rhs) {
+	return strcmp(lhs, rhs);
+}
+
+static void
+watch_print(const void *node, VISIT which, void *output) {
+	if (which == postorder || which == leaf) {
+		fprintf(output, "%s\n", *(const char * const *)node);
+	}
+}
+
+/**
+ * Read and record pending events.
+ * @param watch Watcher.
+ */
+static void
+watch_read(struct watch *watch) {
+	char buffer[64 * (sizeof (struct inotify_event) + NAME_MAX + 1)]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	const ssize_t length = read(watch->fd, buffer, sizeof (buffer));
+
+	if (length < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		err(EXIT_FAILURE, "read inotify");
+	}
+
+	const struct inotify_event *event;
+	for (const char *current = buffer; current < buffer + length;
+		current += sizeof (*event) + event->len) {
+		event = (const struct inotify_event *)current;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			watch->overflow = true;
+			continue;
+		}
+
+		if (event->wd < 0 || event->wd >= watch->count || watch->paths[event->wd] == NULL) {
+			continue;
+		}
+
+		if (event->mask & IN_IGNORED) {
+			free(watch->paths[event->wd]);
+			watch->paths[event->wd] = NULL;
+			continue;
+		}
+
+		if (strcmp(event->name, ".git") == 0) {
+			continue;
+		}
+
+		const char * const directory = watch->paths[event->wd];
+		const size_t directorylen = strlen(directory), namelen = strlen(event->name);
+		char path[directorylen + 1 + namelen + 1];
+
+		*(char *)mempcpy(path, directory, directorylen) = '/';
+		memcpy(path + directorylen + 1, event->name, namelen + 1);
+
+		if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+			watch_directory(watch, path);
+		}
+
+		/* Record paths relative to the root. */
+		const char *relative = path + watch->rootlen;
+		while (*relative == '/') {
+			relative++;
+		}
+
+		if (*relative == '\0' || tfind(relative, &watch->changes, watch_compare) != NULL) {
+			continue;
+		}
+
+		char * const copy = strdup(relative);
+		if (copy == NULL || tsearch(copy, &watch->changes, watch_compare) == NULL) {
+			err(EXIT_FAILURE, "Unable to record change");
+		}
+	}
+}
+
+/**
+ * Wait for modifications, coalescing them until none happened for debounce milliseconds.
+ * @param watch Watcher.
+ * @param debounce Quiet period ending a burst of modifications, in milliseconds.
+ * @param changes Where to print the sorted modified paths, one per line.
+ * @return 0 if modifications were printed, -1 if events were lost and modifications are unknown.
+ */
+int
+watch_wait(struct watch *watch, unsigned int debounce, FILE *changes) {
+	struct pollfd pollfd = { .fd = watch->fd, .events = POLLIN };
+	int ready;
+
+	watch->overflow = false;
+
+	/* Wait for a first modification, then for the burst to end. */
+	do {
+		watch_read(watch);
+	} while (watch->changes == NULL && !watch->overflow);
+
+	while (ready = poll(&pollfd, 1, debounce), ready != 0) {
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+		watch_read(watch);
+	}
+
+	twalk_r(watch->changes, watch_print, changes);
+	tdestroy(watch->changes, free);
+	watch->changes = NULL;
+
+	return watch->overflow ? -1 : 0;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef COMMON_WATCH_H
+#define COMMON_WATCH_H
+
+#include <stdio.h> /* FILE */
+
+struct watch;
+
+extern struct watch *watch_create(const char *root);
+
+extern int watch_wait(struct watch *watch, unsigned int debounce, FILE *changes);
+
+/* COMMON_WATCH_H */
+#endif
@@ -1,28 +1,101 @@
 /* SPDX-License-Identifier: AGPL-3.0-or-later */
-#include <stdio.h> /* fprintf */
+#include <stdio.h> /* fprintf, asprintf */
 #include <stdlib.h> /* exit, getenv, ... */
+#include <stdint.h> /* int64_t */
 #include <stdnoreturn.h> /* noreturn */
 #include <sys/wait.h> /* waitpid, ... */
 #include <string.h> /* strdup, memcpy, ... */
 #include <libgen.h> /* dirname */
-#include <unistd.h> /* getopt */
-#include <fcntl.h> /* open, ... */
+#include <unistd.h> /* getopt, fork, read, write */
+#include <fcntl.h> /* open, fcntl, ... */
+#include <time.h> /* clock_gettime */
 #include <err.h> /* warn, warnx, err */
 
 #include <orm.h>
 
 #include "common/bsysexec.h"
+#include "common/buildlog.h"
 #include "common/extract.h"
 #include "common/isdir.h"
+#include "common/metrics.h"
+#include "common/pathfilter.h"
+#include "common/trace.h"
 
 struct gitworm_args {
 	const char *path;
 	const char *toolchain, *bsys, *sysroot;
+	struct pathfilter sysrootfilter, srcfilter;
+	const char *trace, *log;
+	int tracefd, logfd;
 	unsigned int asroot : 1, rwsysroot : 1, rwsrcdir : 1;
+	unsigned int lean : 1;
 };
 
+/**
+ * Translate a gitignore-style pattern into a git glob pathspec.
+ * Unanchored patterns match at any depth, and patterns
+ * with a trailing slash only match directories' contents.
+ * @param magic Pathspec magic words.
+ * @param pattern Pattern to translate.
+ * @return The pathspec.
+ */
+static char *
+gitworm_pathspec(const char *magic, const char *pattern) {
+	const char * const slash = strchr(pattern, '/');
+	const char *prefix = "", *suffix = "";
+	char *pathspec;
+
+	if (*pattern == '/') {
+		pattern++;
+	} else if (slash == NULL || slash[1] == '\0') {
+		prefix = "**/";
+	}
+
+	if (*pattern != '\0' && pattern[strlen(pattern) - 1] == '/') {
+		suffix = "**";
+	}
+
+	if (asprintf(&pathspec, ":(%s)%s%s%s", magic, prefix, pattern, suffix) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	return pathspec;
+}
+
+/**
+ * Run git-archive(1) in a child process, and report its wait status
+ * through a pipe, as the sandboxed process may not be our parent anymore
+ * (lean sandboxes execute in a child process of a new PID namespace).
+ * @param path Repository path, or NULL for the current directory.
+ * @param treeish Tree to archive.
+ * @param filter Patterns passed as pathspecs.
+ * @param fd Archive output.
+ * @param statusfd Wait status output.
+ * @return Never
+ */
 noreturn static void
-gitworm_archive(const char *path, const char *treeish, int fd) {
+gitworm_archive(const char *path, const char *treeish, const struct pathfilter *filter, int fd, int statusfd) {
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid != 0) {
+		int wstatus;
+
+		close(fd);
+
+		if (waitpid(pid, &wstatus, 0) < 0) {
+			err(EXIT_FAILURE, "waitpid");
+		}
+
+		if (write(statusfd, &wstatus, sizeof (wstatus)) != sizeof (wstatus)) {
+			err(EXIT_FAILURE, "write");
+		}
+
+		exit(EXIT_SUCCESS);
+	}
 
 	if (path != NULL && chdir(path) != 0) {
 		err(EXIT_FAILURE, "chdir");
@@ -44,43 +117,60 @@ gitworm_archive(const char *path, const char *treeish, int fd) {
 	*(char *)mempcpy(name, execpath, execpathlen) = '/';
 	memcpy(name + execpathlen + 1, argv0, sizeof (argv0));
 
-	execl(name, argv0, "--format=tar", "--", treeish, NULL);
+	const char *argv[4 + filter->includescount + filter->excludescount + 1];
+	int argc = 0;
+
+	argv[argc++] = argv0;
+	argv[argc++] = "--format=tar";
+	argv[argc++] = treeish;
+	argv[argc++] = "--";
+	for (size_t i = 0; i < filter->includescount; i++) {
+		argv[argc++] = gitworm_pathspec("glob", filter->includes[i]);
+	}
+	for (size_t i = 0; i < filter->excludescount; i++) {
+		argv[argc++] = gitworm_pathspec("exclude,glob", filter->excludes[i]);
+	}
+	argv[argc] = NULL;
+
+	execv(name, (char **)argv);
 	err(-1, "exec %s", argv0);
 }
 
 static void
-gitworm_wait(pid_t pid) {
+gitworm_wait(int statusfd) {
 	int wstatus;
 
-	pid = waitpid(pid, &wstatus, 0);
-	if (pid < 0) {
-		err(EXIT_FAILURE, "waitpid");
+	if (read(statusfd, &wstatus, sizeof (wstatus)) != sizeof (wstatus)) {
+		errx(EXIT_FAILURE, "Unable to read git-archive status");
 	}
+	close(statusfd);
 
 	if (wstatus != 0) {
 		if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0) {
-			errx(EXIT_FAILURE, "Process %d exited with status %d", pid, WEXITSTATUS(wstatus));
+			errx(EXIT_FAILURE, "git-archive exited with status %d", WEXITSTATUS(wstatus));
 		} else if (WIFSIGNALED(wstatus)) {
-			errx(EXIT_FAILURE, "Process %d killed by signal %d", pid, WTERMSIG(wstatus));
+			errx(EXIT_FAILURE, "git-archive killed by signal %d", WTERMSIG(wstatus));
 		} else if (WCOREDUMP(wstatus)) {
-			errx(EXIT_FAILURE, "Process %d dumped core", pid);
+			errx(EXIT_FAILURE, "git-archive dumped core");
 		}
 	}
 }
 
 noreturn static void
-gitworm_exec(const struct gitworm_args *args, int argc, char **argv, pid_t pid, int fd) {
+gitworm_exec(const struct gitworm_args *args, int argc, char **argv, int statusfd, int fd) {
 	struct orm_sandbox_description description = {
-		.asroot = args->asroot,
+		.asroot = args->asroot, .lean = args->lean,
 	};
 
 	/* Open or describe sysroot. */
-	int sysrootfd;
+	int sysrootfd = -1;
 	if (!isdir(args->sysroot)) {
 		sysrootfd = open(args->sysroot, O_RDONLY | O_CLOEXEC);
 		if (sysrootfd < 0) {
 			err(EXIT_FAILURE, "open '%s'", args->sysroot);
 		}
+	} else if (!pathfilter_empty(&args->sysrootfilter)) {
+		errx(EXIT_FAILURE, "Cannot filter sysroot directory '%s'", args->sysroot);
 	} else {
 		description.sysroot = args->sysroot;
 		description.rosysroot = !args->rwsysroot;
@@ -103,29 +193,91 @@ gitworm_exec(const struct gitworm_args *args, int argc, char **argv, pid_t pid,
 	description.bsysdir = dirname(strdupa(bsyspath));
 	bsysname = basename(strdupa(bsyspath));
 
+	struct metrics * const metrics = metrics_open("gitworm", args->toolchain);
+
 	/* Enter the sandbox. */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (orm_sandbox(&description, getuid(), getgid()) != 0) {
 		err(EXIT_FAILURE, "Unable to enter toolbox");
 	}
+	metrics_record(metrics, METRICS_SANDBOX_SECONDS, metrics_elapsed(&start));
+
+	/* Extract sysroot archive if not mounted directory, concurrently with srcdir,
+	 * so git-archive never waits for the sysroot to drain its pipe. */
+	struct extract_thread sysrootthread = {
+		.extract = extract, .output = "/var/sysroot",
+		.ro = !args->rwsysroot, .fd = sysrootfd, .filter = &args->sysrootfilter,
+	};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (description.sysroot == NULL) {
+		extract_start(&sysrootthread);
+	}
+
+	/* Extract srcdir from pipe, already filtered by git-archive. */
+	int64_t extracted = extract("/var/src", !args->rwsrcdir, fd, NULL);
 
-	/* Extract sysroot archive if not mounted directory. */
 	if (description.sysroot == NULL) {
-		extract("/var/sysroot", !args->rwsysroot, sysrootfd);
+		extract_join(&sysrootthread);
+		extracted += sysrootthread.size;
+	}
+
+	metrics_record(metrics, METRICS_EXTRACT_SECONDS, metrics_elapsed(&start));
+	metrics_record(metrics, METRICS_EXTRACT_BYTES, extracted);
+
+	gitworm_wait(statusfd);
+
+	/* Reap the status reporter, if still our child. */
+	(void)waitpid(-1, NULL, 0);
+
+	if (args->trace == NULL && args->log == NULL && metrics == NULL) {
+		bsysexec(bsysname, argv + optind, argc - optind);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct buildlog * const log = args->log != NULL ? buildlog_create(args->log, args->logfd) : NULL;
+	int listener, wstatus;
+	const pid_t pid = args->trace != NULL ? trace_fork(&listener) : fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
 	}
 
-	/* Extract srcdir from pipe. */
-	extract("/var/src", !args->rwsrcdir, fd);
+	if (pid == 0) {
+		if (log != NULL) {
+			buildlog_redirect(log);
+		}
+		bsysexec(bsysname, argv + optind, argc - optind);
+	}
 
-	gitworm_wait(pid);
+	if (log != NULL) {
+		buildlog_start(log);
+	}
 
-	bsysexec(bsysname, argv + optind, argc - optind);
+	if (args->trace != NULL) {
+		trace_supervise(listener, &args->tracefd, 1);
+	}
+
+	if (waitpid(pid, &wstatus, 0) < 0) {
+		err(EXIT_FAILURE, "waitpid");
+	}
+	metrics_record(metrics, METRICS_BSYS_SECONDS, metrics_elapsed(&start));
+
+	if (log != NULL) {
+		buildlog_finish(log, wstatus != 0);
+	}
+
+	metrics_commit(metrics, wstatus == 0);
+
+	exit(WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : EXIT_FAILURE);
 }
 
 noreturn static void
 gitworm_usage(const char *progname, int status) {
 
 	fprintf(stderr,
-		"usage: %1$s [-SUr] [-C <path>] [-t <toolchain>] [-b <bsys>] [-u <sysroot>] <tree-ish> [<arguments>...]\n"
+		"usage: %1$s [-SUlr] [-T <trace>] [-L <log>] [-C <path>] [-I <pattern>] [-X <pattern>] [-t <toolchain>] [-b <bsys>]"
+			" [-u <sysroot>] [-J <pattern>] [-Y <pattern>] <tree-ish> [<arguments>...]\n"
 		"       %1$s -h\n",
 		progname);
 
@@ -141,16 +293,23 @@ gitworm_parse_args(int argc, char **argv) {
 	};
 	int c;
 
-	while ((c = getopt(argc, argv, ":hSUrC:t:b:u:")) >= 0) {
+	while ((c = getopt(argc, argv, ":hSUlrT:L:C:t:b:u:I:X:J:Y:")) >= 0) {
 		switch (c) {
 		case 'h': gitworm_usage(*argv, EXIT_SUCCESS);
 		case 'S': args.rwsrcdir = 1; break;
 		case 'U': args.rwsysroot = 1; break;
+		case 'l': args.lean = 1; break;
 		case 'r': args.asroot = 1; break;
+		case 'T': args.trace = optarg; break;
+		case 'L': args.log = optarg; break;
 		case 'C': args.path = optarg; break;
 		case 't': args.toolchain = optarg; break;
 		case 'b': args.bsys = optarg; break;
 		case 'u': args.sysroot = optarg; break;
+		case 'I': pathfilter_include(&args.srcfilter, optarg); break;
+		case 'X': pathfilter_exclude(&args.srcfilter, optarg); break;
+		case 'J': pathfilter_include(&args.sysrootfilter, optarg); break;
+		case 'Y': pathfilter_exclude(&args.sysrootfilter, optarg); break;
 		case ':':
 			warnx("Option -%c requires an operand", optopt);
 			gitworm_usage(*argv, EXIT_FAILURE);
@@ -182,24 +341,48 @@ gitworm_parse_args(int argc, char **argv) {
 
 int
 main(int argc, char *argv[]) {
-	const struct gitworm_args args = gitworm_parse_args(argc, argv);
+	struct gitworm_args args = gitworm_parse_args(argc, argv);
 	const char * const treeish = argv[optind++];
 
-	int pipefd[2];
-	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+	/* Open the trace and log now, the host's filesystem is unreachable from the sandbox. */
+	args.tracefd = -1;
+	if (args.trace != NULL) {
+		args.tracefd = open(args.trace, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (args.tracefd < 0) {
+			err(EXIT_FAILURE, "open '%s'", args.trace);
+		}
+	}
+
+	args.logfd = -1;
+	if (args.log != NULL) {
+		args.logfd = open(args.log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (args.logfd < 0) {
+			err(EXIT_FAILURE, "open '%s'", args.log);
+		}
+	}
+
+	int pipefd[2], statusfd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0 || pipe2(statusfd, O_CLOEXEC) < 0) {
 		err(EXIT_FAILURE, "pipe");
 	}
 
+	/* Let git-archive run ahead of the extraction by a whole read, if
+	 * the pipe size limit allows it, the default size is only a few pages. */
+	(void)fcntl(pipefd[0], F_SETPIPE_SZ, CONFIG_ARCHIVE_INPUT_BLOCK_SIZE);
+
 	const pid_t pid = fork();
 	if (pid < 0) {
 		err(EXIT_FAILURE, "fork");
 	}
 
 	if (pid == 0) {
-		gitworm_archive(args.path, treeish, pipefd[1]);
+		close(pipefd[0]);
+		close(statusfd[0]);
+		gitworm_archive(args.path, treeish, &args.srcfilter, pipefd[1], statusfd[1]);
 	}
 
 	close(pipefd[1]);
+	close(statusfd[1]);
 
-	gitworm_exec(&args, argc, argv, pid, pipefd[0]);
+	gitworm_exec(&args, argc, argv, statusfd[0], pipefd[0]);
 }
@@ -1,32 +1,70 @@
 /* SPDX-License-Identifier: AGPL-3.0-or-later */
-#include <stdio.h> /* fprintf */
-#include <stdlib.h> /* exit, getenv */
+#include <stdio.h> /* fprintf, snprintf, fdopen, fputs, ... */
+#include <stdlib.h> /* exit, getenv, malloc, free, strtoll */
 #include <stdbool.h> /* bool */
 #include <stdnoreturn.h> /* noreturn */
+#include <stdatomic.h> /* atomic_uint, atomic_fetch_sub */
+#include <stdint.h> /* intmax_t, int64_t */
+#include <pthread.h> /* pthread_create, ... */
 #include <sys/wait.h> /* waitpid, ... */
 #include <sys/mount.h> /* mount */
 #include <sys/stat.h> /* stat */
-#include <string.h> /* strdup, memcpy */
+#include <dirent.h> /* scandir */
+#include <search.h> /* tsearch, tdestroy */
+#include <string.h> /* strdup, memcpy, stpcpy, strtok_r */
 #include <libgen.h> /* dirname, basename */
 #include <alloca.h> /* alloca */
+#include <unistd.h> /* sysconf, execvp, lseek, pread, pipe2, fsync */
 #include <fcntl.h> /* fcntl, open */
+#include <errno.h> /* errno, ENXIO */
+#include <time.h> /* clock_gettime */
 #include <err.h> /* warn, warnx, err */
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <openssl/evp.h>
 #include <orm.h>
+#include <probes.h>
 
 #include "common/bsysexec.h"
+#include "common/buildlog.h"
 #include "common/cmdpath.h"
 #include "common/extract.h"
 #include "common/isdir.h"
+#include "common/metrics.h"
+#include "common/pathfilter.h"
+#include "common/prefetch.h"
+#include "common/trace.h"
+#include "common/warmup.h"
+
+ORM_PROBE_DEFINE(bsys);
+ORM_PROBE_DEFINE(bsys_done);
+ORM_PROBE_DEFINE(archive);
+ORM_PROBE_DEFINE(archive_entry);
+ORM_PROBE_DEFINE(archive_entry_done);
+ORM_PROBE_DEFINE(archive_output_full);
+ORM_PROBE_DEFINE(archive_done);
+
+struct lndworm_output {
+	const char *path, *format, *filter;
+	struct pathfilter rules;
+	unsigned int manifest : 1;
+	int fd;
+};
 
 struct lndworm_args {
 	const char *format, *filter;
 	const char *toolchain, *bsys;
 	const char *sysroot, *src;
+	struct pathfilter sysrootfilter, srcfilter;
+	struct lndworm_output *outputs;
+	size_t outputscount;
+	const char *trace, *log;
+	int tracefd, logfd, srcfd;
 	unsigned int intop : 1, pkgobj : 1;
 	unsigned int asroot : 1, rwsysroot : 1, rwsrcdir : 1;
+	unsigned int lean : 1, reproducible : 1;
+	time_t epoch;
 };
 
 static int
@@ -53,10 +91,12 @@ lndworm_wait(pid_t pid) {
 	return 0;
 }
 
-static void
-lndworm_extract_ignore_toplevel(const char *output, unsigned int ro, int fd) {
+static int64_t
+lndworm_extract_ignore_toplevel(const char *output, unsigned int ro, int fd, const struct pathfilter *filter) {
 	struct archive *out, *in;
 
+	ORM_PROBE1(extract, output);
+
 	extract_prepare(fd, &out, &in);
 
 	int status;
@@ -72,29 +112,17 @@ lndworm_extract_ignore_toplevel(const char *output, unsigned int ro, int fd) {
 		errx(EXIT_FAILURE, "Ignored toplevel entry '%s' is not a directory", toplevel);
 	}
 
-	const size_t toplevellen = strlen(toplevel);
-	const size_t outputlen = strlen(output);
 	while (status = archive_read_next_header(in, &entry), status == ARCHIVE_OK) {
-		const char *inpathname = archive_entry_pathname(entry);
-		size_t inpathnamelen = strlen(inpathname);
-
-		if (inpathnamelen < toplevellen
-			|| strncmp(inpathname, toplevel, toplevellen) != 0) {
-			warnx("Ignored toplevel entry '%s' as it is not under '%s'", inpathname, toplevel);
+		if (!extract_filter(entry, toplevel, filter)) {
 			continue;
 		}
 
-		inpathname += toplevellen;
-		while (*inpathname == '/') {
-			inpathname++;
+		if (!extract_rebase(entry, output, toplevel)) {
+			warnx("Ignored toplevel entry '%s' as it is not under '%s'", archive_entry_pathname(entry), toplevel);
+			continue;
 		}
-		inpathnamelen = strlen(inpathname);
-
-		char outpathname[outputlen + 1 + inpathnamelen + 1];
-		*(char *)mempcpy(outpathname, output, outputlen) = '/';
-		memcpy(outpathname + outputlen + 1, inpathname, inpathnamelen + 1);
 
-		archive_entry_copy_pathname(entry, outpathname);
+		ORM_PROBE2(extract_entry, archive_entry_pathname(entry), archive_entry_size(entry));
 
 		status = archive_write_header(out, entry);
 		if (status != ARCHIVE_OK) {
@@ -102,138 +130,1256 @@ lndworm_extract_ignore_toplevel(const char *output, unsigned int ro, int fd) {
 		}
 
 		archive_copy_to_disk(in, out);
+
+		ORM_PROBE2(extract_entry_done, archive_entry_pathname(entry), archive_entry_size(entry));
 	}
 
-	extract_finish(output, ro, fd, status, out, in);
+	const int64_t size = extract_finish(output, ro, fd, status, out, in);
+
+	ORM_PROBE1(extract_done, output);
+
+	return size;
 }
 
 static void
-lndworm_archive_copy_from_disk(const char *sourcepath, struct archive *out) {
-	static char buffer[CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE];
-	const int fd = open(sourcepath, O_RDONLY);
-	ssize_t copied;
+lndworm_archive_write(struct archive *out, const void *buffer, size_t size) {
+	la_ssize_t written;
+	size_t total = 0;
 
-	if (fd < 0) {
-		err(EXIT_FAILURE, "open '%s'", sourcepath);
+	while (written = archive_write_data(out, (const char *)buffer + total, size - total),
+		written >= 0 && (total += written) != size);
+
+	if (written < 0) {
+		errx(EXIT_FAILURE, "archive_write_data: %s", archive_error_string(out));
 	}
+}
 
-	while (copied = read(fd, buffer, sizeof (buffer)), copied > 0) {
-		la_ssize_t written;
-		size_t total = 0;
+static const char lndworm_zeroes[CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE];
+
+static void
+lndworm_archive_write_hole(struct archive *out, off_t length) {
 
-		while (written = archive_write_data(out, buffer + total, copied - total),
-			written >= 0 && (total += written) != copied);
+	while (length != 0) {
+		const size_t size = length < sizeof (lndworm_zeroes) ? length : sizeof (lndworm_zeroes);
 
-		if (written < 0) {
-			errx(EXIT_FAILURE, "archive_write_data: %s", archive_error_string(out));
+		lndworm_archive_write(out, lndworm_zeroes, size);
+		length -= size;
+	}
+}
+
+/**
+ * Describe the data segments of a regular file in its entry,
+ * so formats supporting sparse files only store their data.
+ * Files without any hole are left undescribed.
+ * @param sourcepath Path of the file, for error reporting.
+ * @param fd Opened file descriptor of the file.
+ * @param entry Entry of the file.
+ */
+static void
+lndworm_archive_sparse(const char *sourcepath, int fd, struct archive_entry *entry) {
+	const off_t size = archive_entry_size(entry);
+	off_t data, hole = 0;
+
+	archive_entry_sparse_clear(entry);
+
+	while (hole < size && (data = lseek(fd, hole, SEEK_DATA)) >= 0) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) {
+			err(EXIT_FAILURE, "lseek '%s'", sourcepath);
+		}
+
+		if (hole > size) {
+			hole = size;
 		}
+
+		if (data == 0 && hole == size) {
+			return;
+		}
+
+		archive_entry_sparse_add_entry(entry, data, hole - data);
 	}
 
-	if (copied < 0) {
-		err(EXIT_FAILURE, "read '%s'", sourcepath);
+	if (hole < size) {
+		/* Either the filesystem doesn't know about holes, or the file ends with one. */
+		if (errno != ENXIO) {
+			archive_entry_sparse_clear(entry);
+			return;
+		}
+
+		archive_entry_sparse_add_entry(entry, size, 0);
 	}
+}
 
-	close(fd);
+/**
+ * Copy the data of a regular file, as described by its entry.
+ * Holes are never read, but fed as zeroes to the format,
+ * which discards them if it supports sparse files.
+ * @param sourcepath Path of the file, for error reporting.
+ * @param fd Opened file descriptor of the file.
+ * @param entry Entry of the file.
+ * @param out Output archive.
+ */
+static void
+lndworm_archive_copy_from_disk(const char *sourcepath, int fd, struct archive_entry *entry, struct archive *out) {
+	static _Thread_local char buffer[CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE];
+	const off_t size = archive_entry_size(entry);
+	off_t offset = 0, length;
+
+	if (archive_entry_sparse_reset(entry) == 0) {
+		offset = 0;
+		length = size;
+	} else if (archive_entry_sparse_next(entry, &offset, &length) != ARCHIVE_OK) {
+		offset = size;
+		length = 0;
+	}
+
+	off_t position = 0;
+	while (position < size) {
+		ssize_t copied;
+
+		lndworm_archive_write_hole(out, offset - position);
+		position = offset;
+
+		while (length != 0 && (copied = pread(fd, buffer,
+			length < sizeof (buffer) ? length : sizeof (buffer), position)) > 0) {
+			lndworm_archive_write(out, buffer, copied);
+			position += copied;
+			length -= copied;
+		}
+
+		if (length != 0) {
+			if (copied < 0) {
+				err(EXIT_FAILURE, "read '%s'", sourcepath);
+			}
+			/* File truncated since its entry was read, let the format pad it. */
+			break;
+		}
+
+		if (archive_entry_sparse_next(entry, &offset, &length) != ARCHIVE_OK) {
+			offset = size;
+			length = 0;
+		}
+	}
 }
 
+/**
+ * Write an entry, and its data if it has a body.
+ * @param out Output archive.
+ * @param entry Entry to write.
+ */
 static void
-lndworm_archive_create(const char *input, const char *format, const char *filter, const char *output, int fd) {
-	struct archive * const out = archive_write_new(), * const in = archive_read_disk_new();
+lndworm_archive_write_entry(struct archive *out, struct archive_entry *entry) {
+	const char * const sourcepath = archive_entry_sourcepath(entry);
+	int fd = -1;
+
+	if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0) {
+		fd = open(sourcepath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			err(EXIT_FAILURE, "open '%s'", sourcepath);
+		}
 
-	if (archive_read_disk_set_symlink_physical(in) != ARCHIVE_OK) {
-		errx(EXIT_FAILURE, "archive_read_disk_set_symlink_physical: %s", archive_error_string(in));
+		lndworm_archive_sparse(sourcepath, fd, entry);
 	}
 
-	if (archive_read_disk_set_standard_lookup(in) != ARCHIVE_OK) {
-		errx(EXIT_FAILURE, "archive_read_disk_set_standard_lookup: %s", archive_error_string(in));
+	if (archive_write_header(out, entry) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_write_header: %s", archive_error_string(out));
 	}
 
-	if (archive_read_disk_open(in, input) != ARCHIVE_OK) {
-		errx(EXIT_FAILURE, "archive_read_disk_open: %s", archive_error_string(in));
+	if (fd >= 0) {
+		lndworm_archive_copy_from_disk(sourcepath, fd, entry, out);
+		close(fd);
 	}
+}
 
-	if (format != NULL) {
-		if (archive_write_set_format_by_name(out, format) != ARCHIVE_OK) {
+/**
+ * Write an entry through the hardlink resolver, which may
+ * turn it into a hardlink, defer it, or release deferred ones.
+ * @param out Output archive.
+ * @param resolver Hardlink resolver of out.
+ * @param entry Entry to write, NULL to release one deferred entry.
+ * @return Whether an entry was written.
+ */
+static bool
+lndworm_archive_linkify(struct archive *out,
+	struct archive_entry_linkresolver *resolver, struct archive_entry *entry) {
+	struct archive_entry *spare;
+
+	archive_entry_linkify(resolver, &entry, &spare);
+
+	if (entry != NULL) {
+		lndworm_archive_write_entry(out, entry);
+		archive_entry_free(entry);
+	}
+
+	if (spare != NULL) {
+		lndworm_archive_write_entry(out, spare);
+		archive_entry_free(spare);
+	}
+
+	return entry != NULL;
+}
+
+struct lndworm_block {
+	atomic_uint references;
+	off_t offset;
+	size_t size;
+	char data[];
+};
+
+/**
+ * Message sent to a writer: a new entry, a block of
+ * the last entry's data, or neither to close the archive.
+ */
+struct lndworm_message {
+	struct archive_entry *entry;
+	struct lndworm_block *block;
+};
+
+struct lndworm_writer {
+	const struct lndworm_output *output;
+	struct archive *out;
+	struct archive_entry_linkresolver *resolver;
+	EVP_MD_CTX *digest;
+	FILE *manifest;
+	pthread_mutex_t mutex;
+	pthread_cond_t notempty, notfull;
+	struct lndworm_message queue[CONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH];
+	unsigned int head, count;
+	pthread_t thread;
+};
+
+static void
+lndworm_block_release(struct lndworm_block *block) {
+	if (atomic_fetch_sub(&block->references, 1) == 1) {
+		free(block);
+	}
+}
+
+static void
+lndworm_writer_push(struct lndworm_writer *writer, struct archive_entry *entry, struct lndworm_block *block) {
+
+	pthread_mutex_lock(&writer->mutex);
+	while (writer->count == CONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH) {
+		ORM_PROBE1(archive_output_full, writer->output->path);
+		pthread_cond_wait(&writer->notfull, &writer->mutex);
+	}
+
+	writer->queue[(writer->head + writer->count) % CONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH]
+		= (struct lndworm_message) { .entry = entry, .block = block };
+	writer->count++;
+
+	pthread_cond_signal(&writer->notempty);
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+static struct lndworm_message
+lndworm_writer_pop(struct lndworm_writer *writer) {
+
+	pthread_mutex_lock(&writer->mutex);
+	while (writer->count == 0) {
+		pthread_cond_wait(&writer->notempty, &writer->mutex);
+	}
+
+	const struct lndworm_message message = writer->queue[writer->head];
+	writer->head = (writer->head + 1) % CONFIG_ARCHIVE_OUTPUT_QUEUE_DEPTH;
+	writer->count--;
+
+	pthread_cond_signal(&writer->notfull);
+	pthread_mutex_unlock(&writer->mutex);
+
+	return message;
+}
+
+/**
+ * Write a new entry's header through the hardlink resolver.
+ * @param writer Writer of the entry.
+ * @param entry Entry to write, its data following in the queue.
+ * @return The entry if its data must be written from the queue, NULL otherwise.
+ */
+static struct archive_entry *
+lndworm_writer_start(struct lndworm_writer *writer, struct archive_entry *entry) {
+	struct archive_entry *linked = entry, *spare;
+
+	archive_entry_linkify(writer->resolver, &linked, &spare);
+
+	if (linked == entry) {
+		if (archive_write_header(writer->out, entry) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_write_header: %s", archive_error_string(writer->out));
+		}
+
+		if (archive_entry_filetype(entry) != AE_IFREG || archive_entry_size(entry) == 0) {
+			archive_entry_free(entry);
+			linked = NULL;
+		}
+	} else if (linked != NULL) {
+		/* Deferred entries are released later, and read back from the disk. */
+		lndworm_archive_write_entry(writer->out, linked);
+		archive_entry_free(linked);
+		linked = NULL;
+	}
+
+	if (spare != NULL) {
+		lndworm_archive_write_entry(writer->out, spare);
+		archive_entry_free(spare);
+	}
+
+	return linked;
+}
+
+/**
+ * Pad the entry being written, and release it.
+ * Trailing holes, or truncated files, are padded with zeroes.
+ * @param writer Writer of the entry.
+ * @param entry Entry being written, or NULL.
+ * @param position Position reached in the entry's data.
+ */
+static void
+lndworm_writer_finish(struct lndworm_writer *writer, struct archive_entry *entry, off_t position) {
+	if (entry != NULL) {
+		lndworm_archive_write_hole(writer->out, archive_entry_size(entry) - position);
+		archive_entry_free(entry);
+	}
+}
+
+/**
+ * Writer thread, writing entries and the data blocks they
+ * receive to their archive, until they receive an empty message.
+ * @param data Writer.
+ * @return NULL
+ */
+static void *
+lndworm_writer_run(void *data) {
+	struct lndworm_writer * const writer = data;
+	struct archive_entry *entry = NULL;
+	struct lndworm_message message;
+	off_t position = 0;
+
+	while (message = lndworm_writer_pop(writer), message.entry != NULL || message.block != NULL) {
+
+		if (message.block != NULL) {
+			if (entry != NULL) {
+				lndworm_archive_write_hole(writer->out, message.block->offset - position);
+				lndworm_archive_write(writer->out, message.block->data, message.block->size);
+				position = message.block->offset + message.block->size;
+			}
+			lndworm_block_release(message.block);
+			continue;
+		}
+
+		lndworm_writer_finish(writer, entry, position);
+		entry = lndworm_writer_start(writer, message.entry);
+		position = 0;
+	}
+
+	lndworm_writer_finish(writer, entry, position);
+
+	/* Write entries which hardlinks were not all found. */
+	while (lndworm_archive_linkify(writer->out, writer->resolver, NULL));
+
+	if (archive_write_close(writer->out) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_write_close '%s': %s", writer->output->path, archive_error_string(writer->out));
+	}
+
+	return NULL;
+}
+
+static void
+lndworm_manifest_hole(struct lndworm_writer *writer, off_t length) {
+
+	while (length != 0) {
+		const size_t size = length < sizeof (lndworm_zeroes) ? length : sizeof (lndworm_zeroes);
+
+		if (EVP_DigestUpdate(writer->digest, lndworm_zeroes, size) != 1) {
+			errx(EXIT_FAILURE, "EVP_DigestUpdate");
+		}
+		length -= size;
+	}
+}
+
+/**
+ * Print the manifest line of an entry, and release it.
+ * Lines are made of the entry's digest, mode, size and path, entries
+ * without content having a dash digest and a zero size. Backslashes
+ * and newlines of the path are escaped.
+ * @param writer Manifest writer.
+ * @param entry Entry being digested, or NULL.
+ * @param position Position reached in the entry's data.
+ */
+static void
+lndworm_manifest_finish(struct lndworm_writer *writer, struct archive_entry *entry, off_t position) {
+	static const char hexdigits[] = "0123456789abcdef";
+	char hex[EVP_MAX_MD_SIZE * 2 + 1] = "-";
+
+	if (entry == NULL) {
+		return;
+	}
+
+	const mode_t type = archive_entry_filetype(entry);
+	intmax_t size = 0;
+	if (type == AE_IFREG || type == AE_IFLNK) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int length;
+
+		if (type == AE_IFREG) {
+			lndworm_manifest_hole(writer, archive_entry_size(entry) - position);
+		}
+
+		if (EVP_DigestFinal_ex(writer->digest, digest, &length) != 1) {
+			errx(EXIT_FAILURE, "EVP_DigestFinal_ex");
+		}
+
+		for (unsigned int i = 0; i < length; i++) {
+			hex[i * 2] = hexdigits[digest[i] >> 4];
+			hex[i * 2 + 1] = hexdigits[digest[i] & 0xF];
+		}
+		hex[length * 2] = '\0';
+		size = archive_entry_size(entry);
+	}
+
+	fprintf(writer->manifest, "%s %06o %jd ", hex, (unsigned int)archive_entry_mode(entry), size);
+
+	for (const char *pathname = archive_entry_pathname(entry); *pathname != '\0'; pathname++) {
+		switch (*pathname) {
+		case '\\': fputs("\\\\", writer->manifest); break;
+		case '\n': fputs("\\n", writer->manifest); break;
+		default: putc(*pathname, writer->manifest); break;
+		}
+	}
+	putc('\n', writer->manifest);
+
+	archive_entry_free(entry);
+}
+
+/**
+ * Manifest thread, digesting entries and the data blocks they
+ * receive, until they receive an empty message. Symbolic links
+ * are digested from their target. OpenSSL selects the fastest
+ * SHA-256 implementation for the processor, and hashing happens
+ * concurrently to the archives' compressions.
+ * @param data Writer of the manifest.
+ * @return NULL
+ */
+static void *
+lndworm_manifest_run(void *data) {
+	struct lndworm_writer * const writer = data;
+	struct archive_entry *entry = NULL;
+	struct lndworm_message message;
+	off_t position = 0;
+
+	while (message = lndworm_writer_pop(writer), message.entry != NULL || message.block != NULL) {
+
+		if (message.block != NULL) {
+			lndworm_manifest_hole(writer, message.block->offset - position);
+			if (EVP_DigestUpdate(writer->digest, message.block->data, message.block->size) != 1) {
+				errx(EXIT_FAILURE, "EVP_DigestUpdate");
+			}
+			position = message.block->offset + message.block->size;
+			lndworm_block_release(message.block);
+			continue;
+		}
+
+		lndworm_manifest_finish(writer, entry, position);
+		entry = message.entry;
+		position = 0;
+
+		if (EVP_DigestInit_ex(writer->digest, EVP_sha256(), NULL) != 1) {
+			errx(EXIT_FAILURE, "EVP_DigestInit_ex");
+		}
+
+		const char * const symlink = archive_entry_symlink(entry);
+		if (archive_entry_filetype(entry) == AE_IFLNK && symlink != NULL
+			&& EVP_DigestUpdate(writer->digest, symlink, strlen(symlink)) != 1) {
+			errx(EXIT_FAILURE, "EVP_DigestUpdate");
+		}
+	}
+
+	lndworm_manifest_finish(writer, entry, position);
+
+	if (fflush(writer->manifest) != 0 || ferror(writer->manifest)) {
+		errx(EXIT_FAILURE, "Unable to write manifest '%s'", writer->output->path);
+	}
+
+	return NULL;
+}
+
+/**
+ * Check whether an archive compresses with gzip(1),
+ * which headers store a timestamp by default.
+ * @param out Output archive.
+ * @return Whether a gzip filter is used.
+ */
+static bool
+lndworm_archive_gzip(struct archive *out) {
+	const int count = archive_filter_count(out);
+
+	for (int i = 0; i < count; i++) {
+		if (archive_filter_code(out, i) == ARCHIVE_FILTER_GZIP) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+lndworm_writer_init(struct lndworm_writer *writer, const struct lndworm_output *output, bool reproducible) {
+
+	pthread_mutex_init(&writer->mutex, NULL);
+	pthread_cond_init(&writer->notempty, NULL);
+	pthread_cond_init(&writer->notfull, NULL);
+	writer->output = output;
+	writer->head = 0;
+	writer->count = 0;
+
+	if (output->manifest) {
+		writer->out = NULL;
+		writer->resolver = NULL;
+
+		writer->digest = EVP_MD_CTX_new();
+		if (writer->digest == NULL) {
+			errx(EXIT_FAILURE, "EVP_MD_CTX_new");
+		}
+
+		/* The descriptor is fsync'd once the manifest is complete. */
+		writer->manifest = fdopen(dup(output->fd), "w");
+		if (writer->manifest == NULL) {
+			err(EXIT_FAILURE, "fdopen '%s'", output->path);
+		}
+
+		errno = pthread_create(&writer->thread, NULL, lndworm_manifest_run, writer);
+		if (errno != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+
+		return;
+	}
+
+	struct archive * const out = archive_write_new();
+
+	writer->digest = NULL;
+	writer->manifest = NULL;
+	writer->out = out;
+	writer->resolver = archive_entry_linkresolver_new();
+	if (writer->resolver == NULL) {
+		errx(EXIT_FAILURE, "archive_entry_linkresolver_new: Unable to allocate hardlink resolver");
+	}
+
+	if (output->format != NULL) {
+		if (archive_write_set_format_by_name(out, output->format) != ARCHIVE_OK) {
 			errx(EXIT_FAILURE, "archive_write_set_format_by_name: %s", archive_error_string(out));
 		}
-		if (filter != NULL && archive_write_add_filter_by_name(out, filter) != ARCHIVE_OK) {
+		if (output->filter != NULL && archive_write_add_filter_by_name(out, output->filter) != ARCHIVE_OK) {
 			errx(EXIT_FAILURE, "archive_write_add_filter_by_name: %s", archive_error_string(out));
 		}
 	} else {
-		if (archive_write_set_format_filter_by_ext(out, output) != ARCHIVE_OK) {
-			errx(EXIT_FAILURE, "archive_write_set_format_filter_by_ext: %s", archive_error_string(out));
+		if (archive_write_set_format_filter_by_ext(out, output->path) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_write_set_format_filter_by_ext '%s': %s", output->path, archive_error_string(out));
 		}
 	}
 
-	if (archive_write_open_fd(out, fd) != ARCHIVE_OK) {
+	if (reproducible && lndworm_archive_gzip(out)
+		&& archive_write_set_filter_option(out, "gzip", "timestamp", NULL) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_write_set_filter_option: %s", archive_error_string(out));
+	}
+
+	archive_entry_linkresolver_set_strategy(writer->resolver, archive_format(out));
+
+	if (archive_write_open_fd(out, output->fd) != ARCHIVE_OK) {
 		errx(EXIT_FAILURE, "archive_write_open_fd: %s", archive_error_string(out));
 	}
 
+	errno = pthread_create(&writer->thread, NULL, lndworm_writer_run, writer);
+	if (errno != 0) {
+		err(EXIT_FAILURE, "pthread_create");
+	}
+}
+
+static void
+lndworm_writer_deinit(struct lndworm_writer *writer) {
+
+	lndworm_writer_push(writer, NULL, NULL);
+	pthread_join(writer->thread, NULL);
+
+	pthread_cond_destroy(&writer->notfull);
+	pthread_cond_destroy(&writer->notempty);
+	pthread_mutex_destroy(&writer->mutex);
+
+	if (writer->output->manifest) {
+		fclose(writer->manifest);
+		EVP_MD_CTX_free(writer->digest);
+	} else {
+		archive_entry_linkresolver_free(writer->resolver);
+		archive_write_free(writer->out);
+	}
+}
+
+/**
+ * Send an entry, and its data read only once, to all the writers of
+ * outputs it belongs to. The first output receives entries of no other
+ * output with rules, directories being sent wherever they may be needed.
+ * @param writers Writers of all outputs.
+ * @param count Number of writers.
+ * @param entry Entry to send, consumed.
+ */
+static void
+lndworm_archive_fanout(struct lndworm_writer *writers, size_t count, struct archive_entry *entry) {
+	const char * const pathname = archive_entry_pathname(entry);
+	const bool isdir = archive_entry_filetype(entry) == AE_IFDIR;
+	const la_int64_t size = archive_entry_size(entry);
+	bool matches[count], claimed = false;
+	unsigned int references = 0;
+
+	/* The entry may be freed by writers before its _done probe. */
+	ORM_PROBE2(archive_entry, pathname, size);
+
+	for (size_t i = 1; i < count; i++) {
+		const struct pathfilter * const rules = &writers[i].output->rules;
+
+		if (pathfilter_empty(rules)) {
+			matches[i] = true;
+		} else {
+			matches[i] = pathfilter_match(rules, pathname, isdir);
+			claimed |= matches[i] && !isdir;
+		}
+		references += matches[i];
+	}
+	matches[0] = !claimed;
+	references += matches[0];
+
+	if (references == 0) {
+		archive_entry_free(entry);
+		ORM_PROBE1(archive_entry_done, size);
+		return;
+	}
+
+	const char * const sourcepath = archive_entry_sourcepath(entry);
+	int fd = -1;
+
+	if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0) {
+		fd = open(sourcepath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			err(EXIT_FAILURE, "open '%s'", sourcepath);
+		}
+
+		lndworm_archive_sparse(sourcepath, fd, entry);
+	}
+
+	/* Only data segments are read, holes being filled by writers.
+	 * They are listed before the entry is sent, as writers iterate
+	 * its sparse map too. Without a map, the whole file is data.
+	 * Heavily fragmented files can have too many for the stack. */
+	const int segmentscount = fd >= 0 ? archive_entry_sparse_reset(entry) : 0;
+	struct { la_int64_t offset, length; } * const segments = malloc((segmentscount > 0 ? segmentscount : 1) * sizeof (*segments));
+	int segment = 0;
+
+	if (segments == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (segmentscount == 0) {
+		segments[0].offset = 0;
+		segments[0].length = archive_entry_size(entry);
+	}
+	while (segment < segmentscount
+		&& archive_entry_sparse_next(entry, &segments[segment].offset, &segments[segment].length) == ARCHIVE_OK) {
+		segment++;
+	}
+	const int lastsegment = segmentscount > 0 ? segment : 1;
+
+	/* Each writer owns its entry, the last one receiving the original. */
+	for (size_t i = 0, remaining = references; i < count; i++) {
+		if (matches[i]) {
+			struct archive_entry * const sent = --remaining != 0 ? archive_entry_clone(entry) : entry;
+
+			if (sent == NULL) {
+				errx(EXIT_FAILURE, "archive_entry_clone: Unable to allocate entry");
+			}
+
+			lndworm_writer_push(writers + i, sent, NULL);
+		}
+	}
+
+	if (fd < 0) {
+		free(segments);
+		ORM_PROBE1(archive_entry_done, size);
+		return;
+	}
+
+	off_t offset = 0, length = 0;
+	if (lastsegment != 0) {
+		offset = segments[0].offset;
+		length = segments[0].length;
+	}
+	segment = 1;
+
+	while (length != 0) {
+		struct lndworm_block * const block = malloc(sizeof (*block) + CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE);
+		if (block == NULL) {
+			err(EXIT_FAILURE, "malloc");
+		}
+
+		const ssize_t copied = pread(fd, block->data,
+			length < CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE ? length : CONFIG_ARCHIVE_OUTPUT_BLOCK_SIZE, offset);
+		if (copied <= 0) {
+			free(block);
+			if (copied < 0) {
+				err(EXIT_FAILURE, "read '%s'", sourcepath);
+			}
+			/* File truncated since its entry was read, let writers pad it. */
+			break;
+		}
+
+		atomic_init(&block->references, references);
+		block->offset = offset;
+		block->size = copied;
+
+		for (size_t i = 0; i < count; i++) {
+			if (matches[i]) {
+				lndworm_writer_push(writers + i, NULL, block);
+			}
+		}
+
+		offset += copied;
+		length -= copied;
+
+		if (length == 0 && segment < lastsegment) {
+			offset = segments[segment].offset;
+			length = segments[segment].length;
+			segment++;
+		}
+	}
+
+	free(segments);
+	close(fd);
+
+	ORM_PROBE1(archive_entry_done, size);
+}
+
+/**
+ * Directory being listed by a sorted traversal.
+ */
+struct lndworm_sorted_directory {
+	char *path;
+	struct dirent **names;
+	int count, index;
+};
+
+/**
+ * Sorted depth-first traversal, listing each directory at once
+ * and sorting it by byte order, instead of following readdir(3).
+ */
+struct lndworm_sorted {
+	struct archive *in;
+	size_t inputlen;
+	struct lndworm_sorted_directory *stack;
+	size_t depth, capacity;
+};
+
+static int
+lndworm_sorted_select(const struct dirent *dirent) {
+	const char * const name = dirent->d_name;
+
+	return !(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+static int
+lndworm_sorted_compare(const struct dirent **lhs, const struct dirent **rhs) {
+	return strcmp((*lhs)->d_name, (*rhs)->d_name);
+}
+
+/**
+ * List a directory and push it on the traversal's stack.
+ * @param sorted Traversal.
+ * @param path Path of the directory, with a trailing slash, consumed.
+ */
+static void
+lndworm_sorted_push(struct lndworm_sorted *sorted, char *path) {
+
+	if (sorted->depth == sorted->capacity) {
+		const size_t capacity = sorted->capacity != 0 ? sorted->capacity * 2 : 16;
+		struct lndworm_sorted_directory * const stack = reallocarray(sorted->stack, capacity, sizeof (*stack));
+
+		if (stack == NULL) {
+			err(EXIT_FAILURE, "reallocarray");
+		}
+
+		sorted->stack = stack;
+		sorted->capacity = capacity;
+	}
+
+	struct lndworm_sorted_directory * const directory = sorted->stack + sorted->depth;
+
+	directory->count = scandir(path, &directory->names, lndworm_sorted_select, lndworm_sorted_compare);
+	if (directory->count < 0) {
+		err(EXIT_FAILURE, "scandir '%s'", path);
+	}
+	directory->path = path;
+	directory->index = 0;
+
+	sorted->depth++;
+}
+
+/**
+ * Get the next entry of a sorted traversal.
+ * @param sorted Traversal.
+ * @return The next entry, or NULL at the end of the traversal.
+ */
+static struct archive_entry *
+lndworm_sorted_next(struct lndworm_sorted *sorted) {
+
+	while (sorted->depth != 0) {
+		struct lndworm_sorted_directory * const directory = sorted->stack + sorted->depth - 1;
+
+		if (directory->index == directory->count) {
+			free(directory->names);
+			free(directory->path);
+			sorted->depth--;
+			continue;
+		}
+
+		struct dirent * const dirent = directory->names[directory->index++];
+		const size_t pathlen = strlen(directory->path), namelen = strlen(dirent->d_name);
+		char * const path = malloc(pathlen + namelen + 2);
+		struct archive_entry * const entry = archive_entry_new();
+
+		if (path == NULL || entry == NULL) {
+			err(EXIT_FAILURE, "malloc");
+		}
+
+		memcpy(mempcpy(path, directory->path, pathlen), dirent->d_name, namelen + 1);
+		free(dirent);
+
+		archive_entry_copy_sourcepath(entry, path);
+		archive_entry_copy_pathname(entry, path + sorted->inputlen);
+
+		if (archive_read_disk_entry_from_file(sorted->in, entry, -1, NULL) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_read_disk_entry_from_file '%s': %s", path, archive_error_string(sorted->in));
+		}
+
+		if (archive_entry_filetype(entry) == AE_IFDIR) {
+			path[pathlen + namelen] = '/';
+			path[pathlen + namelen + 1] = '\0';
+			lndworm_sorted_push(sorted, path);
+		} else {
+			free(path);
+		}
+
+		return entry;
+	}
+
+	free(sorted->stack);
+
+	return NULL;
+}
+
+/**
+ * Get the next entry of a traversal in readdir(3) order.
+ * @param in Disk reader, opened on input.
+ * @param inputlen Length of the input path, stripped from entries.
+ * @return The next entry, or NULL at the end of the traversal.
+ */
+static struct archive_entry *
+lndworm_disk_next(struct archive *in, size_t inputlen) {
 	struct archive_entry *entry;
-	int status = archive_read_next_header(in, &entry);
-	if (status != ARCHIVE_OK || archive_read_disk_descend(in) != ARCHIVE_OK) {
-		errx(EXIT_FAILURE, "archive_read_next_header"
-			": Unable to descend into '%s': %s", output, archive_error_string(in));
+	int status;
+
+	status = archive_read_next_header(in, &entry);
+	if (status == ARCHIVE_EOF) {
+		return NULL;
 	}
 
-	const size_t inputlen = strlen(input);
-	while (status = archive_read_next_header(in, &entry), status == ARCHIVE_OK) {
-		const char * const sourcepath = archive_entry_sourcepath(entry);
+	if (status != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_read_next_header: %s", archive_error_string(in));
+	}
 
-		archive_entry_copy_pathname(entry, sourcepath + inputlen);
+	archive_entry_copy_pathname(entry, archive_entry_sourcepath(entry) + inputlen);
 
-		status = archive_write_header(out, entry);
+	if (archive_read_disk_can_descend(in)) {
+		status = archive_read_disk_descend(in);
 		if (status != ARCHIVE_OK) {
-			errx(EXIT_FAILURE, "archive_write_header: %s", archive_error_string(out));
+			errx(EXIT_FAILURE, "archive_read_disk_descend: %s", archive_error_string(in));
 		}
+	}
 
-		if (archive_read_disk_can_descend(in)) {
-			status = archive_read_disk_descend(in);
-			if (status != ARCHIVE_OK) {
-				errx(EXIT_FAILURE, "archive_read_disk_descend: %s", archive_error_string(in));
-			}
-		} else if (archive_entry_filetype(entry) == AE_IFREG) {
-			lndworm_archive_copy_from_disk(sourcepath, out);
+	/* Writers and their resolvers keep entries, which are reused by the reader. */
+	struct archive_entry * const clone = archive_entry_clone(entry);
+	if (clone == NULL) {
+		errx(EXIT_FAILURE, "archive_entry_clone: Unable to allocate entry");
+	}
+
+	return clone;
+}
+
+/**
+ * Inodes renumbered by a reproducible traversal.
+ */
+struct lndworm_inodes {
+	void *root;
+	int64_t count;
+};
+
+struct lndworm_inode {
+	dev_t dev;
+	ino_t ino;
+	int64_t number;
+};
+
+static int
+lndworm_inode_compare(const void *lhs, const void *rhs) {
+	const struct lndworm_inode * const linode = lhs, * const rinode = rhs;
+
+	if (linode->dev != rinode->dev) {
+		return linode->dev < rinode->dev ? -1 : 1;
+	}
+
+	return (linode->ino > rinode->ino) - (linode->ino < rinode->ino);
+}
+
+/**
+ * Number an entry's inode in traversal order, hardlinks sharing the
+ * number of their first occurrence, so writers still resolve them.
+ * @param inodes Inodes numbered so far.
+ * @param entry Entry to number.
+ * @return The inode number.
+ */
+static int64_t
+lndworm_inode_number(struct lndworm_inodes *inodes, struct archive_entry *entry) {
+
+	if (archive_entry_nlink(entry) <= 1 || archive_entry_filetype(entry) == AE_IFDIR) {
+		return ++inodes->count;
+	}
+
+	struct lndworm_inode * const inode = malloc(sizeof (*inode));
+	if (inode == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	*inode = (struct lndworm_inode) { .dev = archive_entry_dev(entry), .ino = archive_entry_ino64(entry) };
+
+	struct lndworm_inode * const * const node = tsearch(inode, &inodes->root, lndworm_inode_compare);
+	if (node == NULL) {
+		err(EXIT_FAILURE, "tsearch");
+	}
+
+	if (*node != inode) {
+		free(inode);
+	} else {
+		inode->number = ++inodes->count;
+	}
+
+	return (*node)->number;
+}
+
+/**
+ * Normalize an entry's metadata for reproducible archives: modification
+ * times are clamped to epoch, other times dropped, ownership is 0:0
+ * without names, and permissions are 0755 or 0644 depending on
+ * whether the entry is a directory or executable, special bits kept.
+ * Inodes are numbered in traversal order, on device 0.
+ * @param entry Entry to normalize.
+ * @param epoch Maximum modification time.
+ * @param inodes Inodes numbered so far.
+ */
+static void
+lndworm_archive_normalize(struct archive_entry *entry, time_t epoch, struct lndworm_inodes *inodes) {
+	const mode_t perm = archive_entry_perm(entry);
+	const time_t mtime = archive_entry_mtime(entry);
+
+	archive_entry_set_mtime(entry, mtime < epoch ? mtime : epoch, 0);
+	archive_entry_unset_atime(entry);
+	archive_entry_unset_ctime(entry);
+	archive_entry_unset_birthtime(entry);
+
+	archive_entry_set_uid(entry, 0);
+	archive_entry_set_gid(entry, 0);
+	archive_entry_copy_uname(entry, NULL);
+	archive_entry_copy_gname(entry, NULL);
+
+	archive_entry_set_ino64(entry, lndworm_inode_number(inodes, entry));
+	archive_entry_set_dev(entry, 0);
+
+	if (archive_entry_filetype(entry) != AE_IFLNK) {
+		const bool executable = archive_entry_filetype(entry) == AE_IFDIR || (perm & 0111) != 0;
+
+		archive_entry_set_perm(entry, (perm & 07000) | (executable ? 0755 : 0644));
+	}
+}
+
+/**
+ * Create all output archives in a single traversal of input.
+ * Each file is read once, its data being fanned out to writer threads,
+ * one per output, compressing concurrently.
+ * @param input Directory to archive, with a trailing slash.
+ * @param outputs Outputs to create, the first one receiving unclaimed entries.
+ * @param count Number of outputs.
+ * @param reproducible Whether to traverse in sorted order and normalize entries.
+ * @param epoch Maximum modification time of reproducible entries.
+ * @return Total size of the regular files archived.
+ */
+static int64_t
+lndworm_archive_create(const char *input, const struct lndworm_output *outputs, size_t count,
+	bool reproducible, time_t epoch) {
+	struct archive * const in = archive_read_disk_new();
+
+	if (archive_read_disk_set_symlink_physical(in) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_read_disk_set_symlink_physical: %s", archive_error_string(in));
+	}
+
+	if (archive_read_disk_set_standard_lookup(in) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_read_disk_set_standard_lookup: %s", archive_error_string(in));
+	}
+
+	/* Holes are detected when copying data, see lndworm_archive_sparse().
+	 * Reproducible archives don't store host specific metadata. */
+	const int behavior = ARCHIVE_READDISK_NO_SPARSE
+		| (reproducible ? ARCHIVE_READDISK_NO_XATTR | ARCHIVE_READDISK_NO_ACL | ARCHIVE_READDISK_NO_FFLAGS : 0);
+	if (archive_read_disk_set_behavior(in, behavior) != ARCHIVE_OK) {
+		errx(EXIT_FAILURE, "archive_read_disk_set_behavior: %s", archive_error_string(in));
+	}
+
+	const size_t inputlen = strlen(input);
+	struct lndworm_sorted sorted = { .in = in, .inputlen = inputlen };
+
+	if (reproducible) {
+		char * const path = strdup(input);
+
+		if (path == NULL) {
+			err(EXIT_FAILURE, "strdup");
+		}
+
+		lndworm_sorted_push(&sorted, path);
+	} else {
+		struct archive_entry *entry;
+
+		if (archive_read_disk_open(in, input) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_read_disk_open: %s", archive_error_string(in));
+		}
+
+		if (archive_read_next_header(in, &entry) != ARCHIVE_OK || archive_read_disk_descend(in) != ARCHIVE_OK) {
+			errx(EXIT_FAILURE, "archive_read_next_header"
+				": Unable to descend into '%s': %s", input, archive_error_string(in));
+		}
+	}
+
+	struct lndworm_writer * const writers = malloc(count * sizeof (*writers));
+	if (writers == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		lndworm_writer_init(writers + i, outputs + i, reproducible);
+	}
+
+	/* Entries are written CONFIG_ARCHIVE_PREFETCH_DEPTH entries behind the traversal,
+	 * giving time to the prefetch threads to bring their data in the page cache. */
+	struct prefetch * const prefetch = prefetch_create(CONFIG_ARCHIVE_PREFETCH_THREADS, CONFIG_ARCHIVE_PREFETCH_DEPTH);
+	struct archive_entry *pending[CONFIG_ARCHIVE_PREFETCH_DEPTH];
+	unsigned int head = 0, pendingcount = 0;
+	struct lndworm_inodes inodes = { 0 };
+	int64_t size = 0;
+
+	struct archive_entry *entry;
+	while (entry = reproducible ? lndworm_sorted_next(&sorted) : lndworm_disk_next(in, inputlen), entry != NULL) {
+
+		if (reproducible) {
+			lndworm_archive_normalize(entry, epoch, &inodes);
+		}
+
+		if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0) {
+			prefetch_file(prefetch, archive_entry_sourcepath(entry), archive_entry_size(entry));
+			size += archive_entry_size(entry);
+		}
+
+		if (pendingcount == CONFIG_ARCHIVE_PREFETCH_DEPTH) {
+			lndworm_archive_fanout(writers, count, pending[head]);
+			head = (head + 1) % CONFIG_ARCHIVE_PREFETCH_DEPTH;
+			pendingcount--;
 		}
+
+		pending[(head + pendingcount) % CONFIG_ARCHIVE_PREFETCH_DEPTH] = entry;
+		pendingcount++;
 	}
 
+	while (pendingcount != 0) {
+		lndworm_archive_fanout(writers, count, pending[head]);
+		head = (head + 1) % CONFIG_ARCHIVE_PREFETCH_DEPTH;
+		pendingcount--;
+	}
+
+	prefetch_destroy(prefetch);
+	tdestroy(inodes.root, free);
+
 	archive_read_close(in);
-	archive_write_close(out);
 
-	if (status != ARCHIVE_EOF) {
-		errx(EXIT_FAILURE, "archive_read_next_header: %s", archive_error_string(in));
+	for (size_t i = 0; i < count; i++) {
+		lndworm_writer_deinit(writers + i);
 	}
 
+	free(writers);
 	archive_read_free(in);
-	archive_write_free(out);
+
+	return size;
+}
+
+/**
+ * Find out whether the output must be a mountable filesystem image
+ * instead of a libarchive(3) archive, either from the explicit format,
+ * or from the output file name's extension.
+ * @param format Explicit output format, or NULL.
+ * @param output Output file name.
+ * @return The image format name, or NULL if not an image.
+ */
+static const char *
+lndworm_image_format(const char *format, const char *output) {
+	static const struct {
+		const char *extension, *format;
+	} images[] = {
+		{ ".squashfs", "squashfs" },
+		{ ".sqfs", "squashfs" },
+		{ ".erofs", "erofs" },
+	};
+
+	if (format != NULL) {
+		if (strcmp(format, "squashfs") == 0 || strcmp(format, "erofs") == 0) {
+			return format;
+		}
+		return NULL;
+	}
+
+	const size_t outputlen = strlen(output);
+	for (size_t i = 0; i < sizeof (images) / sizeof (*images); i++) {
+		const size_t extensionlen = strlen(images[i].extension);
+
+		if (outputlen > extensionlen
+			&& strcmp(output + outputlen - extensionlen, images[i].extension) == 0) {
+			return images[i].format;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Create a filesystem image of input, using the toolchain's
+ * mksquashfs(1) or mkfs.erofs(1). Both compress on all available
+ * processors and deduplicate identical data, the output being
+ * reopened through procfs as it was opened outside of the sandbox.
+ * Reproducible images have all timestamps set to epoch, root ownership,
+ * and a null UUID for EROFS, both programs sorting directories.
+ * Exits on failure.
+ * @param input Directory to create the image from.
+ * @param format Either "squashfs" or "erofs".
+ * @param filter Compressor, or NULL for the program's default.
+ * @param fd Output file descriptor.
+ * @param reproducible Whether to create a reproducible image.
+ * @param epoch Timestamp of reproducible images.
+ */
+static void
+lndworm_image_create(const char *input, const char *format, const char *filter, int fd,
+	bool reproducible, time_t epoch) {
+	char output[sizeof ("/proc/self/fd/") + sizeof (fd) * 3];
+	char workers[sizeof ("--workers=") + sizeof (long) * 3];
+	char timestamp[sizeof ("-T") + sizeof (intmax_t) * 3];
+	const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *argv[16];
+	int argc = 0;
+
+	/* Remove FD_CLOEXEC from fd, the program reopens it. */
+	if (fcntl(fd, F_SETFD, 0) != 0) {
+		err(EXIT_FAILURE, "fcntl F_SETFD");
+	}
+	snprintf(output, sizeof (output), "/proc/self/fd/%d", fd);
+
+	if (strcmp(format, "squashfs") == 0) {
+		snprintf(workers, sizeof (workers), "%ld", processors > 0 ? processors : 1);
+
+		argv[argc++] = "mksquashfs";
+		argv[argc++] = input;
+		argv[argc++] = output;
+		argv[argc++] = "-noappend";
+		argv[argc++] = "-no-progress";
+		argv[argc++] = "-processors";
+		argv[argc++] = workers;
+		if (filter != NULL) {
+			argv[argc++] = "-comp";
+			argv[argc++] = filter;
+		}
+		if (reproducible) {
+			snprintf(timestamp, sizeof (timestamp), "%jd", (intmax_t)epoch);
+			argv[argc++] = "-all-root";
+			argv[argc++] = "-mkfs-time";
+			argv[argc++] = timestamp;
+			argv[argc++] = "-all-time";
+			argv[argc++] = timestamp;
+		}
+	} else {
+		char * const compressor = alloca(sizeof ("-z") + (filter != NULL ? strlen(filter) : sizeof ("lz4hc")));
+
+		snprintf(workers, sizeof (workers), "--workers=%ld", processors > 0 ? processors : 1);
+		stpcpy(stpcpy(compressor, "-z"), filter != NULL ? filter : "lz4hc");
+
+		/* Block deduplication is only available with compression. */
+		argv[argc++] = "mkfs.erofs";
+		argv[argc++] = compressor;
+		argv[argc++] = "-Ededupe";
+		argv[argc++] = workers;
+		if (reproducible) {
+			snprintf(timestamp, sizeof (timestamp), "-T%jd", (intmax_t)epoch);
+			argv[argc++] = "--all-root";
+			argv[argc++] = timestamp;
+			argv[argc++] = "-U00000000-0000-0000-0000-000000000000";
+		}
+		argv[argc++] = output;
+		argv[argc++] = input;
+	}
+	argv[argc] = NULL;
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		execvp(*argv, (char **)argv);
+		err(EXIT_FAILURE, "execvp '%s'", *argv);
+	}
+
+	if (lndworm_wait(pid) != 0) {
+		exit(EXIT_FAILURE);
+	}
 }
 
 noreturn static void
 lndworm_exec(const struct lndworm_args *args,
-	int argc, char **argv, const char *output, int fd) {
+	int argc, char **argv, const char *output, int fd, int statusfd) {
 	struct orm_sandbox_description description = {
-		.asroot = args->asroot,
+		.asroot = args->asroot, .lean = args->lean,
 	};
 
 	/* Open or describe sysroot. */
-	int sysrootfd;
+	int sysrootfd = -1;
 	if (!isdir(args->sysroot)) {
 		sysrootfd = open(args->sysroot, O_RDONLY | O_CLOEXEC);
 		if (sysrootfd < 0) {
 			err(EXIT_FAILURE, "open '%s'", args->sysroot);
 		}
+	} else if (!pathfilter_empty(&args->sysrootfilter)) {
+		errx(EXIT_FAILURE, "Cannot filter sysroot directory '%s'", args->sysroot);
 	} else {
 		description.sysroot = args->sysroot;
 		description.rosysroot = !args->rwsysroot;
 	}
 
-	/* Open or describe srcdir. */
-	int srcfd;
-	if (!isdir(args->src)) {
+	/* Open or describe srcdir, unless streamed. */
+	int srcfd = args->srcfd;
+	if (srcfd >= 0) {
+		/* Already opened from stdin. */
+	} else if (!isdir(args->src)) {
 		srcfd = open(args->src, O_RDONLY | O_CLOEXEC);
 		if (srcfd < 0) {
 			err(EXIT_FAILURE, "open '%s'", args->src);
 		}
+	} else if (!pathfilter_empty(&args->srcfilter)) {
+		errx(EXIT_FAILURE, "Cannot filter src directory '%s'", args->src);
 	} else {
 		description.srcdir = args->src;
 		description.rosrcdir = !args->rwsrcdir;
@@ -256,47 +1402,171 @@ lndworm_exec(const struct lndworm_args *args,
 	description.bsysdir = dirname(strdupa(bsyspath));
 	bsysname = basename(strdupa(bsyspath));
 
+	/* Warm the page cache up while setting up, or record what to warm. */
+	struct warmup * const warmup = warmup_start(root, description.sysroot);
+	struct metrics * const metrics = metrics_open("lndworm", args->toolchain);
+
 	/* Enter the sandbox. */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (orm_sandbox(&description, getuid(), getgid()) != 0) {
 		err(EXIT_FAILURE, "Unable to enter toolbox");
 	}
+	metrics_record(metrics, METRICS_SANDBOX_SECONDS, metrics_elapsed(&start));
 
-	/* Extract sysroot archive if not mounted directory. */
+	/* Extract sysroot archive if not mounted directory, concurrently with src. */
+	struct extract_thread sysrootthread = {
+		.extract = extract, .output = "/var/sysroot",
+		.ro = !args->rwsysroot, .fd = sysrootfd, .filter = &args->sysrootfilter,
+	};
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (description.sysroot == NULL) {
-		extract("/var/sysroot", !args->rwsysroot, sysrootfd);
+		extract_start(&sysrootthread);
 	}
 
 	/* Extract src archive if not mounted directory. */
+	int64_t extracted = 0;
 	if (description.srcdir == NULL) {
 		const unsigned int rosrcdir = !args->rwsrcdir;
 
 		if (args->intop) {
-			lndworm_extract_ignore_toplevel("/var/src", rosrcdir, srcfd);
+			extracted = lndworm_extract_ignore_toplevel("/var/src", rosrcdir, srcfd, &args->srcfilter);
 		} else {
-			extract("/var/src", rosrcdir, srcfd);
+			extracted = extract("/var/src", rosrcdir, srcfd, &args->srcfilter);
 		}
 	}
 
-	const pid_t pid = fork();
+	if (description.sysroot == NULL) {
+		extract_join(&sysrootthread);
+		extracted += sysrootthread.size;
+	}
+
+	if (description.srcdir == NULL || description.sysroot == NULL) {
+		metrics_record(metrics, METRICS_EXTRACT_SECONDS, metrics_elapsed(&start));
+		metrics_record(metrics, METRICS_EXTRACT_BYTES, extracted);
+	}
+
+	int listener, tracefds[2];
+	size_t tracecount = 0;
+	if (args->trace != NULL) {
+		tracefds[tracecount++] = args->tracefd;
+	}
+	if (warmup != NULL) {
+		tracefds[tracecount++] = warmup_fd(warmup);
+	}
+
+	struct buildlog * const log = args->log != NULL ? buildlog_create(args->log, args->logfd) : NULL;
+	ORM_PROBE1(bsys, bsysname);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const pid_t pid = tracecount != 0 ? trace_fork(&listener) : fork();
 	if (pid < 0) {
 		err(EXIT_FAILURE, "fork");
 	}
 
 	if (pid == 0) {
+		if (log != NULL) {
+			buildlog_redirect(log);
+		}
 		bsysexec(bsysname, argv + optind, argc - optind);
 	}
 
-	if (lndworm_wait(pid) != 0) {
+	if (log != NULL) {
+		buildlog_start(log);
+	}
+
+	if (tracecount != 0) {
+		trace_supervise(listener, tracefds, tracecount);
+	}
+
+	const int status = lndworm_wait(pid);
+	metrics_record(metrics, METRICS_BSYS_SECONDS, metrics_elapsed(&start));
+
+	ORM_PROBE2(bsys_done, bsysname, status);
+
+	if (warmup != NULL) {
+		warmup_commit(warmup, status == 0);
+	}
+
+	if (log != NULL) {
+		buildlog_finish(log, status != 0);
+
+		if (fsync(args->logfd) != 0 && errno != EINVAL) {
+			err(EXIT_FAILURE, "fsync '%s'", args->log);
+		}
+	}
+
+	if (status != 0) {
+		metrics_commit(metrics, false);
 		exit(EXIT_FAILURE);
 	}
 
-	lndworm_archive_create(args->pkgobj ? "/var/obj/" : "/var/dest/", args->format, args->filter, output, fd);
+	const char * const input = args->pkgobj ? "/var/obj/" : "/var/dest/";
+	const char * const image = lndworm_image_format(args->format, output);
+	struct lndworm_output outputs[1 + args->outputscount];
+
+	outputs[0] = (struct lndworm_output) {
+		.path = output, .format = args->format, .filter = args->filter, .fd = fd,
+	};
+	memcpy(outputs + 1, args->outputs, args->outputscount * sizeof (*outputs));
+
+	ORM_PROBE2(archive, input, output);
+
+	/* Images are packaged by the toolchain, their input size is unknown. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (image != NULL) {
+		lndworm_image_create(input, image, args->filter, fd, args->reproducible, args->epoch);
+	} else {
+		const int64_t packaged = lndworm_archive_create(input, outputs, 1 + args->outputscount,
+			args->reproducible, args->epoch);
+
+		metrics_record(metrics, METRICS_PACKAGE_SECONDS, metrics_elapsed(&start));
+		metrics_record(metrics, METRICS_PACKAGE_BYTES, packaged);
+	}
+
+	ORM_PROBE1(archive_done, output);
+
+	/* Notify completion once the outputs are durable and closed, the sandbox
+	 * is then torn down while the parent already exited. Closing them first
+	 * lets a streamed output's reader see its end of file without waiting
+	 * for the sandbox, and reports deferred write errors before completing. */
+	for (size_t i = 0; i < 1 + args->outputscount; i++) {
+		if (fsync(outputs[i].fd) != 0 && errno != EINVAL) {
+			err(EXIT_FAILURE, "fsync '%s'", outputs[i].path);
+		}
+		if (close(outputs[i].fd) != 0) {
+			err(EXIT_FAILURE, "close '%s'", outputs[i].path);
+		}
+	}
+
+	if (args->trace != NULL) {
+		if (fsync(args->tracefd) != 0 && errno != EINVAL) {
+			err(EXIT_FAILURE, "fsync '%s'", args->trace);
+		}
+		if (close(args->tracefd) != 0) {
+			err(EXIT_FAILURE, "close '%s'", args->trace);
+		}
+	}
+
+	if (write(statusfd, "", 1) != 1) {
+		err(EXIT_FAILURE, "write");
+	}
+
+	/* Out of the caller's way, as it already exited. */
+	metrics_commit(metrics, true);
+
 	exit(EXIT_SUCCESS);
 }
 
 static int
 lndworm_run(const struct lndworm_args *args,
 	int argc, char **argv, const char *output, int fd) {
+	int statusfd[2];
+
+	if (pipe2(statusfd, O_CLOEXEC) != 0) {
+		warn("pipe");
+		return -1;
+	}
 
 	const pid_t pid = fork();
 	if (pid < 0) {
@@ -305,51 +1575,110 @@ lndworm_run(const struct lndworm_args *args,
 	}
 
 	if (pid == 0) {
-		lndworm_exec(args, argc, argv, output, fd);
+		close(statusfd[0]);
+		lndworm_exec(args, argc, argv, output, fd, statusfd[1]);
 	}
+	close(statusfd[1]);
 
-	if (lndworm_wait(pid) != 0) {
-		return -1;
+	/* The child notifies completion, else closes the pipe when exiting. */
+	ssize_t readval;
+	char done;
+	while (readval = read(statusfd[0], &done, 1), readval < 0 && errno == EINTR);
+	close(statusfd[0]);
+
+	if (readval == 1) {
+		return 0;
 	}
 
-	return 0;
+	if (lndworm_wait(pid) == 0) {
+		warnx("Process %d exited without completing", pid);
+	}
+
+	return -1;
 }
 
 noreturn static void
 lndworm_usage(const char *progname, int status) {
 
 	fprintf(stderr,
-		"usage: %1$s [-ASUir] [-a <output archive format> [-f <output compression filter>]]"
-			" [-t <toolchain>] [-b <bsys>] [-u <sysroot>] [-s <src>] <output> [<arguments>...]\n"
+		"usage: %1$s [-ASRUilr] [-T <trace>] [-L <log>] [-a <output archive format> [-f <output compression filter>]]"
+			" [-t <toolchain>] [-b <bsys>] [-u <sysroot>] [-J <pattern>] [-Y <pattern>]"
+			" [-s <src>] [-I <pattern>] [-X <pattern>] [-O [<patterns>=]<output>] [-M <manifest>]"
+			" <output> [<arguments>...]\n"
 		"       %1$s -h\n",
 		progname);
 
 	exit(status);
 }
 
+/**
+ * Append an additional output, described by its path,
+ * optionally prefixed by comma-separated patterns and an equal sign.
+ * Manifests are described by their path only, and list all entries.
+ * @param args Arguments receiving the output.
+ * @param description Output description, modified.
+ * @param manifest Whether the output is a manifest.
+ */
+static void
+lndworm_parse_output(struct lndworm_args *args, char *description, bool manifest) {
+	struct lndworm_output * const outputs = reallocarray(args->outputs, args->outputscount + 1, sizeof (*outputs));
+	if (outputs == NULL) {
+		err(EXIT_FAILURE, "reallocarray");
+	}
+
+	struct lndworm_output * const output = outputs + args->outputscount;
+	char * const equal = strchr(description, '=');
+
+	*output = (struct lndworm_output) { .path = description, .manifest = manifest, .fd = -1 };
+	if (!manifest && equal != NULL) {
+		char *saveptr;
+
+		*equal = '\0';
+		output->path = equal + 1;
+		for (char *pattern = strtok_r(description, ",", &saveptr);
+			pattern != NULL; pattern = strtok_r(NULL, ",", &saveptr)) {
+			pathfilter_include(&output->rules, pattern);
+		}
+	}
+
+	args->outputs = outputs;
+	args->outputscount++;
+}
+
 static struct lndworm_args
 lndworm_parse_args(int argc, char **argv) {
 	struct lndworm_args args = {
 		.toolchain = getenv("ORM_DEFAULT_TOOLCHAIN"),
 		.bsys = getenv("ORM_DEFAULT_BSYS"),
 		.sysroot = getenv("ORM_SYSROOT"),
+		.tracefd = -1, .logfd = -1, .srcfd = -1,
 	};
 	int c;
 
-	while ((c = getopt(argc, argv, ":hASUira:f:t:b:u:s:")) >= 0) {
+	while ((c = getopt(argc, argv, ":hASRUilrT:L:a:f:t:b:u:s:I:X:J:Y:O:M:")) >= 0) {
 		switch (c) {
 		case 'h': lndworm_usage(*argv, EXIT_SUCCESS);
 		case 'A': args.pkgobj = 1; break;
 		case 'S': args.rwsrcdir = 1; break;
+		case 'R': args.reproducible = 1; break;
 		case 'U': args.rwsysroot = 1; break;
 		case 'i': args.intop = 1; break;
+		case 'l': args.lean = 1; break;
 		case 'r': args.asroot = 1; break;
+		case 'T': args.trace = optarg; break;
+		case 'L': args.log = optarg; break;
 		case 'a': args.format = optarg; break;
 		case 'f': args.filter = optarg; break;
 		case 't': args.toolchain = optarg; break;
 		case 'b': args.bsys = optarg; break;
 		case 'u': args.sysroot = optarg; break;
 		case 's': args.src = optarg; break;
+		case 'I': pathfilter_include(&args.srcfilter, optarg); break;
+		case 'X': pathfilter_exclude(&args.srcfilter, optarg); break;
+		case 'J': pathfilter_include(&args.sysrootfilter, optarg); break;
+		case 'Y': pathfilter_exclude(&args.sysrootfilter, optarg); break;
+		case 'O': lndworm_parse_output(&args, optarg, false); break;
+		case 'M': lndworm_parse_output(&args, optarg, true); break;
 		case ':':
 			warnx("Option -%c requires an operand", optopt);
 			lndworm_usage(*argv, EXIT_FAILURE);
@@ -369,6 +1698,47 @@ lndworm_parse_args(int argc, char **argv) {
 		lndworm_usage(*argv, EXIT_FAILURE);
 	}
 
+	if (strcmp(argv[optind], "-") == 0) {
+		if (args.format == NULL) {
+			warnx("Cannot stream output without format");
+			lndworm_usage(*argv, EXIT_FAILURE);
+		}
+
+		if (lndworm_image_format(args.format, argv[optind]) != NULL) {
+			warnx("Cannot stream a filesystem image");
+			lndworm_usage(*argv, EXIT_FAILURE);
+		}
+	}
+
+	if (args.outputscount != 0) {
+		if (lndworm_image_format(args.format, argv[optind]) != NULL) {
+			warnx("Cannot create additional outputs or manifests with a filesystem image");
+			lndworm_usage(*argv, EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < args.outputscount; i++) {
+			if (!args.outputs[i].manifest && lndworm_image_format(NULL, args.outputs[i].path) != NULL) {
+				warnx("Additional output '%s' cannot be a filesystem image", args.outputs[i].path);
+				lndworm_usage(*argv, EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (args.reproducible) {
+		const char * const epoch = getenv("SOURCE_DATE_EPOCH");
+
+		if (epoch != NULL) {
+			char *end;
+
+			errno = 0;
+			args.epoch = strtoll(epoch, &end, 10);
+			if (errno != 0 || *epoch == '\0' || *end != '\0' || args.epoch < 0) {
+				warnx("Invalid SOURCE_DATE_EPOCH '%s'", epoch);
+				lndworm_usage(*argv, EXIT_FAILURE);
+			}
+		}
+	}
+
 	if (args.sysroot == NULL) {
 		args.sysroot = "/";
 	}
@@ -381,7 +1751,7 @@ lndworm_parse_args(int argc, char **argv) {
 		}
 
 		args.src = cmdpath(srccmd);
-	} else {
+	} else if (strcmp(args.src, "-") != 0) {
 		args.src = realpath(args.src, NULL);
 	}
 
@@ -403,10 +1773,19 @@ lndworm_parse_args(int argc, char **argv) {
 
 int
 main(int argc, char *argv[]) {
-	const struct lndworm_args args = lndworm_parse_args(argc, argv);
+	struct lndworm_args args = lndworm_parse_args(argc, argv);
 	const char * const output = argv[optind++];
+	const bool streamed = strcmp(output, "-") == 0;
 	int fd;
 
+	/* A streamed src is read from the inherited stdin. */
+	if (strcmp(args.src, "-") == 0) {
+		args.srcfd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+		if (args.srcfd < 0) {
+			err(EXIT_FAILURE, "Unable to read src from stdin");
+		}
+	}
+
 	/* Avoid interactivity in all subsequent processes,
 	 * no need for dup2 here as STDIN_FILENO is always zero. */
 	close(STDIN_FILENO);
@@ -415,17 +1794,62 @@ main(int argc, char *argv[]) {
 	}
 
 	/* Open the output file now, as later on, processes will
-	 * be in the sandbox, and won't be able to access the host's filesystem. */
-	fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
-	if (fd < 0) {
-		err(EXIT_FAILURE, "open '%s'", output);
+	 * be in the sandbox, and won't be able to access the host's filesystem.
+	 * A streamed output takes stdout, and leaves stderr to the bsys. */
+	if (streamed) {
+		fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+		if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			err(EXIT_FAILURE, "Unable to stream output to stdout");
+		}
+	} else {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			err(EXIT_FAILURE, "open '%s'", output);
+		}
+	}
+
+	size_t opened = 0;
+	while (opened < args.outputscount) {
+		struct lndworm_output * const extra = args.outputs + opened;
+
+		extra->fd = open(extra->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (extra->fd < 0) {
+			warn("open '%s'", extra->path);
+			break;
+		}
+		opened++;
 	}
 
-	if (lndworm_run(&args, argc, argv, output, fd) != 0) {
-		/* In case of error, we must cleanup the created package,
+	if (opened == args.outputscount && args.trace != NULL) {
+		args.tracefd = open(args.trace, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (args.tracefd < 0) {
+			warn("open '%s'", args.trace);
+		}
+	}
+
+	/* The log is kept on failures, where it matters most. */
+	if (opened == args.outputscount && (args.trace == NULL || args.tracefd >= 0) && args.log != NULL) {
+		args.logfd = open(args.log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (args.logfd < 0) {
+			warn("open '%s'", args.log);
+		}
+	}
+
+	if (opened != args.outputscount || (args.trace != NULL && args.tracefd < 0)
+		|| (args.log != NULL && args.logfd < 0)
+		|| lndworm_run(&args, argc, argv, output, fd) != 0) {
+		/* In case of error, we must cleanup the created packages,
 		 * which means the toplevel parent process must never
 		 * enter the sandbox, and be resilient to errors. */
-		unlink(output);
+		if (args.tracefd >= 0) {
+			unlink(args.trace);
+		}
+		while (opened != 0) {
+			unlink(args.outputs[--opened].path);
+		}
+		if (!streamed) {
+			unlink(output);
+		}
 		return EXIT_FAILURE;
 	}
 
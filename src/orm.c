@@ -1,136 +1,1373 @@
 /* SPDX-License-Identifier: AGPL-3.0-or-later */
-#include <stdio.h> /* puts, fprintf */
-#include <stdlib.h> /* realpath, ... */
+#include <stdio.h> /* puts, printf, fprintf, asprintf, renameat2 */
+#include <stdlib.h> /* realpath, mkostemp, mkdtemp, setenv, ... */
 #include <stdnoreturn.h> /* noreturn */
+#include <stdbool.h> /* true */
+#include <stdint.h> /* intmax_t, INTMAX_MAX, uint64_t */
+#include <inttypes.h> /* PRIx64 */
 #include <string.h> /* strdup, memcpy, ... */
 #include <unistd.h> /* getopt, ... */
 #include <libgen.h> /* dirname, basename */
 #include <alloca.h> /* alloca */
+#include <dirent.h> /* opendir, readdir, dirfd, closedir */
+#include <limits.h> /* UINT_MAX, INT_MAX */
+#include <signal.h> /* signal, raise */
+#include <poll.h> /* poll */
+#include <fcntl.h> /* open */
+#include <errno.h> /* errno, EINTR, ENOENT, EWOULDBLOCK */
+#include <sys/file.h> /* flock */
+#include <sys/stat.h> /* mkdirat, fstat, fstatat, futimens */
+#include <sys/socket.h> /* socket, bind, ... */
+#include <sys/un.h> /* struct sockaddr_un */
+#include <sys/wait.h> /* waitpid */
+#include <sys/random.h> /* getrandom */
+#include <time.h> /* clock_gettime */
 #include <err.h> /* err, errx, warnx */
 
 #include <orm.h>
 
 #include "common/cmdpath.h"
+#include "common/dedup.h"
+#include "common/metrics.h"
+#include "common/mirror.h"
+#include "common/trace.h"
+#include "common/warmup.h"
+#include "common/watch.h"
+
+/* Generations of persistent objdirs, in hexadecimal. */
+#define ORM_GENERATION_LENGTH (sizeof (uint64_t) * 2)
 
 struct orm_args {
 	const char *toolchain, *bsys;
 	const char *workspace, *sysroot;
 	const char *destdir, *objdir, *srcdir;
 	const char *workdir;
+	unsigned int timeout;
+	off_t budget;
 	unsigned int asroot : 1, rwsysroot : 1, rwsrcdir : 1;
 	unsigned int persistent : 1, interactive : 1;
+	unsigned int watch : 1, hybrid : 1;
+	unsigned int clone : 1, promote : 1;
+	unsigned int snapshot : 1, dedup : 1, collect : 1;
+	unsigned int lean : 1, srcdirset : 1;
 };
 
 /**
- * Finds out and prints the absolute path of the given
- * workdir in the resolved (or given) workspace.
+ * Finds out and prints the absolute path of the given
+ * workdir in the resolved (or given) workspace.
+ * @param args Command line options.
+ * @return Never
+ */
+noreturn static void
+orm_print_workdir(const struct orm_args *args) {
+	char *workdir;
+	int flags = 0;
+
+	if (args->persistent) {
+		flags |= ORM_WORKDIR_PERSISTENT;
+	}
+
+	if (orm_workdir(args->workspace, args->workdir, flags, &workdir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup workdir '%s'", args->workdir);
+	}
+
+	puts(workdir);
+
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Lock a workspace exclusively, if it isn't in use.
+ * @param cachefd Cache directory.
+ * @param name Name of the workspace.
+ * @param background Whether to skip workspaces in use quietly.
+ * @return The lock, or -1 if the workspace is in use, was never used, or was collected meanwhile.
+ */
+static int
+orm_dedup_lock(int cachefd, const char *name, bool background) {
+	const size_t namelen = strlen(name);
+	char usedpath[namelen + sizeof ("/.used")];
+	struct stat st, current;
+
+	memcpy(mempcpy(usedpath, name, namelen), "/.used", sizeof ("/.used"));
+
+	const int fd = openat(cachefd, usedpath, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "openat '%s'", usedpath);
+		}
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		if (!background) {
+			warnx("Workspace '%s' is in use, skipping", name);
+		}
+		close(fd);
+		return -1;
+	}
+
+	/* The workspace may have been moved out of the way before we got the lock. */
+	if (fstat(fd, &st) != 0
+		|| fstatat(cachefd, usedpath, &current, AT_SYMLINK_NOFOLLOW) != 0
+		|| st.st_dev != current.st_dev || st.st_ino != current.st_ino) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Deduplicate the content of all persistent workspaces in a content-addressed store.
+ * Workspaces in use are skipped, and protected from use while deduplicated.
+ * Deduplications are serialized, and the last one is dated by its lock's
+ * modification time. In the background, a deduplication is skipped if
+ * another one is running, or if the last one ended less than interval seconds ago.
+ * @param background Whether deduplicating in the background.
+ * @param interval Minimum interval between background deduplications, in seconds.
+ * @param stats Statistics of the deduplication, if not skipped.
+ * @return 0 on success, -1 if skipped.
+ */
+static int
+orm_dedup_workspaces(bool background, time_t interval, struct dedup_stats *stats) {
+	static const char storename[] = "/.store";
+	char *cachedir;
+
+	if (orm_cachedir(ORM_WORKDIR_PERSISTENT, &cachedir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup cache directory");
+	}
+
+	const size_t cachedirlen = strlen(cachedir);
+	char store[cachedirlen + sizeof (storename)];
+	memcpy(mempcpy(store, cachedir, cachedirlen), storename, sizeof (storename));
+
+	DIR * const dirp = opendir(cachedir);
+	if (dirp == NULL) {
+		if (errno == ENOENT) {
+			*stats = (struct dedup_stats) { 0 };
+			free(cachedir);
+			return 0;
+		}
+		err(EXIT_FAILURE, "opendir '%s'", cachedir);
+	}
+
+	/* Workspaces never start with a dot, unlike the store and the lock. */
+	const int lockfd = openat(dirfd(dirp), ".dedup", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0) {
+		err(EXIT_FAILURE, "Unable to open '%s/.dedup'", cachedir);
+	}
+
+	if (flock(lockfd, background ? LOCK_EX | LOCK_NB : LOCK_EX) != 0) {
+		if (!background || errno != EWOULDBLOCK) {
+			err(EXIT_FAILURE, "Unable to lock '%s/.dedup'", cachedir);
+		}
+		goto dedup_skip;
+	}
+
+	struct stat st;
+	struct timespec now;
+	if (fstat(lockfd, &st) != 0 || clock_gettime(CLOCK_REALTIME, &now) != 0) {
+		err(EXIT_FAILURE, "Unable to date '%s/.dedup'", cachedir);
+	}
+
+	/* A freshly created lock never dated a deduplication. */
+	if (background && st.st_size != 0 && now.tv_sec - st.st_mtim.tv_sec < interval) {
+		goto dedup_skip;
+	}
+
+	/* Nothing can be deduplicated without shared extents, which is only worth a warning once. */
+	if (background && !mirror_reflinks(cachedir)) {
+		*stats = (struct dedup_stats) { 0 };
+		goto dedup_date;
+	}
+
+	struct dedup * const dedup = dedup_create(store);
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		if (*entry->d_name != '.' && entry->d_type == DT_DIR) {
+			const int workspacefd = orm_dedup_lock(dirfd(dirp), entry->d_name, background);
+			const size_t namelen = strlen(entry->d_name);
+			char workspace[cachedirlen + 1 + namelen + 1];
+
+			if (workspacefd < 0) {
+				continue;
+			}
+
+			*(char *)mempcpy(workspace, cachedir, cachedirlen) = '/';
+			memcpy(workspace + cachedirlen + 1, entry->d_name, namelen + 1);
+
+			dedup_tree(dedup, workspace);
+			close(workspacefd);
+		}
+	}
+	dedup_destroy(dedup, stats);
+
+dedup_date:
+	/* Date the deduplication, its size marks the lock as dated. */
+	if (pwrite(lockfd, "", 1, 0) != 1 || futimens(lockfd, NULL) != 0) {
+		warn("Unable to date '%s/.dedup'", cachedir);
+	}
+
+	close(lockfd);
+	closedir(dirp);
+	free(cachedir);
+
+	return 0;
+
+dedup_skip:
+	close(lockfd);
+	closedir(dirp);
+	free(cachedir);
+
+	return -1;
+}
+
+/**
+ * Deduplicate the content of all persistent workspaces, and print statistics.
+ * @return Never
+ */
+noreturn static void
+orm_dedup(void) {
+	struct dedup_stats stats;
+
+	orm_dedup_workspaces(false, 0, &stats);
+
+	printf("%zu files, %zu stored, %zu shared, %jd bytes shared\n",
+		stats.files, stats.stored, stats.shared, (intmax_t)stats.bytes);
+
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Execute the given bsys, or the user's shell if available.
+ * @param bsysname The base name of the bsys, or NULL if interactive.
+ * @param args Arguments to forward to the command.
+ * @param count Number of arguments in args.
+ * @return Never
+ */
+noreturn static void
+orm_exec(const char *bsysname, char **args, int count) {
+	char *argv[3 + count];
+	int argc = 0;
+
+	if (bsysname != NULL) {
+		static const char bsysdir[] = "/var/bsys/";
+		const size_t bsysnamelen = strlen(bsysname);
+		char * const bsys = alloca(sizeof (bsysdir) + bsysnamelen);
+
+		memcpy(bsys, bsysdir, sizeof (bsysdir) - 1);
+		memcpy(bsys + sizeof (bsysdir) - 1, bsysname, bsysnamelen + 1);
+
+		argv[argc++] = bsys;
+	} else {
+		char *shell = getenv("SHELL");
+
+		if (shell == NULL || access(shell, X_OK) != 0) {
+			shell = "/bin/sh";
+		}
+		argv[argc++] = shell;
+		argv[argc++] = "-i";
+	}
+
+	while (count != 0) {
+		argv[argc++] = *args++;
+		count--;
+	}
+	argv[argc] = NULL;
+
+	execv(*argv, argv);
+
+	err(EXIT_FAILURE, "execv '%s'", *argv);
+}
+
+/**
+ * Execute the given bsys, and execute it again each time the sources change.
+ * Modified paths, relative to the srcdir, are listed in the file named by
+ * ORM_CHANGES for each rebuild, which is unset when they are unknown.
+ * @param bsysname The base name of the bsys.
+ * @param args Arguments to forward to the command.
+ * @param count Number of arguments in args.
+ * @return Never
+ */
+noreturn static void
+orm_watch(const char *bsysname, char **args, int count) {
+	char changespath[] = "/tmp/orm-changes.XXXXXX";
+	const int changesfd = mkostemp(changespath, O_CLOEXEC);
+	FILE *changes;
+
+	if (changesfd < 0 || (changes = fdopen(changesfd, "w")) == NULL) {
+		err(EXIT_FAILURE, "Unable to create changes file");
+	}
+
+	/* Watch before the first build, modifications
+	 * during a build trigger the next one. */
+	struct watch * const watch = watch_create("/var/src");
+
+	while (true) {
+		const pid_t pid = fork();
+		int wstatus;
+
+		if (pid < 0) {
+			err(EXIT_FAILURE, "fork");
+		}
+
+		if (pid == 0) {
+			orm_exec(bsysname, args, count);
+		}
+
+		if (waitpid(pid, &wstatus, 0) < 0) {
+			err(EXIT_FAILURE, "waitpid");
+		}
+
+		if (WIFSIGNALED(wstatus)) {
+			warnx("bsys terminated by signal %d", WTERMSIG(wstatus));
+		} else if (WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+			warnx("bsys exited with status %d", WEXITSTATUS(wstatus));
+		}
+
+		if (ftruncate(changesfd, 0) != 0) {
+			err(EXIT_FAILURE, "ftruncate '%s'", changespath);
+		}
+		rewind(changes);
+
+		const int known = watch_wait(watch, CONFIG_WATCH_DEBOUNCE, changes);
+
+		if (fflush(changes) != 0) {
+			err(EXIT_FAILURE, "Unable to write '%s'", changespath);
+		}
+
+		if (known == 0) {
+			setenv("ORM_CHANGES", changespath, 1);
+		} else {
+			unsetenv("ORM_CHANGES");
+		}
+	}
+}
+
+/**
+ * Exit as the child whose status is given did.
+ * @param wstatus Wait status of the child.
+ * @return Never
+ */
+noreturn static void
+orm_exit(int wstatus) {
+
+	if (WIFSIGNALED(wstatus)) {
+		signal(WTERMSIG(wstatus), SIG_DFL);
+		raise(WTERMSIG(wstatus));
+	}
+
+	exit(WEXITSTATUS(wstatus));
+}
+
+/**
+ * Execute the bsys, either once or in watch mode, or go interactive.
+ * When recording a warmup profile, the command is traced from a
+ * child process, and the profile is committed if it succeeded.
+ * Likewise when collecting metrics, to time the bsys.
+ * @param args Command line options.
+ * @param warmup Warmup profile to record, or NULL.
+ * @param metrics Metrics to commit, or NULL.
+ * @param bsysname The base name of the bsys, or NULL if interactive.
+ * @param argc Forwarded from main().
+ * @param argv Forwarded from main().
+ * @return Never
+ */
+noreturn static void
+orm_command(const struct orm_args *args, struct warmup *warmup, struct metrics *metrics,
+	const char *bsysname, int argc, char **argv) {
+
+	if (warmup != NULL || metrics != NULL) {
+		struct timespec start;
+		int listener;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		const pid_t pid = warmup != NULL ? trace_fork(&listener) : fork();
+
+		if (pid < 0) {
+			err(EXIT_FAILURE, "fork");
+		}
+
+		if (pid != 0) {
+			/* Interruptions are for the command, we still have to commit. */
+			signal(SIGINT, SIG_IGN);
+			signal(SIGQUIT, SIG_IGN);
+
+			if (warmup != NULL) {
+				const int fd = warmup_fd(warmup);
+
+				trace_supervise(listener, &fd, 1);
+			}
+
+			int wstatus;
+			if (waitpid(pid, &wstatus, 0) < 0) {
+				err(EXIT_FAILURE, "waitpid");
+			}
+
+			const bool success = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EXIT_SUCCESS;
+			if (warmup != NULL) {
+				warmup_commit(warmup, success);
+			}
+
+			metrics_record(metrics, METRICS_BSYS_SECONDS, metrics_elapsed(&start));
+			metrics_commit(metrics, success);
+
+			orm_exit(wstatus);
+		}
+	}
+
+	if (args->watch) {
+		orm_watch(bsysname, argv + optind, argc - optind);
+	}
+
+	orm_exec(bsysname, argv + optind, argc - optind);
+}
+
+/**
+ * Find out the snapshot key of a srcdir, with the snapshot command run in it.
+ * The key is escaped to be a valid file name, as branch names may contain slashes.
+ * @param srcdir Source directory.
+ * @return The escaped key, never NULL.
+ */
+static char *
+orm_snapshot_key(const char *srcdir) {
+	const char *command = getenv("ORM_SNAPSHOT_COMMAND");
+	const int cwdfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (command == NULL) {
+		command = CONFIG_DEFAULT_SNAPSHOT_COMMAND;
+	}
+
+	if (cwdfd < 0 || chdir(srcdir) != 0) {
+		err(EXIT_FAILURE, "Unable to change directory to '%s'", srcdir);
+	}
+
+	char * const key = cmdline(command);
+	if (key == NULL || *key == '\0') {
+		errx(EXIT_FAILURE, "Unable to find out snapshot key of '%s'", srcdir);
+	}
+
+	if (fchdir(cwdfd) != 0) {
+		err(EXIT_FAILURE, "fchdir");
+	}
+	close(cwdfd);
+
+	/* Escape slashes, and leading dots, with their percent-encoding. */
+	char * const escaped = malloc(strlen(key) * 3 + 1), *current = escaped;
+	if (escaped == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	for (const char *c = key; *c != '\0'; c++) {
+		if (*c == '/' || *c == '%' || (c == key && *c == '.')) {
+			current += sprintf(current, "%%%02X", *c);
+		} else {
+			*current++ = *c;
+		}
+	}
+	*current = '\0';
+
+	free(key);
+
+	return escaped;
+}
+
+/**
+ * Switch the objdir to the snapshot of the srcdir's current branch (or commit).
+ * When the key changed since the last build, the objdir is saved as the snapshot
+ * of the previous key, and the snapshot of the new one is restored, if any.
+ * Else, the objdir is kept as it is, a likely good start for a new branch.
+ * Snapshots are kept alongside the objdir they describe, so they are lost
+ * or collected with it, and never mixed with another objdir's. They are
+ * mirrored incrementally.
+ * @param args Command line options.
+ * @param srcdir Source directory.
+ * @param objdir Objdir to switch.
+ */
+static void
+orm_snapshot(const struct orm_args *args, const char *srcdir, const char *objdir) {
+	const int flags = args->persistent && !args->hybrid ? ORM_WORKDIR_PERSISTENT : 0;
+	char * const key = orm_snapshot_key(srcdir);
+	char *snapshotsdir;
+
+	if (orm_workdir(args->workspace, "snapshots", flags, &snapshotsdir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup snapshots directory");
+	}
+
+	const int dirfd = open(snapshotsdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		err(EXIT_FAILURE, "open '%s'", snapshotsdir);
+	}
+
+	const int lockfd = openat(dirfd, "lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0 || flock(lockfd, LOCK_EX) != 0) {
+		err(EXIT_FAILURE, "Unable to lock '%s/lock'", snapshotsdir);
+	}
+
+	if (mkdirat(dirfd, "refs", 0700) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdirat '%s/refs'", snapshotsdir);
+	}
+
+	char previous[NAME_MAX + 1];
+	ssize_t previouslen = 0;
+	const int currentfd = openat(dirfd, "current", O_RDONLY | O_CLOEXEC);
+	if (currentfd >= 0) {
+		previouslen = read(currentfd, previous, sizeof (previous) - 1);
+		if (previouslen < 0) {
+			err(EXIT_FAILURE, "read '%s/current'", snapshotsdir);
+		}
+		close(currentfd);
+	} else if (errno != ENOENT) {
+		err(EXIT_FAILURE, "openat '%s/current'", snapshotsdir);
+	}
+	previous[previouslen] = '\0';
+
+	if (strcmp(previous, key) != 0) {
+		const size_t snapshotsdirlen = strlen(snapshotsdir);
+		char path[snapshotsdirlen + sizeof ("/refs/") + NAME_MAX];
+
+		if (*previous != '\0') {
+			snprintf(path, sizeof (path), "%s/refs/%s", snapshotsdir, previous);
+			mirror(objdir, path);
+		}
+
+		if (strlen(key) > NAME_MAX) {
+			errx(EXIT_FAILURE, "Snapshot key '%s' is too long", key);
+		}
+
+		snprintf(path, sizeof (path), "%s/refs/%s", snapshotsdir, key);
+		if (access(path, F_OK) == 0) {
+			mirror(path, objdir);
+		} else if (errno != ENOENT) {
+			err(EXIT_FAILURE, "access '%s'", path);
+		}
+
+		const int newfd = openat(dirfd, "current.new", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (newfd < 0 || write(newfd, key, strlen(key)) < 0 || close(newfd) != 0
+			|| renameat(dirfd, "current.new", dirfd, "current") != 0) {
+			err(EXIT_FAILURE, "Unable to update '%s/current'", snapshotsdir);
+		}
+	}
+
+	close(lockfd);
+	close(dirfd);
+	free(snapshotsdir);
+	free(key);
+}
+
+/**
+ * Resolve the given (or not) source directory into
+ * an absolute path, either with cmdpath() or realpath(3).
+ * @param srcdir Source directory, or NULL.
+ * @return The absolute path of the source directory, or NULL on error.
+ */
+static char *
+orm_srcdir(const char *srcdir) {
+
+	if (srcdir == NULL) {
+		const char *srccmd = getenv("ORM_SRCDIR_COMMAND");
+
+		if (srccmd == NULL) {
+			srccmd = CONFIG_DEFAULT_SRCDIR_COMMAND;
+		}
+
+		return cmdpath(srccmd);
+	} else {
+		return realpath(srcdir, NULL);
+	}
+}
+
+/**
+ * Parse a size, with an optional binary unit suffix (K, M, G or T).
+ * @param string Size to parse.
+ * @param sizep Where to store the size.
+ * @return 0 on success, -1 if invalid.
+ */
+static int
+orm_size(const char *string, off_t *sizep) {
+	static const char units[] = "KMGT";
+	unsigned int shift = 0;
+	char *end;
+
+	if (*string < '0' || *string > '9') {
+		return -1;
+	}
+
+	const unsigned long long size = strtoull(string, &end, 10);
+	if (*end != '\0') {
+		const char * const unit = strchr(units, *end);
+
+		if (unit == NULL || end[1] != '\0') {
+			return -1;
+		}
+
+		shift = 10 * (unit - units + 1);
+	}
+
+	if (size > (unsigned long long)INTMAX_MAX >> shift) {
+		return -1;
+	}
+
+	*sizep = size << shift;
+
+	return 0;
+}
+
+/**
+ * Collect least recently used workspaces to fit a budget.
+ * @param flags Workdir flags, selecting which workspaces to collect.
+ * @param budget Total size allowed for the workspaces.
+ */
+static void
+orm_collect(int flags, off_t budget) {
+	off_t size;
+
+	if (orm_workdir_collect(flags, budget, &size) != 0) {
+		err(EXIT_FAILURE, "Unable to collect workspaces");
+	}
+
+	if (size > budget) {
+		warnx("Workspaces in use exceed the budget, %jd bytes remain", (intmax_t)size);
+	}
+}
+
+/**
+ * Mark a workspace as used until the build ends, and if the
+ * user configured a budget for such workspaces, collect them.
+ * Persistent workspaces are then deduplicated, if configured.
+ * @param workspace Workspace used.
+ * @param flags Workdir flags of the workspace.
+ */
+static void
+orm_use(const char *workspace, int flags) {
+	const char * const budgetstr = getenv(flags & ORM_WORKDIR_PERSISTENT ?
+		"ORM_PERSISTENT_GC_BUDGET" : "ORM_GC_BUDGET");
+	const char * const intervalstr = flags & ORM_WORKDIR_PERSISTENT ?
+		getenv("ORM_DEDUP_INTERVAL") : NULL;
+
+	/* Lock is deliberately leaked, and inherited by the build. */
+	if (orm_workspace_use(workspace, flags) < 0) {
+		err(EXIT_FAILURE, "Unable to use workspace '%s'", workspace);
+	}
+
+	if (budgetstr == NULL && intervalstr == NULL) {
+		return;
+	}
+
+	off_t budget;
+	if (budgetstr != NULL && orm_size(budgetstr, &budget) != 0) {
+		errx(EXIT_FAILURE, "Invalid workspaces budget '%s'", budgetstr);
+	}
+
+	unsigned long interval;
+	if (intervalstr != NULL) {
+		char *end;
+
+		interval = strtoul(intervalstr, &end, 10);
+		if (*intervalstr == '\0' || *end != '\0' || interval > INT_MAX) {
+			errx(EXIT_FAILURE, "Invalid deduplication interval '%s'", intervalstr);
+		}
+	}
+
+	/* Collection and deduplication happen in the background,
+	 * our workspace's lock protects it, as it is in use. */
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		if (setsid() < 0) {
+			err(EXIT_FAILURE, "setsid");
+		}
+
+		if (budgetstr != NULL) {
+			orm_collect(flags, budget);
+		}
+
+		if (intervalstr != NULL) {
+			struct dedup_stats stats;
+			orm_dedup_workspaces(true, interval, &stats);
+		}
+
+		exit(EXIT_SUCCESS);
+	}
+}
+
+/**
+ * Open the workspace's persistent hybrid directory, holding the lock
+ * and generation of its persistent objdir.
+ * @param workspace Workspace used.
+ * @return The directory's file descriptor.
+ */
+static int
+orm_hybrid_open(const char *workspace) {
+	char *hybriddir;
+
+	if (orm_workdir(workspace, "hybrid", ORM_WORKDIR_PERSISTENT, &hybriddir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup persistent hybrid directory");
+	}
+
+	const int hybridfd = open(hybriddir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (hybridfd < 0) {
+		err(EXIT_FAILURE, "open '%s'", hybriddir);
+	}
+	free(hybriddir);
+
+	return hybridfd;
+}
+
+/**
+ * Exclude hybrid builds from the workspace until the build ends, as it modifies
+ * their persistent objdir, and renew its generation so they seed from it again.
+ * Persistent builds share the lock, while hybrid builds hold it exclusively.
+ * @param workspace Workspace used.
+ */
+static void
+orm_persistent(const char *workspace) {
+	const int hybridfd = orm_hybrid_open(workspace);
+	char generation[ORM_GENERATION_LENGTH + 1];
+	uint64_t random;
+
+	/* Lock is deliberately leaked, and inherited by the build. */
+	const int lockfd = openat(hybridfd, "lock", O_RDWR | O_CREAT, 0600);
+	if (lockfd < 0 || flock(lockfd, LOCK_SH) != 0) {
+		err(EXIT_FAILURE, "Unable to lock persistent hybrid directory");
+	}
+
+	if (getrandom(&random, sizeof (random), 0) != sizeof (random)) {
+		err(EXIT_FAILURE, "getrandom");
+	}
+	snprintf(generation, sizeof (generation), "%016" PRIx64, random);
+
+	/* Generations all have the same size, concurrent builds can overwrite each other's. */
+	const int fd = openat(hybridfd, "generation", O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || pwrite(fd, generation, ORM_GENERATION_LENGTH, 0) != (ssize_t)ORM_GENERATION_LENGTH) {
+		err(EXIT_FAILURE, "Unable to write persistent objdir generation");
+	}
+	close(fd);
+	close(hybridfd);
+}
+
+/**
+ * Describe the sandbox to create from the command line options.
+ * @param args Command line options.
+ * @param bsysdir Directory of the bsys.
+ * @param description Description to fill.
+ */
+static void
+orm_describe(const struct orm_args *args, const char *bsysdir, struct orm_sandbox_description *description) {
+
+	*description = (struct orm_sandbox_description) {
+		.sysroot = args->sysroot, .bsysdir = bsysdir,
+		.destdir = args->destdir, .objdir = args->objdir,
+		.srcdir = args->srcdir,
+		.asroot = args->asroot, .rosysroot = !args->rwsysroot,
+		.rosrcdir = !args->rwsrcdir, .lean = args->lean,
+	};
+
+	/* The srcdir may not have been needed until now. */
+	if (description->srcdir == NULL) {
+		description->srcdir = orm_srcdir(NULL);
+		if (description->srcdir == NULL) {
+			err(EXIT_FAILURE, "Unable to lookup srcdir");
+		}
+	}
+
+	/* Use persistent-cache if requested. */
+	int flags = 0;
+	if (args->persistent) {
+		flags |= ORM_WORKDIR_PERSISTENT;
+	}
+
+	/* Mark the workspace as used, and protect it from collection while it is,
+	 * before resolving its workdirs, which collections could remove. */
+	orm_use(args->workspace, flags);
+	if (args->hybrid && !args->persistent) {
+		orm_use(args->workspace, ORM_WORKDIR_PERSISTENT);
+	}
+
+	/* Hybrid objdirs are built in the runtime directory. */
+	if (description->objdir == NULL) {
+		char *objdir;
+		if (orm_workdir(args->workspace, "obj", args->hybrid ? 0 : flags, &objdir) != 0) {
+			err(EXIT_FAILURE, "Unable to lookup objdir");
+		}
+		description->objdir = objdir;
+	}
+
+	if (description->destdir == NULL) {
+		char *destdir;
+		if (orm_workdir(args->workspace, "dest", flags, &destdir) != 0) {
+			err(EXIT_FAILURE, "Unable to lookup destdir");
+		}
+		description->destdir = destdir;
+	}
+
+	/* Resolve the toolchain's path. */
+	char *root;
+	if (orm_toolchain_path(args->toolchain, &root) != 0) {
+		err(EXIT_FAILURE, "Unable to find toolchain '%s'", args->toolchain);
+	}
+	description->root = root;
+
+	if (args->persistent && !args->hybrid && args->objdir == NULL) {
+		orm_persistent(args->workspace);
+	}
+}
+
+/**
+ * Connect to the running session of a workspace, if any.
+ * @param address Address of the session's socket.
+ * @param pidp Pointer to the session's process id.
+ * @return The connected socket, or -1 if no session is running.
+ */
+static int
+orm_session_connect(const struct sockaddr_un *address, pid_t *pidp) {
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct ucred credentials;
+	socklen_t length = sizeof (credentials);
+	char hello;
+
+	if (fd < 0) {
+		err(EXIT_FAILURE, "socket");
+	}
+
+	/* A session accepts its clients with a byte, it may be exiting if we don't get one. */
+	if (connect(fd, (const struct sockaddr *)address, sizeof (*address)) != 0
+		|| read(fd, &hello, sizeof (hello)) != sizeof (hello)) {
+		close(fd);
+		return -1;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+		err(EXIT_FAILURE, "getsockopt SO_PEERCRED");
+	}
+
+	*pidp = credentials.pid;
+
+	return fd;
+}
+
+/**
+ * Hold the sandbox of a session, until it had no client for timeout seconds.
+ * Each client is connected for as long as it runs a command in the sandbox.
+ * @param description Sandbox of the session.
+ * @param listenfd Bound socket of the session.
+ * @param readyfd Pipe signaled once the session accepts clients.
+ * @param timeout Idle timeout, in seconds.
+ * @return Never
+ */
+noreturn static void
+orm_session_serve(const struct orm_sandbox_description *description, int listenfd, int readyfd, unsigned int timeout) {
+	struct pollfd *fds = malloc(sizeof (*fds));
+	nfds_t count = 1;
+
+	/* Detach from the terminal, the session outlives the command which started it. */
+	if (setsid() < 0) {
+		err(EXIT_FAILURE, "setsid");
+	}
+
+	const int nullfd = open("/dev/null", O_RDWR);
+	if (nullfd < 0 || dup2(nullfd, STDIN_FILENO) < 0
+		|| dup2(nullfd, STDOUT_FILENO) < 0 || dup2(nullfd, STDERR_FILENO) < 0) {
+		err(EXIT_FAILURE, "Unable to redirect session to /dev/null");
+	}
+	close(nullfd);
+
+	if (fds == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (orm_sandbox(description, getuid(), getgid()) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Listen from the sandbox, clients find the namespaces to join from the listener's credentials. */
+	static const char listening;
+	if (listen(listenfd, SOMAXCONN) != 0 || write(readyfd, &listening, sizeof (listening)) != sizeof (listening)) {
+		exit(EXIT_FAILURE);
+	}
+	close(readyfd);
+
+	fds->fd = listenfd;
+	fds->events = POLLIN;
+
+	/* Idle only without clients, poll(2) takes milliseconds. */
+	const int timeoutms = timeout > INT_MAX / 1000 ? INT_MAX : (int)timeout * 1000;
+	int ready;
+	while (ready = poll(fds, count, count == 1 ? timeoutms : -1), ready != 0) {
+
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			exit(EXIT_FAILURE);
+		}
+
+		/* Disconnected clients are done running their command. */
+		for (nfds_t i = 1; i < count; i++) {
+			char byte;
+
+			if (fds[i].revents != 0 && read(fds[i].fd, &byte, sizeof (byte)) <= 0) {
+				close(fds[i].fd);
+				fds[i--] = fds[--count];
+			}
+		}
+
+		if (fds->revents & POLLIN) {
+			const int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+			static const char hello;
+			struct pollfd *newfds;
+
+			if (fd < 0) {
+				continue;
+			}
+
+			newfds = realloc(fds, (count + 1) * sizeof (*fds));
+			if (newfds == NULL || send(fd, &hello, sizeof (hello), MSG_NOSIGNAL) != sizeof (hello)) {
+				close(fd);
+				continue;
+			}
+			fds = newfds;
+
+			fds[count].fd = fd;
+			fds[count].events = POLLIN;
+			count++;
+		}
+	}
+
+	/* The socket stays behind, refusing connections until a new session replaces it. */
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Key a session's sandbox by the options it was started with, so invocations
+ * can check they would run the same one, without resolving it again.
+ * Unspecified workdirs are those of the workspace, thus keyed by it.
+ * @param args Command line options.
+ * @param bsysdir Directory of the bsys.
+ * @return The allocated key.
+ */
+static char *
+orm_session_key(const struct orm_args *args, const char *bsysdir) {
+	char *key;
+
+	if (asprintf(&key, "workspace=%s\ntoolchain=%s\nbsysdir=%s\nsysroot=%s\ndestdir=%s\nobjdir=%s\nsrcdir=%s\n"
+		"persistent=%u\nasroot=%u\nrwsysroot=%u\nrwsrcdir=%u\n",
+		args->workspace, args->toolchain, bsysdir, args->sysroot,
+		args->destdir != NULL ? args->destdir : "", args->objdir != NULL ? args->objdir : "",
+		args->srcdirset ? args->srcdir : "",
+		args->persistent, args->asroot, args->rwsysroot, args->rwsrcdir) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	return key;
+}
+
+/**
+ * Execute the bsys, or go interactive, in the workspace's session,
+ * starting the session if it isn't running yet. A running session
+ * must have been started with the same options, else we refuse to join it.
+ * Only starting a session resolves its sandbox, joining one stays cheap.
  * @param args Command line options.
+ * @param bsysdir Directory of the bsys, to start the session.
+ * @param bsysname The base name of the bsys, or NULL if interactive.
+ * @param argc Forwarded from main().
+ * @param argv Forwarded from main().
  * @return Never
  */
 noreturn static void
-orm_print_workdir(const struct orm_args *args) {
-	char *workdir;
-	int flags = 0;
+orm_session(const struct orm_args *args, const char *bsysdir, const char *bsysname, int argc, char **argv) {
+	struct orm_sandbox_description description = { .asroot = args->asroot };
+	char *sessiondir;
 
-	if (args->persistent) {
-		flags |= ORM_WORKDIR_PERSISTENT;
+	if (orm_workdir(args->workspace, "session", 0, &sessiondir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup session directory");
 	}
 
-	if (orm_workdir(args->workspace, args->workdir, flags, &workdir) != 0) {
-		err(EXIT_FAILURE, "Unable to lookup workdir '%s'", args->workdir);
+	static const char socketname[] = "/socket", lockname[] = "/lock", keyname[] = "/key";
+	const size_t sessiondirlen = strlen(sessiondir);
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	char lockpath[sessiondirlen + sizeof (lockname)];
+	char keypath[sessiondirlen + sizeof (keyname)];
+
+	if (sessiondirlen + sizeof (socketname) > sizeof (address.sun_path)) {
+		errx(EXIT_FAILURE, "Session directory '%s' is too long to hold a socket", sessiondir);
 	}
+	memcpy(mempcpy(address.sun_path, sessiondir, sessiondirlen), socketname, sizeof (socketname));
+	memcpy(mempcpy(lockpath, sessiondir, sessiondirlen), lockname, sizeof (lockname));
+	memcpy(mempcpy(keypath, sessiondir, sessiondirlen), keyname, sizeof (keyname));
 
-	puts(workdir);
+	char * const key = orm_session_key(args, bsysdir);
+	const size_t keylen = strlen(key);
 
-	exit(EXIT_SUCCESS);
+	/* Serialize session lookups, so only one session is started at a time. */
+	const int lockfd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0 || flock(lockfd, LOCK_EX) != 0) {
+		err(EXIT_FAILURE, "Unable to lock '%s'", lockpath);
+	}
+
+	pid_t pid;
+	int fd = orm_session_connect(&address, &pid);
+	if (fd >= 0) {
+		const int keyfd = open(keypath, O_RDONLY | O_CLOEXEC);
+		char current[keylen + 1];
+
+		if (keyfd < 0) {
+			err(EXIT_FAILURE, "open '%s'", keypath);
+		}
+
+		const ssize_t currentlen = read(keyfd, current, sizeof (current));
+		if (currentlen < 0) {
+			err(EXIT_FAILURE, "read '%s'", keypath);
+		}
+		close(keyfd);
+
+		if ((size_t)currentlen != keylen || memcmp(current, key, keylen) != 0) {
+			errx(EXIT_FAILURE, "Session in '%s' was started with other options, as listed in '%s'", sessiondir, keypath);
+		}
+	} else {
+		orm_describe(args, bsysdir, &description);
+
+
+		const int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (listenfd < 0) {
+			err(EXIT_FAILURE, "socket");
+		}
+
+		if (unlink(address.sun_path) != 0 && errno != ENOENT) {
+			err(EXIT_FAILURE, "unlink '%s'", address.sun_path);
+		}
+
+		if (bind(listenfd, (const struct sockaddr *)&address, sizeof (address)) != 0) {
+			err(EXIT_FAILURE, "bind '%s'", address.sun_path);
+		}
+
+		/* Written under the lock, before anyone can connect. */
+		const int keyfd = open(keypath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (keyfd < 0 || write(keyfd, key, keylen) != (ssize_t)keylen || close(keyfd) != 0) {
+			err(EXIT_FAILURE, "Unable to write '%s'", keypath);
+		}
+
+		int readyfds[2];
+		if (pipe2(readyfds, O_CLOEXEC) != 0) {
+			err(EXIT_FAILURE, "pipe");
+		}
+
+		const pid_t session = fork();
+		if (session < 0) {
+			err(EXIT_FAILURE, "fork");
+		}
+
+		if (session == 0) {
+			close(readyfds[0]);
+			close(lockfd);
+			orm_session_serve(&description, listenfd, readyfds[1], args->timeout);
+		}
+
+		close(readyfds[1]);
+		close(listenfd);
+
+		char ready;
+		if (read(readyfds[0], &ready, sizeof (ready)) != sizeof (ready)
+			|| (fd = orm_session_connect(&address, &pid)) < 0) {
+			errx(EXIT_FAILURE, "Unable to start session in '%s'", sessiondir);
+		}
+		close(readyfds[0]);
+	}
+
+	close(lockfd);
+	free(key);
+
+	/* Keep the connection to the session while the command runs in it. */
+	const pid_t child = fork();
+	if (child < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (child == 0) {
+		if (orm_sandbox_join(&description, pid) != 0) {
+			err(EXIT_FAILURE, "Unable to join session %d", pid);
+		}
+
+		orm_command(args, NULL, NULL, bsysname, argc, argv);
+	}
+
+	int wstatus;
+	if (waitpid(child, &wstatus, 0) < 0) {
+		err(EXIT_FAILURE, "waitpid");
+	}
+
+	orm_exit(wstatus);
 }
 
 /**
- * Execute the given bsys, or the user's shell if available.
+ * Execute the bsys, or go interactive, in a child process,
+ * for callers which still have work to do once it ended.
+ * @param args Command line options.
+ * @param description Sandbox description.
+ * @param warmup Warmup profile to record, or NULL.
+ * @param metrics Metrics to commit, or NULL.
  * @param bsysname The base name of the bsys, or NULL if interactive.
- * @param args Arguments to forward to the command.
- * @param count Number of arguments in args.
+ * @param argc Forwarded from main().
+ * @param argv Forwarded from main().
+ * @return The wait status of the child.
+ */
+static int
+orm_build(const struct orm_args *args, const struct orm_sandbox_description *description,
+	struct warmup *warmup, struct metrics *metrics, const char *bsysname, int argc, char **argv) {
+	const pid_t pid = fork();
+
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (orm_sandbox(description, getuid(), getgid()) != 0) {
+			err(EXIT_FAILURE, "Unable to enter toolbox");
+		}
+		metrics_record(metrics, METRICS_SANDBOX_SECONDS, metrics_elapsed(&start));
+
+		orm_command(args, warmup, metrics, bsysname, argc, argv);
+	}
+
+	/* Interruptions are for the command, we still have work to do. */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	int wstatus;
+	if (waitpid(pid, &wstatus, 0) < 0) {
+		err(EXIT_FAILURE, "waitpid");
+	}
+
+	return wstatus;
+}
+
+/**
+ * Read a generation of the persistent objdir.
+ * @param dirfd Directory of the generation.
+ * @param name Name of the generation.
+ * @param generation Generation read, empty if none.
+ */
+static void
+orm_hybrid_generation(int dirfd, const char *name, char generation[static ORM_GENERATION_LENGTH + 1]) {
+	const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	ssize_t length = 0;
+
+	if (fd >= 0) {
+		length = read(fd, generation, ORM_GENERATION_LENGTH);
+		close(fd);
+	}
+
+	if (fd < 0 ? errno != ENOENT : length < 0) {
+		err(EXIT_FAILURE, "Unable to read '%s'", name);
+	}
+
+	generation[length] = '\0';
+}
+
+/**
+ * Execute the bsys, or go interactive, with a hybrid objdir. The runtime objdir is seeded
+ * from the persistent one when it wasn't already, or when the persistent generation changed,
+ * and once the command ended, a background process writes its modifications back to the persistent one.
+ * The workspace's hybrid lock is held exclusively during both the build and the writeback,
+ * so the next hybrid or persistent build waits for the previous writeback to end.
+ * @param args Command line options.
+ * @param description Sandbox description, with the runtime objdir.
+ * @param warmup Warmup profile to record, or NULL.
+ * @param metrics Metrics to commit, or NULL.
+ * @param bsysname The base name of the bsys, or NULL if interactive.
+ * @param argc Forwarded from main().
+ * @param argv Forwarded from main().
  * @return Never
  */
 noreturn static void
-orm_exec(const char *bsysname, char **args, int count) {
-	char *argv[3 + count];
-	int argc = 0;
+orm_hybrid(const struct orm_args *args, const struct orm_sandbox_description *description,
+	struct warmup *warmup, struct metrics *metrics, const char *bsysname, int argc, char **argv) {
+	char *hybriddir, *objdir;
 
-	if (bsysname != NULL) {
-		static const char bsysdir[] = "/var/bsys/";
-		const size_t bsysnamelen = strlen(bsysname);
-		char * const bsys = alloca(sizeof (bsysdir) + bsysnamelen);
+	if (orm_workdir(args->workspace, "hybrid", 0, &hybriddir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup hybrid directory");
+	}
 
-		memcpy(bsys, bsysdir, sizeof (bsysdir) - 1);
-		memcpy(bsys + sizeof (bsysdir) - 1, bsysname, bsysnamelen + 1);
+	if (orm_workdir(args->workspace, "obj", ORM_WORKDIR_PERSISTENT, &objdir) != 0) {
+		err(EXIT_FAILURE, "Unable to lookup persistent objdir");
+	}
 
-		argv[argc++] = bsys;
-	} else {
-		char *shell = getenv("SHELL");
+	const int hybridfd = open(hybriddir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (hybridfd < 0) {
+		err(EXIT_FAILURE, "open '%s'", hybriddir);
+	}
 
-		if (shell == NULL || access(shell, X_OK) != 0) {
-			shell = "/bin/sh";
+	/* The lock is persistent, as persistent builds don't need a runtime directory. */
+	const int persistentfd = orm_hybrid_open(args->workspace);
+	const int lockfd = openat(persistentfd, "lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0 || flock(lockfd, LOCK_EX) != 0) {
+		err(EXIT_FAILURE, "Unable to lock persistent hybrid directory");
+	}
+
+	/* The runtime directory is lost on reboot, and the stamp with it,
+	 * persistent builds renew the generation the stamp must match. */
+	char generation[ORM_GENERATION_LENGTH + 1], seeded[ORM_GENERATION_LENGTH + 1];
+	orm_hybrid_generation(persistentfd, "generation", generation);
+	orm_hybrid_generation(hybridfd, "seeded", seeded);
+	close(persistentfd);
+
+	if (faccessat(hybridfd, "seeded", F_OK, 0) != 0 || strcmp(generation, seeded) != 0) {
+		if (unlinkat(hybridfd, "seeded", 0) != 0 && errno != ENOENT) {
+			err(EXIT_FAILURE, "unlinkat '%s/seeded'", hybriddir);
+		}
+
+		mirror(objdir, description->objdir);
+
+		const int stampfd = openat(hybridfd, "seeded", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (stampfd < 0 || write(stampfd, generation, strlen(generation)) < 0 || close(stampfd) != 0) {
+			err(EXIT_FAILURE, "Unable to create '%s/seeded'", hybriddir);
 		}
-		argv[argc++] = shell;
-		argv[argc++] = "-i";
 	}
+	close(hybridfd);
 
-	while (count != 0) {
-		argv[argc++] = *args++;
-		count--;
+	const int wstatus = orm_build(args, description, warmup, metrics, bsysname, argc, argv);
+
+	/* The writeback inherits the lock, and releases it when done. */
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
 	}
-	argv[argc] = NULL;
 
-	execv(*argv, argv);
+	if (pid == 0) {
+		if (setsid() < 0) {
+			err(EXIT_FAILURE, "setsid");
+		}
 
-	err(EXIT_FAILURE, "execv '%s'", *argv);
+		mirror(description->objdir, objdir);
+
+		exit(EXIT_SUCCESS);
+	}
+
+	orm_exit(wstatus);
 }
 
 /**
- * Setup the sandbox and execute the bsys, or go interactive.
+ * Execute the bsys, or go interactive, in a private clone of the objdir, created
+ * next to it. Where the filesystem shares extents, the clone is a copy of the objdir,
+ * else it is overlaid on the objdir, only holding its modifications. The clone is either
+ * removed in the background once the command ended, or, when promoting and the command
+ * succeeded, atomically exchanged with the objdir, or merged into it when overlaid.
+ * Clones are created while sharing the objdir's lock, overlaid ones keep sharing it
+ * until their command ended, and promotions hold it exclusively.
  * @param args Command line options.
+ * @param description Sandbox description, its objdir is replaced with the clone.
+ * @param warmup Warmup profile to record, or NULL.
+ * @param metrics Metrics to commit, or NULL.
+ * @param bsysname The base name of the bsys, or NULL if interactive.
  * @param argc Forwarded from main().
  * @param argv Forwarded from main().
  * @return Never
  */
 noreturn static void
-orm_run(const struct orm_args *args, int argc, char **argv) {
-	struct orm_sandbox_description description = {
-		.sysroot = args->sysroot, .destdir = args->destdir,
-		.objdir = args->objdir, .srcdir = args->srcdir,
-		.asroot = args->asroot, .rosysroot = !args->rwsysroot,
-		.rosrcdir = !args->rwsrcdir,
-	};
+orm_clone(const struct orm_args *args, struct orm_sandbox_description *description,
+	struct warmup *warmup, struct metrics *metrics, const char *bsysname, int argc, char **argv) {
+	static const char lockext[] = ".lock", cloneext[] = ".XXXXXX", upperext[] = "/upper", workext[] = "/work";
+	const char * const objdir = description->objdir;
+	const size_t objdirlen = strlen(objdir), clonedirlen = objdirlen + sizeof (cloneext) - 1;
+	char lockpath[objdirlen + sizeof (lockext)], * const clonedir = malloc(clonedirlen + 1);
+	char upperdir[clonedirlen + sizeof (upperext)], workdir[clonedirlen + sizeof (workext)];
 
-	/* Use persistent-cache if requested. */
-	int flags = 0;
-	if (args->persistent) {
-		flags |= ORM_WORKDIR_PERSISTENT;
+	if (clonedir == NULL) {
+		err(EXIT_FAILURE, "malloc");
 	}
+	memcpy(mempcpy(lockpath, objdir, objdirlen), lockext, sizeof (lockext));
+	memcpy(mempcpy(clonedir, objdir, objdirlen), cloneext, sizeof (cloneext));
 
-	if (description.objdir == NULL) {
-		char *objdir;
-		if (orm_workdir(args->workspace, "obj", flags, &objdir) != 0) {
-			err(EXIT_FAILURE, "Unable to lookup objdir");
+	const int lockfd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd < 0 || flock(lockfd, LOCK_SH) != 0) {
+		err(EXIT_FAILURE, "Unable to lock '%s'", lockpath);
+	}
+
+	if (mkdtemp(clonedir) == NULL) {
+		err(EXIT_FAILURE, "mkdtemp '%s'", clonedir);
+	}
+	memcpy(mempcpy(upperdir, clonedir, clonedirlen), upperext, sizeof (upperext));
+	memcpy(mempcpy(workdir, clonedir, clonedirlen), workext, sizeof (workext));
+
+	/* Without shared extents, copies would duplicate the whole objdir. */
+	const bool overlay = !mirror_reflinks(clonedir);
+	if (overlay) {
+		if (mkdir(upperdir, 0700) != 0 || mkdir(workdir, 0700) != 0) {
+			err(EXIT_FAILURE, "Unable to create overlay directories in '%s'", clonedir);
+		}
+
+		description->objupperdir = clonedir;
+	} else {
+		mirror(objdir, clonedir);
+
+		if (flock(lockfd, LOCK_UN) != 0) {
+			err(EXIT_FAILURE, "Unable to unlock '%s'", lockpath);
 		}
-		description.objdir = objdir;
+
+		description->objdir = clonedir;
 	}
 
-	if (description.destdir == NULL) {
-		char *destdir;
-		if (orm_workdir(args->workspace, "dest", flags, &destdir) != 0) {
-			err(EXIT_FAILURE, "Unable to lookup destdir");
+	const int wstatus = orm_build(args, description, warmup, metrics, bsysname, argc, argv);
+
+	if (args->promote) {
+		if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EXIT_SUCCESS) {
+			if (flock(lockfd, LOCK_EX) != 0) {
+				err(EXIT_FAILURE, "Unable to lock '%s'", lockpath);
+			}
+
+			/* The previous objdir takes the clone's place, and is removed,
+			 * or receives the overlay's modifications, once no overlay uses it. */
+			if (overlay) {
+				mirror_merge(upperdir, objdir);
+			} else if (renameat2(AT_FDCWD, clonedir, AT_FDCWD, objdir, RENAME_EXCHANGE) != 0) {
+				err(EXIT_FAILURE, "Unable to promote '%s' to '%s'", clonedir, objdir);
+			}
+
+			if (flock(lockfd, LOCK_UN) != 0) {
+				err(EXIT_FAILURE, "Unable to unlock '%s'", lockpath);
+			}
+		} else {
+			warnx("Build failed, not promoting '%s'", clonedir);
 		}
-		description.destdir = destdir;
 	}
+	close(lockfd);
 
-	/* Resolve the toolchain's path. */
-	char *root;
-	if (orm_toolchain_path(args->toolchain, &root) != 0) {
-		err(EXIT_FAILURE, "Unable to find toolchain '%s'", args->toolchain);
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		if (setsid() < 0) {
+			err(EXIT_FAILURE, "setsid");
+		}
+
+		mirror_remove(AT_FDCWD, clonedir);
+
+		exit(EXIT_SUCCESS);
 	}
-	description.root = root;
+
+	orm_exit(wstatus);
+}
+
+/**
+ * Setup the sandbox and execute the bsys, or go interactive.
+ * @param args Command line options.
+ * @param argc Forwarded from main().
+ * @param argv Forwarded from main().
+ * @return Never
+ */
+noreturn static void
+orm_run(const struct orm_args *args, int argc, char **argv) {
+	struct orm_sandbox_description description;
 
 	/* If bsys is a path (relative or not), use it directly,
 	 * else, search the user's configurations for our bsys. */
@@ -140,7 +1377,7 @@ orm_run(const struct orm_args *args, int argc, char **argv) {
 	} else if (orm_bsys_path(args->bsys, &bsyspath) != 0) {
 		err(EXIT_FAILURE, "Unable to find bsys '%s'", args->bsys);
 	}
-	description.bsysdir = dirname(strdupa(bsyspath));
+	const char * const bsysdir = dirname(strdupa(bsyspath));
 
 	char *bsysname;
 	if (!args->interactive) {
@@ -149,21 +1386,54 @@ orm_run(const struct orm_args *args, int argc, char **argv) {
 		bsysname = NULL;
 	}
 
+	/* Reuse the workspace's session, if requested. */
+	if (args->timeout != 0) {
+		orm_session(args, bsysdir, bsysname, argc, argv);
+	}
+
+	orm_describe(args, bsysdir, &description);
+
+	/* Warm the page cache up while setting up, or record what to warm.
+	 * Watching never ends, so its profile would never be committed,
+	 * and an interactive shell's accesses are no build's. */
+	struct warmup * const warmup = !args->watch && bsysname != NULL ?
+		warmup_start(description.root, description.sysroot) : NULL;
+
+	/* Only builds are counted, watch mode never ends. */
+	struct metrics * const metrics = !args->watch && bsysname != NULL ? metrics_open("orm", args->toolchain) : NULL;
+
+	if (args->snapshot) {
+		orm_snapshot(args, description.srcdir, description.objdir);
+	}
+
+	if (args->hybrid) {
+		orm_hybrid(args, &description, warmup, metrics, bsysname, argc, argv);
+	}
+
+	if (args->clone) {
+		orm_clone(args, &description, warmup, metrics, bsysname, argc, argv);
+	}
+
 	/* Enter the sandbox, as we don't need anything from the system now. */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (orm_sandbox(&description, getuid(), getgid()) != 0) {
 		err(EXIT_FAILURE, "Unable to enter toolbox");
 	}
+	metrics_record(metrics, METRICS_SANDBOX_SECONDS, metrics_elapsed(&start));
 
 	/* Execute either the bsys or the shell. */
-	orm_exec(bsysname, argv + optind, argc - optind);
+	orm_command(args, warmup, metrics, bsysname, argc, argv);
 }
 
 noreturn static void
 orm_usage(const char *progname, int status) {
 
 	fprintf(stderr,
-		"usage: %1$s [-PSUir] [-t <toolchain>] [-b <bsys>] [-w <workspace>] [-u <sysroot>] [-d <destdir>] [-o <objdir>] [-s <srcdir>] [<arguments>...]\n"
+		"usage: %1$s [-PSUirWHcCBl] [-k <timeout>] [-t <toolchain>] [-b <bsys>] [-w <workspace>] [-u <sysroot>] [-d <destdir>] [-o <objdir>] [-s <srcdir>] [<arguments>...]\n"
 		"       %1$s [-P] [-w <workspace>] [-s <srcdir>] -p <workdir>\n"
+		"       %1$s -D\n"
+		"       %1$s [-P] -g <budget>\n"
 		"       %1$s -h\n",
 		progname);
 
@@ -180,7 +1450,7 @@ orm_parse_args(int argc, char **argv) {
 	};
 	int c;
 
-	while ((c = getopt(argc, argv, ":hPSUirt:b:w:u:d:o:s:p:")) >= 0) {
+	while ((c = getopt(argc, argv, ":hPSUirWHcCBDlk:g:t:b:w:u:d:o:s:p:")) >= 0) {
 		switch (c) {
 		case 'h': orm_usage(*argv, EXIT_SUCCESS);
 		case 'P': args.persistent = 1; break;
@@ -188,6 +1458,29 @@ orm_parse_args(int argc, char **argv) {
 		case 'U': args.rwsysroot = 1; break;
 		case 'i': args.interactive = 1; break;
 		case 'r': args.asroot = 1; break;
+		case 'W': args.watch = 1; break;
+		case 'H': args.hybrid = 1; break;
+		case 'c': args.clone = 1; break;
+		case 'C': args.clone = 1; args.promote = 1; break;
+		case 'B': args.snapshot = 1; break;
+		case 'D': args.dedup = 1; break;
+		case 'l': args.lean = 1; break;
+		case 'k': {
+			char *end;
+			const unsigned long timeout = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || timeout == 0 || timeout > UINT_MAX / 1000) {
+				warnx("Invalid session timeout '%s'", optarg);
+				orm_usage(*argv, EXIT_FAILURE);
+			}
+			args.timeout = timeout;
+		} break;
+		case 'g':
+			if (orm_size(optarg, &args.budget) != 0) {
+				warnx("Invalid workspaces budget '%s'", optarg);
+				orm_usage(*argv, EXIT_FAILURE);
+			}
+			args.collect = 1;
+			break;
 		case 't': args.toolchain = optarg; break;
 		case 'b': args.bsys = optarg; break;
 		case 'w': args.workspace = optarg; break;
@@ -205,24 +1498,23 @@ orm_parse_args(int argc, char **argv) {
 		}
 	}
 
-	/* No need to resolve a srcdir if we are just
-	 * here for a workdir and workspace is already specified.
-	 * This allows this synopsis to run without executing srccmd. */
-	if (args.workdir == NULL || args.workspace == NULL) {
-		/* Resolve the given (or not) source directory into
-		 * an absolute path, either with cmdpath() or realpath(3). */
-		if (args.srcdir == NULL) {
-			const char *srccmd = getenv("ORM_SRCDIR_COMMAND");
-
-			if (srccmd == NULL) {
-				srccmd = CONFIG_DEFAULT_SRCDIR_COMMAND;
-			}
+	/* Deduplication and collection are about all workspaces. */
+	if (args.dedup || args.collect) {
+		return args;
+	}
 
-			args.srcdir = cmdpath(srccmd);
-		} else {
-			args.srcdir = realpath(args.srcdir, NULL);
+	/* No need to resolve a srcdir if we are just here for a workdir, or for a
+	 * session, which resolves it only when started, and workspace is already
+	 * specified. This allows these synopses to run without executing srccmd. */
+	args.srcdirset = args.srcdir != NULL;
+	if ((args.workdir == NULL && args.timeout == 0) || args.workspace == NULL) {
+		args.srcdir = orm_srcdir(args.srcdir);
+		if (args.srcdir == NULL) {
+			warn("Unable to lookup srcdir");
+			orm_usage(*argv, EXIT_FAILURE);
 		}
-
+	} else if (args.srcdir != NULL) {
+		args.srcdir = realpath(args.srcdir, NULL);
 		if (args.srcdir == NULL) {
 			warn("Unable to lookup srcdir");
 			orm_usage(*argv, EXIT_FAILURE);
@@ -242,6 +1534,31 @@ orm_parse_args(int argc, char **argv) {
 		orm_usage(*argv, EXIT_FAILURE);
 	}
 
+	if (args.watch && args.interactive) {
+		warnx("Unable to watch sources in an interactive shell");
+		orm_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.hybrid && (args.objdir != NULL || args.timeout != 0)) {
+		warnx("Hybrid objdir is incompatible with an explicit objdir or a session");
+		orm_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.clone && (args.hybrid || args.objdir != NULL || args.timeout != 0)) {
+		warnx("Cloned objdir is incompatible with a hybrid or explicit objdir, or a session");
+		orm_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.snapshot && (args.objdir != NULL || args.timeout != 0)) {
+		warnx("Snapshots are incompatible with an explicit objdir or a session");
+		orm_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.lean && args.timeout != 0) {
+		warnx("Lean sandboxes are incompatible with sessions");
+		orm_usage(*argv, EXIT_FAILURE);
+	}
+
 	if (args.toolchain == NULL) {
 		args.toolchain = "default";
 	}
@@ -265,5 +1582,14 @@ main(int argc, char *argv[]) {
 		orm_print_workdir(&args);
 	}
 
+	if (args.dedup) {
+		orm_dedup();
+	}
+
+	if (args.collect) {
+		orm_collect(args.persistent ? ORM_WORKDIR_PERSISTENT : 0, args.budget);
+		exit(EXIT_SUCCESS);
+	}
+
 	orm_run(&args, argc, argv);
 }